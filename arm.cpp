@@ -4,6 +4,37 @@
 #include <iterator>
 #include <cassert>
 #include <iostream>
+#include <vector>
+#include <unordered_map>
+#include <cstddef>
+#include <stdexcept>
+#include <chrono>
+#include <string_view>
+#include <string>
+#include <memory>
+#include <cstring>
+#include <bit>
+#include <type_traits>
+#include <thread>
+#include <mutex>
+#include <deque>
+#include <atomic>
+#include <optional>
+#include <limits>
+#include <utility>
+#include <sstream>
+
+#ifdef __unix__
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <elf.h>
+#endif
+
+#if defined(__x86_64__) && defined(__unix__)
+#define ARM_JIT_SUPPORTED 1
+#endif
 
 template<typename Type, typename CRTP> struct Strongly_Typed
 {
@@ -24,6 +55,20 @@ protected:
   std::uint32_t m_val;
 };
 
+// Host side word access to guest memory, which is little endian
+[[nodiscard]] inline std::uint32_t load_word(const std::uint8_t *bytes) noexcept
+{
+  static_assert(std::endian::native == std::endian::little);
+  std::uint32_t value;
+  std::memcpy(&value, bytes, sizeof(value));
+  return value;
+}
+
+inline void store_word(std::uint8_t *bytes, const std::uint32_t value) noexcept
+{
+  std::memcpy(bytes, &value, sizeof(value));
+}
+
 enum class Condition {
   EQ = 0b0000,  // Z set (equal)
   NE = 0b0001,  // Z clear (not equal)
@@ -76,6 +121,9 @@ struct Instruction : Strongly_Typed<std::uint32_t, Instruction>
   friend struct Data_Processing;
   friend struct Single_Data_Transfer;
   friend struct Multiply_Long;
+  friend struct Multiply;
+  friend struct Block_Data_Transfer;
+  friend struct Halfword_Data_Transfer;
 };
 
 struct Single_Data_Transfer : Strongly_Typed<std::uint32_t, Single_Data_Transfer>
@@ -98,7 +146,7 @@ struct Single_Data_Transfer : Strongly_Typed<std::uint32_t, Single_Data_Transfer
   [[nodiscard]] constexpr auto offset_register() const noexcept { return offset() & 0b1111; }
   [[nodiscard]] constexpr auto offset_shift() const noexcept { return offset() >> 4; }
   [[nodiscard]] constexpr auto offset_shift_type() const noexcept { return static_cast<Shift_Type>((offset_shift() >> 1) & 0b11); }
-  [[nodiscard]] constexpr auto offset_shift_amount() const noexcept { return offset_shift() >> 4; }
+  [[nodiscard]] constexpr auto offset_shift_amount() const noexcept { return offset_shift() >> 3; }
 };
 
 struct Multiply_Long : Strongly_Typed<std::uint32_t, Multiply_Long>
@@ -107,7 +155,8 @@ struct Multiply_Long : Strongly_Typed<std::uint32_t, Multiply_Long>
     : Strongly_Typed{ ins.m_val } {}
 
 
-  [[nodiscard]] constexpr bool unsigned_mul() const noexcept { return bit_set(22); }
+  // SMULL / SMLAL, rather than UMULL / UMLAL
+  [[nodiscard]] constexpr bool signed_mul() const noexcept { return bit_set(22); }
   [[nodiscard]] constexpr bool accumulate() const noexcept { return bit_set(21); }
   [[nodiscard]] constexpr bool status_register_update() const noexcept { return bit_set(20); }
   [[nodiscard]] constexpr auto high_result() const noexcept { return (m_val >> 16) & 0b1111; }
@@ -117,11 +166,75 @@ struct Multiply_Long : Strongly_Typed<std::uint32_t, Multiply_Long>
 
 };
 
+struct Multiply : Strongly_Typed<std::uint32_t, Multiply>
+{
+  constexpr Multiply(Instruction ins) noexcept
+    : Strongly_Typed{ ins.m_val } {}
+
+
+  [[nodiscard]] constexpr bool accumulate() const noexcept { return bit_set(21); }
+  [[nodiscard]] constexpr bool set_condition_code() const noexcept { return bit_set(20); }
+  [[nodiscard]] constexpr auto destination_register() const noexcept { return (m_val >> 16) & 0b1111; }
+  [[nodiscard]] constexpr auto accumulate_register() const noexcept { return (m_val >> 12) & 0b1111; }
+  [[nodiscard]] constexpr auto operand_1() const noexcept { return (m_val >> 8) & 0b1111; }
+  [[nodiscard]] constexpr auto operand_2() const noexcept { return m_val & 0b1111; }
+};
+
+struct Block_Data_Transfer : Strongly_Typed<std::uint32_t, Block_Data_Transfer>
+{
+  constexpr Block_Data_Transfer(Instruction ins) noexcept
+    : Strongly_Typed{ ins.m_val } {}
+
+
+  [[nodiscard]] constexpr bool pre_indexing() const noexcept { return bit_set(24); }
+  [[nodiscard]] constexpr bool up_indexing() const noexcept { return bit_set(23); }
+  [[nodiscard]] constexpr bool psr_force_user() const noexcept { return bit_set(22); }
+  [[nodiscard]] constexpr bool write_back() const noexcept { return bit_set(21); }
+  [[nodiscard]] constexpr bool load() const noexcept { return bit_set(20); }
+
+  [[nodiscard]] constexpr auto base_register() const noexcept { return (m_val >> 16) & 0b1111; }
+  [[nodiscard]] constexpr auto register_list() const noexcept { return m_val & 0xFFFF; }
+  [[nodiscard]] constexpr bool transfers(const std::uint32_t reg) const noexcept { return bit_set(reg); }
+
+  [[nodiscard]] constexpr std::uint32_t register_count() const noexcept
+  {
+    auto list = register_list();
+    std::uint32_t count = 0;
+    while (list) {
+      ++count;
+      list &= (list - 1);
+    }
+    return count;
+  }
+};
+
+// LDRH / STRH / LDRSB / LDRSH, added in ARMv4 alongside Thumb
+struct Halfword_Data_Transfer : Strongly_Typed<std::uint32_t, Halfword_Data_Transfer>
+{
+  constexpr Halfword_Data_Transfer(Instruction ins) noexcept
+    : Strongly_Typed{ ins.m_val } {}
+
+
+  [[nodiscard]] constexpr bool pre_indexing() const noexcept { return bit_set(24); }
+  [[nodiscard]] constexpr bool up_indexing() const noexcept { return bit_set(23); }
+  [[nodiscard]] constexpr bool immediate_offset() const noexcept { return bit_set(22); }
+  [[nodiscard]] constexpr bool write_back() const noexcept { return bit_set(21); }
+  [[nodiscard]] constexpr bool load() const noexcept { return bit_set(20); }
+  [[nodiscard]] constexpr bool signed_transfer() const noexcept { return bit_set(6); }
+  [[nodiscard]] constexpr bool halfword() const noexcept { return bit_set(5); }
+
+  [[nodiscard]] constexpr auto base_register() const noexcept { return (m_val >> 16) & 0b1111; }
+  [[nodiscard]] constexpr auto src_dest_register() const noexcept { return (m_val >> 12) & 0b1111; }
+  [[nodiscard]] constexpr auto offset() const noexcept { return ((m_val >> 4) & 0xF0) | (m_val & 0xF); }
+  [[nodiscard]] constexpr auto offset_register() const noexcept { return m_val & 0b1111; }
+};
+
 struct Data_Processing : Strongly_Typed<std::uint32_t, Data_Processing>
 {
   constexpr Data_Processing(Instruction ins) noexcept
     : Strongly_Typed{ ins.m_val } {}
 
+
   [[nodiscard]] constexpr OpCode get_opcode() const noexcept
   {
     return static_cast<OpCode>(0b1111 & (m_val >> 21));
@@ -138,22 +251,19 @@ struct Data_Processing : Strongly_Typed<std::uint32_t, Data_Processing>
 
   [[nodiscard]] constexpr auto operand_2_immediate() const noexcept
   {
-    const auto op_2         = operand_2();
-    const std::int8_t value = 0b1111'1111 & op_2;
-
-    // I believe this is defined behavior
-    const auto sign_extended_value = static_cast<std::uint32_t>(static_cast<uint32_t>(value));
+    const auto op_2  = operand_2();
+    const auto value = static_cast<std::uint32_t>(0b1111'1111 & op_2);
 
     const auto shift_right = (op_2 >> 8) * 2;
 
     // Avoiding UB for shifts >= size
     if (shift_right == 0 || shift_right == 32) {
-      return static_cast<std::uint32_t>(sign_extended_value);
+      return value;
     }
 
     // Should create a ROR on any modern compiler.
     // no branching, CMOV on GCC
-    return (sign_extended_value >> shift_right) | (sign_extended_value << (32 - shift_right));
+    return (value >> shift_right) | (value << (32 - shift_right));
   }
 
   constexpr auto destination_register() const noexcept { return 0b1111 & (m_val >> 12); }
@@ -166,6 +276,18 @@ struct Data_Processing : Strongly_Typed<std::uint32_t, Data_Processing>
 };
 
 
+[[nodiscard]] constexpr std::int32_t branch_offset(const Instruction instruction) noexcept
+{
+  if (instruction.bit_set(23)) {
+    // is signed
+    const auto twos_compliment = ((~(instruction & 0x00FFFFFFF)) + 1) & 0x00FFFFFF;
+    return -(twos_compliment << 2);
+  } else {
+    return (instruction & 0x00FFFFFF) << 2;
+  }
+}
+
+
 enum class Instruction_Type {
   Data_Processing,
   MRS,
@@ -181,10 +303,53 @@ enum class Instruction_Type {
   Coprocessor_Data_Transfer,
   Coprocessor_Data_Operation,
   Coprocessor_Register_Transfer,
-  Software_Interrupt
+  Software_Interrupt,
+  Halfword_Data_Transfer,
+  Branch_Exchange,
+  // Thumb operations with no ARM equivalent, see get_thumb_table()
+  Thumb_Branch,
+  Thumb_Branch_Link,
+  Thumb_PC_Relative
 };
 
 
+[[nodiscard]] constexpr std::string_view to_string(const Instruction_Type type) noexcept
+{
+  switch (type) {
+  case Instruction_Type::Data_Processing: return "Data_Processing";
+  case Instruction_Type::MRS: return "MRS";
+  case Instruction_Type::MSR: return "MSR";
+  case Instruction_Type::MSRF: return "MSRF";
+  case Instruction_Type::Multiply: return "Multiply";
+  case Instruction_Type::Multiply_Long: return "Multiply_Long";
+  case Instruction_Type::Single_Data_Swap: return "Single_Data_Swap";
+  case Instruction_Type::Single_Data_Transfer: return "Single_Data_Transfer";
+  case Instruction_Type::Undefined: return "Undefined";
+  case Instruction_Type::Block_Data_Transfer: return "Block_Data_Transfer";
+  case Instruction_Type::Branch: return "Branch";
+  case Instruction_Type::Coprocessor_Data_Transfer: return "Coprocessor_Data_Transfer";
+  case Instruction_Type::Coprocessor_Data_Operation: return "Coprocessor_Data_Operation";
+  case Instruction_Type::Coprocessor_Register_Transfer: return "Coprocessor_Register_Transfer";
+  case Instruction_Type::Software_Interrupt: return "Software_Interrupt";
+  case Instruction_Type::Halfword_Data_Transfer: return "Halfword_Data_Transfer";
+  case Instruction_Type::Branch_Exchange: return "Branch_Exchange";
+  case Instruction_Type::Thumb_Branch: return "Thumb_Branch";
+  case Instruction_Type::Thumb_Branch_Link: return "Thumb_Branch_Link";
+  case Instruction_Type::Thumb_PC_Relative: return "Thumb_PC_Relative";
+  }
+  return "Unknown";
+}
+
+[[nodiscard]] constexpr std::string_view to_string(const OpCode opcode) noexcept
+{
+  constexpr std::array<std::string_view, 16> names{ "AND", "EOR", "SUB", "RSB", "ADD", "ADC", "SBC", "RSC",
+                                                    "TST", "TEQ", "CMP", "CMN", "ORR", "MOV", "BIC", "MVN" };
+  return names[static_cast<std::size_t>(opcode)];
+}
+
+constexpr std::size_t instruction_type_count = static_cast<std::size_t>(Instruction_Type::Thumb_PC_Relative) + 1;
+
+
 [[nodiscard]] constexpr auto get_lookup_table() noexcept
 {
   // hack for lack of constexpr std::bitset
@@ -213,7 +378,8 @@ enum class Instruction_Type {
   };
 
   // ARMv3  http://netwinder.osuosl.org/pub/netwinder/docs/arm/ARM7500FEvB_3.pdf
-  std::array<std::tuple<std::uint32_t, std::uint32_t, Instruction_Type>, 15> table{
+  // plus the ARMv4T additions: BX and halfword transfers
+  std::array<std::tuple<std::uint32_t, std::uint32_t, Instruction_Type>, 18> table{
     { { 0b0000'1100'0000'0000'0000'0000'0000'0000, 0b0000'0000'0000'0000'0000'0000'0000'0000, Instruction_Type::Data_Processing },
       { 0b0000'1111'1011'1111'0000'1111'1111'1111, 0b0000'0001'0000'1111'0000'1111'1111'1111, Instruction_Type::MRS },
       { 0b0000'1111'1011'1111'1111'1111'1111'0000, 0b0000'0001'0010'1001'1111'0000'0000'0000, Instruction_Type::MSR },
@@ -223,12 +389,15 @@ enum class Instruction_Type {
       { 0b0000'1111'1011'0000'0000'1111'1111'0000, 0b0000'0001'0000'0000'0000'0000'1001'0000, Instruction_Type::Single_Data_Swap },
       { 0b0000'1100'0000'0000'0000'0000'0000'0000, 0b0000'0100'0000'0000'0000'0000'0000'0000, Instruction_Type::Single_Data_Transfer },
       { 0b0000'1110'0000'0000'0000'0000'0001'0000, 0b0000'0110'0000'0000'0000'0000'0001'0000, Instruction_Type::Undefined },
-      { 0b0000'1110'0000'0000'0000'0000'0000'0000, 0b0000'1110'0000'0000'0000'0000'0000'0000, Instruction_Type::Block_Data_Transfer },
+      { 0b0000'1110'0000'0000'0000'0000'0000'0000, 0b0000'1000'0000'0000'0000'0000'0000'0000, Instruction_Type::Block_Data_Transfer },
       { 0b0000'1110'0000'0000'0000'0000'0000'0000, 0b0000'1010'0000'0000'0000'0000'0000'0000, Instruction_Type::Branch },
       { 0b0000'1110'0000'0000'0000'0000'1111'0000, 0b0000'1100'0010'0000'0000'0000'0000'0000, Instruction_Type::Coprocessor_Data_Transfer },
       { 0b0000'1111'0000'0000'0000'0000'0001'0000, 0b0000'1110'0000'0000'0000'0000'0000'0000, Instruction_Type::Coprocessor_Data_Operation },
       { 0b0000'1111'0000'0000'0000'0000'0001'0000, 0b0000'1110'0000'0000'0000'0000'0001'0000, Instruction_Type::Coprocessor_Register_Transfer },
-      { 0b0000'1111'0000'0000'0000'0000'0000'0000, 0b0000'1111'0000'0000'0000'0000'0000'0000, Instruction_Type::Software_Interrupt } }
+      { 0b0000'1111'0000'0000'0000'0000'0000'0000, 0b0000'1111'0000'0000'0000'0000'0000'0000, Instruction_Type::Software_Interrupt },
+      { 0b0000'1111'1111'1111'1111'1111'1111'0000, 0b0000'0001'0010'1111'1111'1111'0001'0000, Instruction_Type::Branch_Exchange },
+      { 0b0000'1110'0000'0000'0000'0000'1011'0000, 0b0000'0000'0000'0000'0000'0000'1011'0000, Instruction_Type::Halfword_Data_Transfer },
+      { 0b0000'1110'0000'0000'0000'0000'1101'0000, 0b0000'0000'0000'0000'0000'0000'1101'0000, Instruction_Type::Halfword_Data_Transfer } }
   };
 
   // Order from most restrictive to least restrictive
@@ -240,542 +409,5521 @@ enum class Instruction_Type {
   return table;
 }
 
+// The instruction type for every combination of bits 27-20 and 7-4, which
+// decide it for nearly all instructions. Combinations where other bits
+// matter too (MRS / MSR, swaps, BX) are marked for a full search.
+constexpr std::uint8_t needs_search = 0xFF;
 
-template<std::size_t RAMSize = 1024> struct System
+[[nodiscard]] constexpr auto get_arm_decode_table() noexcept
 {
-  std::uint32_t CSPR{};
+  constexpr auto lookup_table = get_lookup_table();
+  constexpr std::uint32_t key_bits = 0b0000'1111'1111'0000'0000'0000'1111'0000;
 
-  std::array<std::uint32_t, 16> registers{};
-  std::array<std::uint8_t, RAMSize> RAM{};
+  std::array<std::uint8_t, 4096> table{};
+  for (std::uint32_t key = 0; key < table.size(); ++key) {
+    const auto instruction = ((key & 0xFF0) << 16) | ((key & 0xF) << 4);
 
-  [[nodiscard]] constexpr auto &PC() noexcept { return registers[15]; }
-  [[nodiscard]] constexpr const auto &PC() const noexcept { return registers[15]; }
+    table[key] = static_cast<std::uint8_t>(Instruction_Type::Undefined);
+    for (const auto &[mask, value, type] : lookup_table) {
+      if ((instruction & mask & key_bits) == (value & key_bits)) {
+        // the first (most specific) candidate decides, if it looks at nothing but the key
+        table[key] = (mask & ~key_bits) == 0 ? static_cast<std::uint8_t>(type) : needs_search;
+        break;
+      }
+    }
+  }
+  return table;
+}
 
-  System() = default;
+constexpr auto arm_decode_table = get_arm_decode_table();
 
-  template<std::size_t Size>
-  constexpr System(const std::array<std::uint8_t, Size> &memory) noexcept
-  {
-    static_assert(Size <= RAMSize);
+[[nodiscard]] constexpr std::size_t arm_decode_key(const Instruction instruction) noexcept
+{
+  return ((instruction.data() >> 16) & 0xFF0) | ((instruction.data() >> 4) & 0xF);
+}
 
-    // Workaround for missing constexpr copy (added in C++20, not in compilers yet)
-    for (std::size_t loc = 0; loc < Size; ++loc) {
-      RAM[loc] = memory[loc];
-    }
-  }
+// A Thumb instruction as the ARM instruction that does the same thing, the
+// way the ARM7TDMI decompresses Thumb, so both states share one set of
+// handlers. The few Thumb operations ARM can't express get Thumb types:
+// branches (halfword offsets, the byte offset is stored in bits 27-0 below
+// the condition), the two halves of BL (the Thumb encoding as is), and PC
+// relative loads and address calculations (an ARM instruction, executed
+// with the PC word aligned).
+struct Thumb_Entry
+{
+  std::uint32_t instruction{};
+  Instruction_Type type{ Instruction_Type::Undefined };
+};
 
-  constexpr Instruction get_instruction(const std::uint32_t PC) noexcept {
-    // Note: there are more efficient ways to do this with reinterepet_cast
-    // or an intrinsic, but I cannot with constexpr context and I see
-    // no compiler that can optimize around this implementation
-    const std::uint32_t byte_1 = RAM[PC];
-    const std::uint32_t byte_2 = RAM[PC+1];
-    const std::uint32_t byte_3 = RAM[PC+2];
-    const std::uint32_t byte_4 = RAM[PC+3];
+[[nodiscard]] constexpr Thumb_Entry thumb_to_arm(const std::uint32_t thumb) noexcept
+{
+  constexpr std::uint32_t always = 0b1110'0000'0000'0000'0000'0000'0000'0000;
 
-    return Instruction{byte_1 | (byte_2 << 8) | (byte_3 << 16) | (byte_4 << 24)};
-  }
+  // always passes its condition, so it faults whatever the flags are
+  constexpr Thumb_Entry undefined{ always, Instruction_Type::Undefined };
+  constexpr std::uint32_t sp     = 13;
+  constexpr std::uint32_t lr     = 14;
+  constexpr std::uint32_t pc     = 15;
 
-  constexpr void run(const std::uint32_t loc) noexcept
-  {
-    registers[14] = RAMSize;
+  const auto bits = [thumb](const std::uint32_t low, const std::uint32_t count) { return (thumb >> low) & ((1u << count) - 1); };
 
-    PC() = loc;
-    while (PC() < RAMSize) {
-//      std::cout << std::hex << PC() << ':';
-//      for (const auto r : registers) {
-//        std::cout << ' ' << r;
-//      }
+  const auto data_processing = [](const OpCode opcode, const bool set, const std::uint32_t rn, const std::uint32_t rd, const std::uint32_t operand_2) {
+    return Thumb_Entry{ always | (static_cast<std::uint32_t>(opcode) << 21) | (std::uint32_t{ set } << 20) | (rn << 16) | (rd << 12) | operand_2,
+                        Instruction_Type::Data_Processing };
+  };
+  const auto shifted_register = [](const std::uint32_t rm, const Shift_Type type, const std::uint32_t amount) {
+    return (amount << 7) | (static_cast<std::uint32_t>(type) << 5) | rm;
+  };
+  const auto register_shifted_register = [](const std::uint32_t rm, const Shift_Type type, const std::uint32_t rs) {
+    return (rs << 8) | (static_cast<std::uint32_t>(type) << 5) | (1u << 4) | rm;
+  };
+  // imm8 ror 30 is imm8 << 2, for the word scaled offsets
+  const auto immediate = [](const std::uint32_t imm8, const std::uint32_t rotate = 0) { return (1u << 25) | (rotate << 8) | imm8; };
+  const auto words     = [&](const std::uint32_t imm8) { return immediate(imm8, 15); };
 
-//      std::cout << "; ";
+  const auto single_data_transfer = [](const bool load, const bool byte, const std::uint32_t rn, const std::uint32_t rd, const std::uint32_t offset, const bool register_offset) {
+    return Thumb_Entry{ always | (0b01u << 26) | (std::uint32_t{ register_offset } << 25) | (1u << 24) | (1u << 23) | (std::uint32_t{ byte } << 22)
+                          | (std::uint32_t{ load } << 20) | (rn << 16) | (rd << 12) | offset,
+                        Instruction_Type::Single_Data_Transfer };
+  };
+  const auto halfword_data_transfer = [](const bool load, const bool sign, const bool half, const std::uint32_t rn, const std::uint32_t rd, const std::uint32_t offset, const bool register_offset) {
+    return Thumb_Entry{ always | (1u << 24) | (1u << 23) | (std::uint32_t{ !register_offset } << 22) | (std::uint32_t{ load } << 20) | (rn << 16)
+                          | (rd << 12) | ((offset & 0xF0) << 4) | (1u << 7) | (std::uint32_t{ sign } << 6) | (std::uint32_t{ half } << 5) | (1u << 4)
+                          | (offset & 0xF),
+                        Instruction_Type::Halfword_Data_Transfer };
+  };
+  const auto block_data_transfer = [](const bool load, const bool pre, const bool up, const std::uint32_t rn, const std::uint32_t list) {
+    return Thumb_Entry{ always | (0b100u << 25) | (std::uint32_t{ pre } << 24) | (std::uint32_t{ up } << 23) | (1u << 21) | (std::uint32_t{ load } << 20)
+                          | (rn << 16) | list,
+                        Instruction_Type::Block_Data_Transfer };
+  };
+  const auto thumb_branch = [](const std::uint32_t condition, const std::int32_t offset) {
+    return Thumb_Entry{ (condition << 28) | (static_cast<std::uint32_t>(offset) & 0x0FFF'FFFF), Instruction_Type::Thumb_Branch };
+  };
+  const auto sign_extend = [](const std::uint32_t value, const std::uint32_t width) {
+    return static_cast<std::int32_t>(value << (32 - width)) >> (32 - width);
+  };
 
-//      for (int i = 100; i < 110; ++i) {
-//        std::cout << ' ' << static_cast<std::uint16_t>(RAM[i]);
-//      }
+  const auto rd = bits(0, 3);
+  const auto rs = bits(3, 3);
 
-//      std::cout << '\n';
+  // move shifted register
+  if (bits(13, 3) == 0b000 && bits(11, 2) != 0b11) {
+    return data_processing(OpCode::MOV, true, 0, rd, shifted_register(rs, static_cast<Shift_Type>(bits(11, 2)), bits(6, 5)));
+  }
 
-      process(get_instruction(PC()));
-    }
+  // add / subtract, register or 3 bit immediate
+  if (bits(11, 5) == 0b00011) {
+    const auto opcode = bits(9, 1) ? OpCode::SUB : OpCode::ADD;
+    return data_processing(opcode, true, rs, rd, bits(10, 1) ? immediate(bits(6, 3)) : bits(6, 3));
   }
 
-  [[nodiscard]] constexpr auto get_second_operand_shift_amount(const Data_Processing val) const noexcept
-  {
-    if (val.operand_2_immediate_shift()) {
-      return val.operand_2_shift_amount();
-    } else {
-      return 0xFF & registers[val.operand_2_shift_register()];
-    }
+  // move / compare / add / subtract 8 bit immediate
+  if (bits(13, 3) == 0b001) {
+    const auto rd_high = bits(8, 3);
+    constexpr std::array opcodes{ OpCode::MOV, OpCode::CMP, OpCode::ADD, OpCode::SUB };
+    const auto opcode = opcodes[bits(11, 2)];
+    return data_processing(opcode, true, opcode == OpCode::MOV ? 0 : rd_high, opcode == OpCode::CMP ? 0 : rd_high, immediate(bits(0, 8)));
   }
 
-  [[nodiscard]] constexpr std::pair<bool, std::uint32_t>
-    shift_register(const bool c_flag, const Shift_Type type, std::uint32_t shift_amount, std::uint32_t value) const noexcept
-  {
-    switch (type) {
-    case Shift_Type::Logical_Left:
-      if (shift_amount == 0) {
-        return { c_flag, value };
-      } else {
-        return { value & (1 << (32 - shift_amount)), value << shift_amount };
-      }
-    case Shift_Type::Logical_Right:
-      if (shift_amount == 0) {
-        return { value & (1 << 31), 0 };
-      } else {
-        return { value & (1 << (shift_amount - 1)), value >> shift_amount };
-      }
-    case Shift_Type::Arithmetic_Right:
-      if (shift_amount == 0) {
-        const bool is_negative = value & (1 << 31);
-        return { is_negative, is_negative ? -1 : 0 };
-      } else {
-        return { value & (1 << (shift_amount - 1)), (static_cast<std::int32_t>(value) >> shift_amount) };
-      }
-    case Shift_Type::Rotate_Right:
-      if (shift_amount == 0) {
-        // This is rotate_right_extended
-        return { value & 1, (c_flag << 31) | (value >> 1) };
-      } else {
-        return { value & (1 << (shift_amount - 1)), (value >> shift_amount) | (value << (32 - shift_amount)) };
-      }
+  // ALU operations, all flag setting
+  if (bits(10, 6) == 0b010000) {
+    switch (bits(6, 4)) {
+    case 0b0000: return data_processing(OpCode::AND, true, rd, rd, rs);
+    case 0b0001: return data_processing(OpCode::EOR, true, rd, rd, rs);
+    case 0b0010: return data_processing(OpCode::MOV, true, 0, rd, register_shifted_register(rd, Shift_Type::Logical_Left, rs));
+    case 0b0011: return data_processing(OpCode::MOV, true, 0, rd, register_shifted_register(rd, Shift_Type::Logical_Right, rs));
+    case 0b0100: return data_processing(OpCode::MOV, true, 0, rd, register_shifted_register(rd, Shift_Type::Arithmetic_Right, rs));
+    case 0b0101: return data_processing(OpCode::ADC, true, rd, rd, rs);
+    case 0b0110: return data_processing(OpCode::SBC, true, rd, rd, rs);
+    case 0b0111: return data_processing(OpCode::MOV, true, 0, rd, register_shifted_register(rd, Shift_Type::Rotate_Right, rs));
+    case 0b1000: return data_processing(OpCode::TST, true, rd, 0, rs);
+    case 0b1001: return data_processing(OpCode::RSB, true, rs, rd, immediate(0));
+    case 0b1010: return data_processing(OpCode::CMP, true, rd, 0, rs);
+    case 0b1011: return data_processing(OpCode::CMN, true, rd, 0, rs);
+    case 0b1100: return data_processing(OpCode::ORR, true, rd, rd, rs);
+    case 0b1101: return Thumb_Entry{ always | (1u << 20) | (rd << 16) | (rd << 8) | 0b1001'0000 | rs, Instruction_Type::Multiply };
+    case 0b1110: return data_processing(OpCode::BIC, true, rd, rd, rs);
+    case 0b1111: return data_processing(OpCode::MVN, true, 0, rd, rs);
     }
   }
 
-  [[nodiscard]] constexpr std::pair<bool, std::int32_t> get_second_operand(const Data_Processing val) const noexcept
-  {
-    if (val.immediate_operand()) {
-      return { c_flag(), val.operand_2_immediate() };
-    } else {
-      const auto shift_amount = get_second_operand_shift_amount(val);
-      return shift_register(c_flag(), val.operand_2_shift_type(), shift_amount, registers[val.operand_2_register()]);
+  // high register operations and BX
+  if (bits(10, 6) == 0b010001) {
+    const auto hd = rd | (bits(7, 1) << 3);
+    const auto hs = rs | (bits(6, 1) << 3);
+    switch (bits(8, 2)) {
+    case 0b00: return data_processing(OpCode::ADD, false, hd, hd, hs);
+    case 0b01: return data_processing(OpCode::CMP, true, hd, 0, hs);
+    case 0b10: return data_processing(OpCode::MOV, false, 0, hd, hs);
+    case 0b11: return Thumb_Entry{ always | 0b0001'0010'1111'1111'1111'0001'0000 | hs, Instruction_Type::Branch_Exchange };
     }
   }
 
-  constexpr auto offset(const Single_Data_Transfer val) const noexcept {
-    const auto offset = [=]() -> std::int32_t {
-      if (val.immediate_offset()) {
-        return val.offset();
-      } else {
-        const auto offset_register = registers[val.offset_register()];
-        // note: carry out seems to have no use with Single_Data_Transfer
-        return shift_register(c_flag(), val.offset_shift_type(), val.offset_shift_amount(), offset_register).second;
-      }
-    }();
+  // PC relative load
+  if (bits(11, 5) == 0b01001) {
+    return Thumb_Entry{ single_data_transfer(true, false, pc, bits(8, 3), bits(0, 8) * 4, false).instruction, Instruction_Type::Thumb_PC_Relative };
+  }
 
-    if (val.up_indexing()) {
-      return offset;
-    } else {
-      return -offset;
+  // load / store with register offset, and sign extended byte / halfword
+  if (bits(12, 4) == 0b0101) {
+    const auto rb = rs;
+    const auto ro = bits(6, 3);
+    if (bits(9, 1) == 0) {
+      return single_data_transfer(bits(11, 1), bits(10, 1), rb, rd, ro, true);
+    }
+
+    // H and S bits
+    switch (bits(10, 2)) {
+    case 0b00: return halfword_data_transfer(false, false, true, rb, rd, ro, true);  // STRH
+    case 0b01: return halfword_data_transfer(true, true, false, rb, rd, ro, true);   // LDSB
+    case 0b10: return halfword_data_transfer(true, false, true, rb, rd, ro, true);   // LDRH
+    case 0b11: return halfword_data_transfer(true, true, true, rb, rd, ro, true);    // LDSH
     }
   }
 
-  constexpr void single_data_transfer(const Single_Data_Transfer val) noexcept {
-    const std::int32_t index_offset = offset(val);
-    const auto base_location = registers[val.base_register()];
-    const bool pre_indexed = val.pre_indexing();
+  // load / store with immediate offset, words are scaled by 4
+  if (bits(13, 3) == 0b011) {
+    const bool byte = bits(12, 1);
+    return single_data_transfer(bits(11, 1), byte, rs, rd, byte ? bits(6, 5) : bits(6, 5) * 4, false);
+  }
 
-    const auto src_dest_register = val.src_dest_register();
-    const auto indexed_location = base_location + index_offset;
+  // load / store halfword, offset scaled by 2
+  if (bits(12, 4) == 0b1000) {
+    return halfword_data_transfer(bits(11, 1), false, true, rs, rd, bits(6, 5) * 2, false);
+  }
 
-    if (val.byte_transfer()) {
-      if (const auto location = pre_indexed ? indexed_location : base_location; val.load()) {
-        registers[src_dest_register] = RAM[location];
-      } else {
-        RAM[location] = registers[src_dest_register];
-      }
-    } else {
-      // word transfer
-      if (const auto location = pre_indexed ? indexed_location : base_location; val.load()) {
-        registers[src_dest_register] = static_cast<std::uint32_t>(RAM[location]) | (static_cast<std::uint32_t>(RAM[location + 1]) << 8) | (static_cast<std::uint32_t>(RAM[location + 2]) << 16) | (static_cast<std::uint32_t>(RAM[location + 3]) << 24);
-      } else {
-        RAM[location] = registers[src_dest_register] & 0xFF;
-        RAM[location+1] = (registers[src_dest_register] >> 8) & 0xFF;
-        RAM[location+2] = (registers[src_dest_register] >> 16) & 0xFF;
-        RAM[location+3] = (registers[src_dest_register] >> 24) & 0xFF;
-      }
-    }
+  // SP relative load / store
+  if (bits(12, 4) == 0b1001) {
+    return single_data_transfer(bits(11, 1), false, sp, bits(8, 3), bits(0, 8) * 4, false);
+  }
 
-    if (!pre_indexed || val.write_back()) {
-      registers[val.base_register()] = indexed_location;
+  // load address, relative to SP or to the word aligned PC
+  if (bits(12, 4) == 0b1010) {
+    const auto entry = data_processing(OpCode::ADD, false, bits(11, 1) ? sp : pc, bits(8, 3), words(bits(0, 8)));
+    return bits(11, 1) ? entry : Thumb_Entry{ entry.instruction, Instruction_Type::Thumb_PC_Relative };
+  }
+
+  // add offset to SP
+  if (bits(8, 8) == 0b1011'0000) {
+    return data_processing(bits(7, 1) ? OpCode::SUB : OpCode::ADD, false, sp, sp, words(bits(0, 7)));
+  }
+
+  // PUSH / POP, optionally with LR / PC
+  if (bits(12, 4) == 0b1011 && bits(9, 2) == 0b10) {
+    const bool load = bits(11, 1);
+    const auto list = bits(0, 8) | (bits(8, 1) << (load ? pc : lr));
+    return load ? block_data_transfer(true, false, true, sp, list) : block_data_transfer(false, true, false, sp, list);
+  }
+
+  // LDMIA / STMIA
+  if (bits(12, 4) == 0b1100) {
+    return block_data_transfer(bits(11, 1), false, true, bits(8, 3), bits(0, 8));
+  }
+
+  // conditional branch, and SWI in the place of the never condition
+  if (bits(12, 4) == 0b1101) {
+    const auto condition = bits(8, 4);
+    if (condition == 0b1111) {
+      return Thumb_Entry{ always | 0b1111'0000'0000'0000'0000'0000'0000 | bits(0, 8), Instruction_Type::Software_Interrupt };
+    }
+    if (condition == 0b1110) {
+      return undefined;
     }
+    return thumb_branch(condition, sign_extend(bits(0, 8), 8) * 2);
   }
 
-  constexpr void data_processing(const Data_Processing val) noexcept
-  {
-    const auto first_operand              = registers[val.operand_1_register()];
-    const auto[carry_out, second_operand] = get_second_operand(val);
-    const auto destination_register       = val.destination_register();
-    auto &destination                     = registers[destination_register];
+  // unconditional branch
+  if (bits(11, 5) == 0b11100) {
+    return thumb_branch(0b1110, sign_extend(bits(0, 11), 11) * 2);
+  }
 
-    const auto update_logical_flags = [ =, &destination, carry_out = carry_out, second_operand = second_operand ](const bool write, const auto result)
-    {
-      if (val.set_condition_code() && destination_register != 15) {
-        c_flag(carry_out);
-        z_flag(result == 0);
-        n_flag(result & (1u << 31));
-      }
-      if (write) {
-        destination = result;
-      }
-    };
+  // long branch with link, in two halves
+  if (bits(12, 4) == 0b1111) {
+    return Thumb_Entry{ always | thumb, Instruction_Type::Thumb_Branch_Link };
+  }
 
-    // use 64 bit operations to be able to capture carry
-    const auto arithmetic =
-      [ =, &destination, carry = c_flag(), first_operand = static_cast<std::uint64_t>(first_operand), second_operand = second_operand ](
-        const bool write, const auto op)
-    {
-      const auto result = op(first_operand, second_operand, carry);
+  return undefined;
+}
+
+// Every Thumb encoding translated ahead of time. Too large to build within
+// the compiler's constexpr limits, so it is filled in the first time Thumb
+// code runs, and compile time evaluation translates each instruction as it
+// goes. Programs that stay in ARM state never pay for it.
+[[nodiscard]] inline auto get_thumb_table() noexcept
+{
+  auto table = std::make_unique<std::array<Thumb_Entry, 65536>>();
+  for (std::uint32_t thumb = 0; thumb < table->size(); ++thumb) {
+    (*table)[thumb] = thumb_to_arm(thumb);
+  }
+  return table;
+}
 
-      static_assert(std::is_same_v<std::decay_t<decltype(result)>, std::uint64_t>);
+[[nodiscard]] inline const auto &thumb_table() noexcept
+{
+  static const auto table = get_thumb_table();
+  return *table;
+}
+
+[[nodiscard]] constexpr Thumb_Entry decode_thumb(const std::uint16_t thumb) noexcept
+{
+  if (std::is_constant_evaluated()) {
+    return thumb_to_arm(thumb);
+  }
+  return thumb_table()[thumb];
+}
 
-      if (val.set_condition_code() && destination_register != 15) {
-        z_flag(result == 0);
-        n_flag(result & (1u << 31));
-        c_flag(result & (1ull << 32));
 
-        const auto first_op_sign  = static_cast<std::uint32_t>(first_operand) & (1 << 31);
-        const auto second_op_sign = static_cast<std::uint32_t>(second_operand) & (1 << 31);
-        const auto result_sign    = static_cast<std::uint32_t>(result) & (1 << 31);
+// Whether an instruction with condition executes, given the flags
+[[nodiscard]] constexpr bool condition_passes(const Condition condition, const bool n, const bool z, const bool c, const bool v) noexcept
+{
+  switch (condition) {
+  case Condition::EQ:  // Z set (==)
+    return z;
+  case Condition::NE:  // Z clear (!=)
+    return !z;
+  case Condition::HS:  // AKA CS C set (unsigned >=)
+    return c;
+  case Condition::LO:  // AKA CC C clear (unsigned <)
+    return !c;
+  case Condition::MI:  // N set (negative)
+    return n;
+  case Condition::PL:  // N clear (positive or zero)
+    return !n;
+  case Condition::VS:  // V set (overflow)
+    return v;
+  case Condition::VC:  // V clear (no overflow)
+    return !v;
+  case Condition::HI:  // C set and Z clear (unsigned higher)
+    return c && !z;
+  case Condition::LS:  // C clear or Z (set unsigned lower or same)
+    return !c || z;
+  case Condition::GE:  // N set and V set, or N clear and V clear (>=)
+    return (n && v) || (!n && !v);
+  case Condition::LT:  // N set and V clear, or N clear and V set (<)
+    return (n && !v) || (!n && v);
+  case Condition::GT:  // Z clear, and either N set and V set, or N clear and V clear (>)
+    return !z && ((n && v) || (!n && !v));
+  case Condition::LE:  // Z set, or N set and V clear,or N clear and V set (<=)
+    return z || (n && !v) || (!n && v);
+  case Condition::AL:  // Always
+    return true;
+  case Condition::NV:  // Reserved
+    return false;
+  }
+  return false;
+}
 
-        v_flag((first_op_sign == second_op_sign) && (result_sign != first_op_sign));
+// For each condition a bit per value of the NZCV nibble (N is bit 3) saying
+// whether the condition passes, so checking one is a shift and a mask
+[[nodiscard]] constexpr auto get_condition_table() noexcept
+{
+  std::array<std::uint16_t, 16> table{};
+  for (std::uint32_t condition = 0; condition < table.size(); ++condition) {
+    for (std::uint32_t flags = 0; flags < 16; ++flags) {
+      if (condition_passes(static_cast<Condition>(condition), flags & 0b1000, flags & 0b0100, flags & 0b0010, flags & 0b0001)) {
+        table[condition] |= static_cast<std::uint16_t>(1u << flags);
       }
+    }
+  }
+  return table;
+}
 
-      if (write) {
-        destination = static_cast<std::uint32_t>(result);
-      }
-    };
+constexpr auto condition_table = get_condition_table();
 
 
-    switch (val.get_opcode()) {
-    // Logical Operations
-    case OpCode::AND: update_logical_flags(true, first_operand & second_operand); break;
-    case OpCode::EOR: update_logical_flags(true, first_operand ^ second_operand); break;
-    case OpCode::TST: update_logical_flags(false, first_operand & second_operand); break;
-    case OpCode::TEQ: update_logical_flags(false, first_operand ^ second_operand); break;
-    case OpCode::ORR: update_logical_flags(true, first_operand | second_operand); break;
-    case OpCode::MOV: update_logical_flags(true, second_operand); break;
-    case OpCode::BIC: update_logical_flags(true, first_operand & (~second_operand)); break;
-    case OpCode::MVN:
-      update_logical_flags(true, ~second_operand);
-      break;
+// What produced the current condition flags. Flag setting instructions only
+// record their result, individual flags are derived from it when read.
+enum class Flag_Source : std::uint8_t { CSPR, Logical, Arithmetic, Multiply_Long };
 
-    // Arithmetic Operations
-    case OpCode::SUB: arithmetic(true, [](const auto op_1, const auto op_2, const auto) { return op_1 - op_2; }); break;
-    case OpCode::RSB: arithmetic(true, [](const auto op_1, const auto op_2, const auto) { return op_2 - op_1; }); break;
-    case OpCode::ADD: arithmetic(true, [](const auto op_1, const auto op_2, const auto) { return op_1 + op_2; }); break;
-    case OpCode::ADC: arithmetic(true, [](const auto op_1, const auto op_2, const auto c) { return op_1 + op_2 + c; }); break;
-    case OpCode::SBC: arithmetic(true, [](const auto op_1, const auto op_2, const auto c) { return op_1 - op_2 + c - 1; }); break;
-    case OpCode::RSC: arithmetic(true, [](const auto op_1, const auto op_2, const auto c) { return op_2 - op_1 + c - 1; }); break;
-    case OpCode::CMP: arithmetic(false, [](const auto op_1, const auto op_2, const auto) { return op_1 - op_2; }); break;
-    case OpCode::CMN: arithmetic(false, [](const auto op_1, const auto op_2, const auto) { return op_1 + op_2; }); break;
+// What the barrel shifter produces: the shifted value and its carry out
+struct Shifted
+{
+  bool carry;
+  std::uint32_t value;
+};
+
+// For Arithmetic, result is first_operand plus or minus second_operand (and
+// the carry) worked out in 64 bits from zero extended operands, so bit 32 is
+// the carry out of an add, or the borrow out of a subtract
+struct Lazy_Flags
+{
+  Flag_Source source{ Flag_Source::CSPR };
+  bool carry{};     // carry out of the shifter, for Logical
+  bool subtract{};  // SUB / CMP / RSB / SBC / RSC, for Arithmetic
+  std::uint32_t first_operand{};
+  std::uint32_t second_operand{};
+  std::uint64_t result{};
+};
+
+
+// Guest memory as a fixed, inline array. Everything is constexpr so it is
+// what the compile time tests run against. It is held as a plain array of
+// words, so the instruction fetch and the word transfers that dominate a
+// compile time run are a single array access each, not four byte accesses
+// through std::array's operator[] calls. The host sees the same little
+// endian bytes, by looking at the words in place.
+template<std::size_t Size> struct Fixed_Memory
+{
+  static_assert(Size % 4 == 0);
+  static_assert(std::endian::native == std::endian::little, "host accesses read the words as little endian bytes");
+
+  std::uint32_t words[Size / 4]{};
+
+  // Returning to this address (the initial lr) ends System::run
+  constexpr static std::uint32_t halt_address = Size;
+
+  [[nodiscard]] constexpr bool operator==(const Fixed_Memory &) const noexcept = default;
+
+  [[nodiscard]] constexpr std::uint8_t operator[](const std::uint32_t loc) const noexcept { return read_byte(loc); }
+
+  [[nodiscard]] constexpr std::uint8_t read_byte(const std::uint32_t loc) const noexcept
+  {
+    if (!std::is_constant_evaluated()) {
+      return host_bytes()[loc];
     }
+
+    return static_cast<std::uint8_t>(words[loc / 4] >> (loc % 4 * 8));
   }
 
-  constexpr void branch(const Instruction instruction) noexcept
+  constexpr void write_byte(const std::uint32_t loc, const std::uint8_t value) noexcept
   {
-    if (instruction.bit_set(24)) {
-      // Link bit set
-      registers[14] = PC()-4;
+    if (!std::is_constant_evaluated()) {
+      host_bytes()[loc] = value;
+      return;
     }
 
-    const auto offset = [](const auto &op) -> std::int32_t {
-      if (op.bit_set(23)) {
-        // is signed
-        const auto twos_compliment = ((~(op & 0x00FFFFFFF)) + 1) & 0x00FFFFFF;
-        return -(twos_compliment << 2);
-      } else {
-        return (op & 0x00FFFFFF) << 2;
-      }
-    }(instruction);
-
-    PC() += offset + 4;
+    const auto shift = loc % 4 * 8;
+    auto &word       = words[loc / 4];
+    word             = (word & ~(0xFFu << shift)) | (std::uint32_t{ value } << shift);
   }
 
-  constexpr void multiply_long(const Multiply_Long val) noexcept
+  [[nodiscard]] constexpr std::uint32_t read_word(const std::uint32_t loc) const noexcept
   {
-    const auto result = [val, lhs = registers[val.operand_1()], rhs = registers[val.operand_2()]]() -> std::uint64_t {
-      if (val.unsigned_mul()) {
-        return static_cast<std::uint64_t>(lhs) * static_cast<std::uint64_t>(rhs);
-      } else {
-        return static_cast<std::uint64_t>(static_cast<std::int64_t>(lhs) * static_cast<std::int64_t>(rhs));
-      }
-    }(); 
-
-    if (val.accumulate()) {
-      registers[val.high_result()] += (result >> 32) & 0xFFFFFFFF;
-      registers[val.low_result()] += result & 0xFFFFFFFF;
-    } else {
-      registers[val.high_result()] = (result >> 32) & 0xFFFFFFFF;
-      registers[val.low_result()] = result & 0xFFFFFFFF;
+    if (!std::is_constant_evaluated()) {
+      return load_word(host_bytes() + loc);
     }
 
-    if (val.status_register_update()) {
-      z_flag(result == 0);
-      n_flag(result & (static_cast<std::uint64_t>(1) << 63));
+    if (loc % 4 == 0) {
+      return words[loc / 4];
     }
+
+    return static_cast<std::uint32_t>(read_byte(loc)) | (static_cast<std::uint32_t>(read_byte(loc + 1)) << 8)
+           | (static_cast<std::uint32_t>(read_byte(loc + 2)) << 16) | (static_cast<std::uint32_t>(read_byte(loc + 3)) << 24);
   }
 
-  constexpr static auto n_bit = 0b1000'0000'0000'0000'0000'0000'0000'0000;
-  constexpr static auto z_bit = 0b0100'0000'0000'0000'0000'0000'0000'0000;
-  constexpr static auto c_bit = 0b0010'0000'0000'0000'0000'0000'0000'0000;
+  constexpr void write_word(const std::uint32_t loc, const std::uint32_t value) noexcept
+  {
+    if (!std::is_constant_evaluated()) {
+      store_word(host_bytes() + loc, value);
+      return;
+    }
+
+    if (loc % 4 == 0) {
+      words[loc / 4] = value;
+      return;
+    }
+
+    write_byte(loc, value & 0xFF);
+    write_byte(loc + 1, (value >> 8) & 0xFF);
+    write_byte(loc + 2, (value >> 16) & 0xFF);
+    write_byte(loc + 3, (value >> 24) & 0xFF);
+  }
+
+  // Contiguous word transfers for LDM / STM, checked once for the whole range
+  constexpr void read_words(const std::uint32_t loc, std::uint32_t *values, const std::uint32_t count) const noexcept
+  {
+    assert(std::size_t{ loc } + count * 4 <= Size && "Block transfer outside of RAM");
+
+    if (!std::is_constant_evaluated()) {
+      std::memcpy(values, host_bytes() + loc, count * 4);
+      return;
+    }
+
+    for (std::uint32_t word = 0; word < count; ++word) {
+      values[word] = read_word(loc + word * 4);
+    }
+  }
+
+  constexpr void write_words(const std::uint32_t loc, const std::uint32_t *values, const std::uint32_t count) noexcept
+  {
+    assert(std::size_t{ loc } + count * 4 <= Size && "Block transfer outside of RAM");
+
+    if (!std::is_constant_evaluated()) {
+      std::memcpy(host_bytes() + loc, values, count * 4);
+      return;
+    }
+
+    for (std::uint32_t word = 0; word < count; ++word) {
+      write_word(loc + word * 4, values[word]);
+    }
+  }
+
+  // Bulk transfers for the native copy / fill paths, an overlapping copy
+  // behaves like memmove
+  constexpr void copy_bytes(const std::uint32_t destination, const std::uint32_t source, const std::uint32_t size) noexcept
+  {
+    assert(std::size_t{ destination } + size <= Size && std::size_t{ source } + size <= Size && "Copy outside of RAM");
+
+    if (!std::is_constant_evaluated()) {
+      std::memmove(host_bytes() + destination, host_bytes() + source, size);
+      return;
+    }
+
+    if (destination <= source) {
+      for (std::uint32_t offset = 0; offset < size; ++offset) {
+        write_byte(destination + offset, read_byte(source + offset));
+      }
+    } else {
+      for (std::uint32_t offset = size; offset > 0; --offset) {
+        write_byte(destination + offset - 1, read_byte(source + offset - 1));
+      }
+    }
+  }
+
+  constexpr void fill_bytes(const std::uint32_t destination, const std::uint8_t value, const std::uint32_t size) noexcept
+  {
+    assert(std::size_t{ destination } + size <= Size && "Fill outside of RAM");
+
+    if (!std::is_constant_evaluated()) {
+      std::memset(host_bytes() + destination, value, size);
+      return;
+    }
+
+    for (std::uint32_t offset = 0; offset < size; ++offset) {
+      write_byte(destination + offset, value);
+    }
+  }
+
+private:
+  // The words as the bytes the guest sees, for the host side accesses
+  [[nodiscard]] const std::uint8_t *host_bytes() const noexcept { return reinterpret_cast<const std::uint8_t *>(words); }
+  [[nodiscard]] std::uint8_t *host_bytes() noexcept { return reinterpret_cast<std::uint8_t *>(words); }
+};
+
+// Sparse guest memory covering the full 32 bit address space. 4 KB pages are
+// allocated on first write, reads of memory that was never written return 0
+// without allocating anything. A one entry cache of the last page touched
+// keeps sequential fetches and stack traffic off the page table walk.
+//
+// Copies are copy-on-write: page tables and pages are shared between copies
+// and a copy of the page is only made the first time either side writes to
+// it, so snapshotting or forking a large address space costs a few pointer
+// copies. Every page and table records the memory that owns it, and only its
+// owner writes to it in place. A copy starts out owning nothing, and copying
+// bumps the source's atomic copy count, so the source gives up ownership
+// before its next write. Any number of threads may copy the same source at
+// once, as long as nothing writes to it meanwhile, and the copies themselves
+// can run on different threads.
+class Paged_Memory
+{
+public:
+  constexpr static std::uint32_t page_bits = 12;
+  constexpr static std::uint32_t page_size = 1u << page_bits;
+
+  // The top 256 bytes of the address space are reserved as the return-to-host address
+  constexpr static std::uint32_t halt_address = 0xFFFF'FF00;
+
+  Paged_Memory() = default;
+
+  // The pages move with their owner, so the moved-to memory keeps writing in place
+  Paged_Memory(Paged_Memory &&other) noexcept
+    : m_directory(std::move(other.m_directory)), m_owner(other.m_owner), m_copies(other.m_copies.load(std::memory_order_relaxed)),
+      m_seen_copies(other.m_seen_copies)
+  {
+    other.m_owner = new_owner();
+    other.forget_pages();
+  }
+
+  Paged_Memory &operator=(Paged_Memory &&other) noexcept
+  {
+    if (this != &other) {
+      // copies taken from other share its pages, so its copy count comes along too
+      m_directory   = std::move(other.m_directory);
+      m_owner       = std::exchange(other.m_owner, new_owner());
+      m_copies.store(other.m_copies.load(std::memory_order_relaxed), std::memory_order_relaxed);
+      m_seen_copies = other.m_seen_copies;
+      forget_pages();
+      other.forget_pages();
+    }
+    return *this;
+  }
+
+  // The source stays untouched apart from its copy count
+  Paged_Memory(const Paged_Memory &other) : m_directory(other.m_directory) { other.m_copies.fetch_add(1, std::memory_order_relaxed); }
+
+  Paged_Memory &operator=(const Paged_Memory &other)
+  {
+    if (this != &other) {
+      m_directory = other.m_directory;
+      other.m_copies.fetch_add(1, std::memory_order_relaxed);
+      m_owner       = new_owner();
+      m_seen_copies = m_copies.load(std::memory_order_relaxed);
+      forget_pages();
+    }
+    return *this;
+  }
+
+  ~Paged_Memory() = default;
+
+  [[nodiscard]] bool operator==(const Paged_Memory &other) const noexcept
+  {
+    for (std::uint32_t table = 0; table < directory_size; ++table) {
+      for (std::uint32_t entry = 0; entry < table_size; ++entry) {
+        const auto address = (table << (page_bits + table_bits)) | (entry << page_bits);
+        const auto *lhs    = find_page(address);
+        const auto *rhs    = other.find_page(address);
+
+        if (lhs == rhs) {
+          continue;
+        }
+
+        const auto bytes = [](const std::uint8_t *page, const std::uint32_t offset) { return page ? page[offset] : std::uint8_t{}; };
+        for (std::uint32_t offset = 0; offset < page_size; ++offset) {
+          if (bytes(lhs, offset) != bytes(rhs, offset)) {
+            return false;
+          }
+        }
+      }
+    }
+    return true;
+  }
+
+  [[nodiscard]] std::uint8_t operator[](const std::uint32_t loc) const noexcept { return read_byte(loc); }
+
+  [[nodiscard]] std::uint8_t read_byte(const std::uint32_t loc) const noexcept
+  {
+    const auto *page = find_page(loc);
+    return page ? page[loc & page_mask] : 0;
+  }
+
+  void write_byte(const std::uint32_t loc, const std::uint8_t value) { writable_page(loc)[loc & page_mask] = value; }
+
+  [[nodiscard]] std::uint32_t read_word(const std::uint32_t loc) const noexcept
+  {
+    if ((loc & page_mask) <= page_size - 4) {
+      const auto *page = find_page(loc);
+      return page ? load_word(page + (loc & page_mask)) : 0;
+    }
+
+    // straddles two pages
+    return static_cast<std::uint32_t>(read_byte(loc)) | (static_cast<std::uint32_t>(read_byte(loc + 1)) << 8)
+           | (static_cast<std::uint32_t>(read_byte(loc + 2)) << 16) | (static_cast<std::uint32_t>(read_byte(loc + 3)) << 24);
+  }
+
+  void write_word(const std::uint32_t loc, const std::uint32_t value)
+  {
+    if ((loc & page_mask) <= page_size - 4) {
+      store_word(writable_page(loc) + (loc & page_mask), value);
+      return;
+    }
+
+    write_byte(loc, value & 0xFF);
+    write_byte(loc + 1, (value >> 8) & 0xFF);
+    write_byte(loc + 2, (value >> 16) & 0xFF);
+    write_byte(loc + 3, (value >> 24) & 0xFF);
+  }
+
+  // Contiguous word transfers for LDM / STM, a single copy when the range is
+  // inside one page
+  void read_words(const std::uint32_t loc, std::uint32_t *values, const std::uint32_t count) const noexcept
+  {
+    if ((loc & page_mask) + count * 4 <= page_size) {
+      if (const auto *page = find_page(loc)) {
+        std::memcpy(values, page + (loc & page_mask), count * 4);
+      } else {
+        std::fill(values, values + count, 0);
+      }
+      return;
+    }
+
+    for (std::uint32_t word = 0; word < count; ++word) {
+      values[word] = read_word(loc + word * 4);
+    }
+  }
+
+  void write_words(const std::uint32_t loc, const std::uint32_t *values, const std::uint32_t count)
+  {
+    if ((loc & page_mask) + count * 4 <= page_size) {
+      std::memcpy(writable_page(loc) + (loc & page_mask), values, count * 4);
+      return;
+    }
+
+    for (std::uint32_t word = 0; word < count; ++word) {
+      write_word(loc + word * 4, values[word]);
+    }
+  }
+
+  // Bulk transfers for the native copy / fill paths, a page at a time. An
+  // overlapping copy behaves like memmove.
+  void copy_bytes(const std::uint32_t destination, const std::uint32_t source, const std::uint32_t size)
+  {
+    // copying forwards onto a later part of the source would read bytes it already wrote
+    if (destination > source && destination - source < size) {
+      for (auto offset = size; offset-- > 0;) {
+        write_byte(destination + offset, read_byte(source + offset));
+      }
+      return;
+    }
+
+    for (std::uint32_t done = 0; done < size;) {
+      const auto to      = destination + done;
+      const auto from    = source + done;
+      const auto chunk   = std::min({ size - done, page_size - (to & page_mask), page_size - (from & page_mask) });
+      auto *const target = writable_page(to) + (to & page_mask);
+
+      if (const auto *page = find_page(from)) {
+        std::memmove(target, page + (from & page_mask), chunk);
+      } else {
+        std::memset(target, 0, chunk);
+      }
+      done += chunk;
+    }
+  }
+
+  void fill_bytes(const std::uint32_t destination, const std::uint8_t value, const std::uint32_t size)
+  {
+    for (std::uint32_t done = 0; done < size;) {
+      const auto to    = destination + done;
+      const auto chunk = std::min(size - done, page_size - (to & page_mask));
+      std::memset(writable_page(to) + (to & page_mask), value, chunk);
+      done += chunk;
+    }
+  }
+
+  [[nodiscard]] bool mapped(const std::uint32_t loc) const noexcept { return find_page(loc) != nullptr; }
+
+  // Backs [address, address + length) with host memory owned by region, for
+  // instance an anonymous or file mapping. Both must be page aligned.
+  void map_host(const std::uint32_t address, const std::shared_ptr<std::uint8_t> &region, const std::size_t length)
+  {
+    if ((address & page_mask) != 0 || (length & page_mask) != 0) {
+      throw std::invalid_argument("host mappings must be page aligned");
+    }
+
+    claim_pages();
+    for (std::size_t offset = 0; offset < length; offset += page_size) {
+      page_entry(static_cast<std::uint32_t>(address + offset)) = Page{ std::shared_ptr<std::uint8_t>(region, region.get() + offset), m_owner };
+    }
+    forget_pages();
+  }
+
+  // Number of pages this memory owns, rather than shares with a copy
+  [[nodiscard]] std::size_t private_pages() const noexcept
+  {
+    if (m_copies.load(std::memory_order_relaxed) != m_seen_copies) {
+      return 0;
+    }
+
+    std::size_t count = 0;
+    for (const auto &table : m_directory) {
+      if (table && table->owner == m_owner) {
+        count += static_cast<std::size_t>(
+          std::count_if(table->pages.begin(), table->pages.end(), [owner = m_owner](const Page &page) { return page.data && page.owner == owner; }));
+      }
+    }
+    return count;
+  }
+
+#ifdef __unix__
+  // Zero filled host memory the OS only commits as it is touched, suitable for
+  // large RAM regions with map_host
+  [[nodiscard]] static std::shared_ptr<std::uint8_t> anonymous_region(const std::size_t length)
+  {
+    void *region = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) {
+      throw std::bad_alloc();
+    }
+    return std::shared_ptr<std::uint8_t>(static_cast<std::uint8_t *>(region), [length](std::uint8_t *ptr) { munmap(ptr, length); });
+  }
+#endif
+
+private:
+  constexpr static std::uint32_t table_bits     = 10;
+  constexpr static std::uint32_t table_size     = 1u << table_bits;
+  constexpr static std::uint32_t directory_size = 1u << (32 - page_bits - table_bits);
+  constexpr static std::uint32_t page_mask      = page_size - 1;
+  constexpr static std::uint32_t invalid_page   = 0xFFFF'FFFF;
+
+  struct Page
+  {
+    std::shared_ptr<std::uint8_t> data;
+    std::uint64_t owner{};
+  };
+
+  struct Page_Table
+  {
+    std::array<Page, table_size> pages{};
+    std::uint64_t owner{};
+  };
+
+  // Owners are never reused, so a page's owner can't be mistaken for a later memory
+  [[nodiscard]] static std::uint64_t new_owner() noexcept
+  {
+    static std::atomic<std::uint64_t> owners{};
+    return owners.fetch_add(1, std::memory_order_relaxed) + 1;
+  }
+
+  [[nodiscard]] static constexpr std::uint32_t page_number(const std::uint32_t loc) noexcept { return loc >> page_bits; }
+
+  [[nodiscard]] const std::uint8_t *find_page(const std::uint32_t loc) const noexcept
+  {
+    if (page_number(loc) == m_cached_page) {
+      return m_cached_data;
+    }
+
+    const auto &table = m_directory[loc >> (page_bits + table_bits)];
+    if (!table) {
+      return nullptr;
+    }
+
+    auto *data = table->pages[page_number(loc) & (table_size - 1)].data.get();
+    if (data) {
+      m_cached_page = page_number(loc);
+      m_cached_data = data;
+    }
+    return data;
+  }
+
+  // Everything this memory owned is shared once it has been copied, so it
+  // becomes a new owner and copies whatever it writes from then on
+  void claim_pages() noexcept
+  {
+    if (const auto copies = m_copies.load(std::memory_order_relaxed); copies != m_seen_copies) {
+      m_seen_copies = copies;
+      m_owner       = new_owner();
+      forget_pages();
+    }
+  }
+
+  void forget_pages() noexcept
+  {
+    m_cached_page   = invalid_page;
+    m_writable_page = invalid_page;
+  }
+
+  // Takes a copy of the page table first if someone else owns it, the pages
+  // in the copy keep their owners
+  [[nodiscard]] Page &page_entry(const std::uint32_t loc)
+  {
+    auto &table = m_directory[loc >> (page_bits + table_bits)];
+    if (!table) {
+      table = std::make_shared<Page_Table>();
+      table->owner = m_owner;
+    } else if (table->owner != m_owner) {
+      table = std::make_shared<Page_Table>(*table);
+      table->owner = m_owner;
+    }
+    return table->pages[page_number(loc) & (table_size - 1)];
+  }
+
+  [[nodiscard]] static std::shared_ptr<std::uint8_t> new_page()
+  {
+    return std::shared_ptr<std::uint8_t>(new std::uint8_t[page_size](), std::default_delete<std::uint8_t[]>());
+  }
+
+  [[nodiscard]] std::uint8_t *writable_page(const std::uint32_t loc)
+  {
+    claim_pages();
+    if (page_number(loc) == m_writable_page) {
+      return m_writable_data;
+    }
+
+    auto &page = page_entry(loc);
+    if (!page.data) {
+      page = Page{ new_page(), m_owner };
+    } else if (page.owner != m_owner) {
+      auto copy = new_page();
+      std::memcpy(copy.get(), page.data.get(), page_size);
+      page = Page{ std::move(copy), m_owner };
+    }
+
+    m_cached_page = m_writable_page = page_number(loc);
+    m_cached_data = m_writable_data = page.data.get();
+    return m_writable_data;
+  }
+
+  std::array<std::shared_ptr<Page_Table>, directory_size> m_directory{};
+
+  // Pages and tables tagged with m_owner are this memory's alone. m_copies
+  // counts copies taken from this memory, once it moves past m_seen_copies
+  // the next write claims a new owner.
+  std::uint64_t m_owner{ new_owner() };
+  mutable std::atomic<std::uint64_t> m_copies{};
+  std::uint64_t m_seen_copies{};
+
+  // Reads may be served from a shared page, writes only from a page this
+  // memory owns alone, so the two are cached separately
+  mutable std::uint32_t m_cached_page{ invalid_page };
+  mutable std::uint8_t *m_cached_data{};
+  mutable std::uint32_t m_writable_page{ invalid_page };
+  std::uint8_t *m_writable_data{};
+};
+
+// A memory mapped peripheral. Offsets are relative to the start of the
+// window the device is attached at, size is 1 or 4 bytes.
+struct Device
+{
+  virtual ~Device() = default;
+
+  [[nodiscard]] virtual std::uint32_t read(std::uint32_t offset, std::uint32_t size) = 0;
+  virtual void write(std::uint32_t offset, std::uint32_t value, std::uint32_t size) = 0;
+};
+
+// Stand-in serial port: bytes written to the data register are appended to
+// a host buffer, the status register always reports ready to transmit.
+struct UART : Device
+{
+  constexpr static std::uint32_t data_register   = 0x0;
+  constexpr static std::uint32_t status_register = 0x4;
+  constexpr static std::uint32_t transmit_ready  = 0x1;
+
+  std::string output;
+
+  [[nodiscard]] std::uint32_t read(const std::uint32_t offset, std::uint32_t) override
+  {
+    return offset == status_register ? transmit_ready : 0;
+  }
+
+  void write(const std::uint32_t offset, const std::uint32_t value, std::uint32_t) override
+  {
+    if (offset == data_register) {
+      output.push_back(static_cast<char>(value & 0xFF));
+    }
+  }
+};
+
+// Memory that routes accesses to attached devices and everything else to the
+// backing memory. Address space is tracked in 64 KB regions with one bit per
+// region saying whether any device overlaps it, so a plain RAM access costs a
+// single, well predicted, bit test before going to the backing memory.
+// Devices are not owned and have to outlive the bus, copies of the bus share
+// them.
+template<typename Backing = Paged_Memory> class Memory_Bus
+{
+public:
+  constexpr static std::uint32_t halt_address = Backing::halt_address;
+
+  Memory_Bus() = default;
+
+  [[nodiscard]] bool operator==(const Memory_Bus &other) const noexcept { return m_backing == other.m_backing; }
+
+  void attach(const std::uint32_t base, const std::uint32_t size, Device &device)
+  {
+    if (size == 0) {
+      throw std::invalid_argument("device window must not be empty");
+    }
+
+    m_windows.push_back(Window{ base, size, &device });
+
+    for (std::uint64_t region = base >> region_bits; region <= (std::uint64_t{ base } + size - 1) >> region_bits; ++region) {
+      m_device_regions[region / 64] |= std::uint64_t{ 1 } << (region % 64);
+    }
+  }
+
+  [[nodiscard]] Backing &backing() noexcept { return m_backing; }
+  [[nodiscard]] const Backing &backing() const noexcept { return m_backing; }
+
+  [[nodiscard]] std::uint8_t operator[](const std::uint32_t loc) const noexcept { return m_backing[loc]; }
+
+  [[nodiscard]] std::uint8_t read_byte(const std::uint32_t loc) const
+  {
+    if (device_region(loc)) [[unlikely]] {
+      if (const auto *window = find_window(loc)) {
+        return static_cast<std::uint8_t>(window->device->read(loc - window->base, 1));
+      }
+    }
+    return m_backing.read_byte(loc);
+  }
+
+  void write_byte(const std::uint32_t loc, const std::uint8_t value)
+  {
+    if (device_region(loc)) [[unlikely]] {
+      if (const auto *window = find_window(loc)) {
+        window->device->write(loc - window->base, value, 1);
+        return;
+      }
+    }
+    m_backing.write_byte(loc, value);
+  }
+
+  [[nodiscard]] std::uint32_t read_word(const std::uint32_t loc) const
+  {
+    if (device_region(loc)) [[unlikely]] {
+      if (const auto *window = find_window(loc)) {
+        return window->device->read(loc - window->base, 4);
+      }
+    }
+    return m_backing.read_word(loc);
+  }
+
+  void write_word(const std::uint32_t loc, const std::uint32_t value)
+  {
+    if (device_region(loc)) [[unlikely]] {
+      if (const auto *window = find_window(loc)) {
+        window->device->write(loc - window->base, value, 4);
+        return;
+      }
+    }
+    m_backing.write_word(loc, value);
+  }
+
+  void read_words(const std::uint32_t loc, std::uint32_t *values, const std::uint32_t count) const
+  {
+    if (!device_range(loc, count * 4)) [[likely]] {
+      m_backing.read_words(loc, values, count);
+      return;
+    }
+
+    for (std::uint32_t word = 0; word < count; ++word) {
+      values[word] = read_word(loc + word * 4);
+    }
+  }
+
+  void write_words(const std::uint32_t loc, const std::uint32_t *values, const std::uint32_t count)
+  {
+    if (!device_range(loc, count * 4)) [[likely]] {
+      m_backing.write_words(loc, values, count);
+      return;
+    }
+
+    for (std::uint32_t word = 0; word < count; ++word) {
+      write_word(loc + word * 4, values[word]);
+    }
+  }
+
+  // Whether any device might be in [loc, loc + size)
+  [[nodiscard]] bool devices_in(const std::uint32_t loc, const std::uint32_t size) const noexcept
+  {
+    if (size == 0) {
+      return false;
+    }
+
+    for (std::uint64_t region = loc >> region_bits; region <= (std::uint64_t{ loc } + size - 1) >> region_bits; ++region) {
+      if (device_region(static_cast<std::uint32_t>(region << region_bits))) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Bulk transfers go straight to the backing memory unless a device is
+  // somewhere in range, then every byte is routed
+  void copy_bytes(const std::uint32_t destination, const std::uint32_t source, const std::uint32_t size)
+  {
+    if (!devices_in(destination, size) && !devices_in(source, size)) [[likely]] {
+      m_backing.copy_bytes(destination, source, size);
+      return;
+    }
+
+    if (destination <= source) {
+      for (std::uint32_t offset = 0; offset < size; ++offset) {
+        write_byte(destination + offset, read_byte(source + offset));
+      }
+    } else {
+      for (auto offset = size; offset-- > 0;) {
+        write_byte(destination + offset, read_byte(source + offset));
+      }
+    }
+  }
+
+  void fill_bytes(const std::uint32_t destination, const std::uint8_t value, const std::uint32_t size)
+  {
+    if (!devices_in(destination, size)) [[likely]] {
+      m_backing.fill_bytes(destination, value, size);
+      return;
+    }
+
+    for (std::uint32_t offset = 0; offset < size; ++offset) {
+      write_byte(destination + offset, value);
+    }
+  }
+
+private:
+  constexpr static std::uint32_t region_bits = 16;
+
+  struct Window
+  {
+    std::uint32_t base;
+    std::uint32_t size;
+    Device *device;
+  };
+
+  [[nodiscard]] bool device_region(const std::uint32_t loc) const noexcept
+  {
+    const auto region = loc >> region_bits;
+    return m_device_regions[region / 64] & (std::uint64_t{ 1 } << (region % 64));
+  }
+
+  // Block transfers are at most 64 bytes so they touch at most two regions
+  [[nodiscard]] bool device_range(const std::uint32_t loc, const std::uint32_t size) const noexcept
+  {
+    return device_region(loc) || device_region(loc + size - 1);
+  }
+
+  // Device regions can still hold RAM next to a small window, so this can miss
+  [[nodiscard]] const Window *find_window(const std::uint32_t loc) const noexcept
+  {
+    if (m_last_window < m_windows.size() && loc - m_windows[m_last_window].base < m_windows[m_last_window].size) {
+      return &m_windows[m_last_window];
+    }
+
+    for (std::size_t window = 0; window < m_windows.size(); ++window) {
+      if (loc - m_windows[window].base < m_windows[window].size) {
+        m_last_window = window;
+        return &m_windows[window];
+      }
+    }
+    return nullptr;
+  }
+
+  Backing m_backing;
+  std::array<std::uint64_t, (1u << (32 - region_bits)) / 64> m_device_regions{};
+  std::vector<Window> m_windows;
+  mutable std::size_t m_last_window{};
+};
+
+// Host side of the SWI calls guest programs use for I/O, a small
+// semihosting style set numbered by the SWI comment field (so Thumb's 8 bit
+// field reaches them too). Arguments are in r0-r2, results in r0.
+//   SWI 1  exit(status)              stops the run, r0 keeps the status
+//   SWI 2  write(fd, address, size)  fd 1 or 2, both to the host stream,
+//                                    returns bytes written
+//   SWI 3  read(fd, address, size)   fd 0, returns bytes read, 0 at the end
+//   SWI 4  clock()                   centiseconds since the host was created
+// Writes to fd 1 are collected and handed to the host stream once the buffer
+// fills, at exit and on flush(), so a guest printing a character at a time
+// doesn't cost a host call for each. Not owned by the System, copies of a
+// System share it.
+class Semihosting
+{
+public:
+  constexpr static std::uint32_t exit_call  = 1;
+  constexpr static std::uint32_t write_call = 2;
+  constexpr static std::uint32_t read_call  = 3;
+  constexpr static std::uint32_t clock_call = 4;
+
+  explicit Semihosting(std::ostream &out = std::cout, std::istream &in = std::cin, const std::size_t buffer_size = 4096)
+    : m_out{ out }, m_in{ in }, m_buffer_size{ buffer_size }
+  {
+    m_buffer.reserve(buffer_size);
+  }
+
+  Semihosting(const Semihosting &) = delete;
+  Semihosting &operator=(const Semihosting &) = delete;
+
+  ~Semihosting() { flush(); }
+
+  // Returns false for calls that don't exist
+  template<typename System_Type> [[nodiscard]] bool call(System_Type &system, const std::uint32_t number)
+  {
+    auto &registers = system.registers;
+
+    switch (number) {
+    case exit_call:
+      flush();
+      exit_status = registers[0];
+      system.write_register(15, System_Type::halt_address);
+      return true;
+    case write_call: registers[0] = write(system, registers[0], registers[1], registers[2]); return true;
+    case read_call: registers[0] = read(system, registers[0], registers[1], registers[2]); return true;
+    case clock_call:
+      registers[0] = static_cast<std::uint32_t>(
+        std::chrono::duration_cast<std::chrono::duration<std::int64_t, std::centi>>(std::chrono::steady_clock::now() - m_start).count());
+      return true;
+    default: return false;
+    }
+  }
+
+  void flush()
+  {
+    if (!m_buffer.empty()) {
+      m_out.write(m_buffer.data(), static_cast<std::streamsize>(m_buffer.size()));
+      m_out.flush();
+      m_buffer.clear();
+      ++host_writes;
+    }
+  }
+
+  std::optional<std::uint32_t> exit_status;
+  std::uint64_t host_writes{};
+
+private:
+  constexpr static std::uint32_t error = 0xFFFF'FFFF;
+
+  template<typename System_Type>
+  std::uint32_t write(System_Type &system, const std::uint32_t fd, const std::uint32_t address, const std::uint32_t size)
+  {
+    if (fd != 1 && fd != 2) {
+      return error;
+    }
+
+    for (std::uint32_t offset = 0; offset < size; ++offset) {
+      m_buffer.push_back(static_cast<char>(system.RAM.read_byte(address + offset)));
+      if (m_buffer.size() >= m_buffer_size) {
+        flush();
+      }
+    }
+
+    // errors aren't held back behind normal output
+    if (fd == 2) {
+      flush();
+    }
+    return size;
+  }
+
+  template<typename System_Type>
+  std::uint32_t read(System_Type &system, const std::uint32_t fd, const std::uint32_t address, const std::uint32_t size)
+  {
+    if (fd != 0) {
+      return error;
+    }
+
+    // a prompt has to be visible before waiting for the answer
+    flush();
+
+    // size comes from the guest, so it's read a buffer's worth at a time
+    // rather than allocated in one go
+    std::vector<char> chunk(std::min<std::size_t>(size, std::max<std::size_t>(m_buffer_size, 1)));
+    std::uint32_t count = 0;
+    while (count < size) {
+      const auto wanted = std::min<std::size_t>(size - count, chunk.size());
+      m_in.read(chunk.data(), static_cast<std::streamsize>(wanted));
+      const auto got = static_cast<std::uint32_t>(m_in.gcount());
+      for (std::uint32_t offset = 0; offset < got; ++offset, ++count) {
+        system.RAM.write_byte(address + count, static_cast<std::uint8_t>(chunk[offset]));
+        system.hooks.stored(system, address + count, static_cast<std::uint8_t>(chunk[offset]), 1);
+      }
+      if (got < wanted) {
+        break;
+      }
+    }
+    return count;
+  }
+
+  std::ostream &m_out;
+  std::istream &m_in;
+  std::size_t m_buffer_size;
+  std::string m_buffer;
+  std::chrono::steady_clock::time_point m_start{ std::chrono::steady_clock::now() };
+};
+
+// Clock rate cycle counts are turned into time at, a Game Boy Advance's ARM7TDMI
+constexpr double arm7_clock = 16'777'216.0;
+
+// ARM7TDMI cycle counts for an instruction that ran, counting sequential,
+// non-sequential and internal cycles all as one (no wait states). Loads pay
+// for the internal cycle that writes the register back, anything that
+// writes the PC pays for refilling the pipeline. Multiplies finish early
+// when the top bytes of Rs are all zeros, or all ones for the signed ones,
+// so registers has to be as it was before the instruction ran (see
+// No_Hooks::executing()). An instruction whose condition failed costs 1.
+[[nodiscard]] constexpr std::uint32_t instruction_cycles(const Instruction instruction, const Instruction_Type type,
+                                                         const std::array<std::uint32_t, 16> &registers) noexcept
+{
+  constexpr std::uint32_t refill = 2;
+
+  const auto multiplier_cycles = [&](const std::uint32_t rs, const bool is_signed) -> std::uint32_t {
+    const auto value = registers[rs];
+    for (std::uint32_t cycles = 1; cycles < 4; ++cycles) {
+      const auto top = static_cast<std::int32_t>(value) >> (cycles * 8);
+      if (top == 0 || (is_signed && top == -1)) {
+        return cycles;
+      }
+    }
+    return 4;
+  };
+
+  switch (type) {
+  case Instruction_Type::Data_Processing: {
+    const Data_Processing val = instruction;
+    const bool register_shift = !val.immediate_operand() && !val.operand_2_immediate_shift();
+    return 1 + (register_shift ? 1 : 0) + (val.destination_register() == 15 ? refill : 0);
+  }
+  case Instruction_Type::Multiply: {
+    const Multiply val = instruction;
+    return 1 + multiplier_cycles(val.operand_1(), true) + (val.accumulate() ? 1 : 0);
+  }
+  case Instruction_Type::Multiply_Long: {
+    const Multiply_Long val = instruction;
+    return 2 + multiplier_cycles(val.operand_1(), val.signed_mul()) + (val.accumulate() ? 1 : 0);
+  }
+  case Instruction_Type::Single_Data_Transfer: {
+    const Single_Data_Transfer val = instruction;
+    return val.load() ? 3 + (val.src_dest_register() == 15 ? refill : 0) : 2;
+  }
+  case Instruction_Type::Halfword_Data_Transfer: return Halfword_Data_Transfer{ instruction }.load() ? 3 : 2;
+  case Instruction_Type::Block_Data_Transfer: {
+    const Block_Data_Transfer val = instruction;
+    const auto count = static_cast<std::uint32_t>(std::popcount(instruction.data() & 0xFFFF));
+    return val.load() ? count + 2 + (val.transfers(15) ? refill : 0) : count + 1;
+  }
+  case Instruction_Type::Branch:
+  case Instruction_Type::Branch_Exchange:
+  case Instruction_Type::Thumb_Branch:
+  case Instruction_Type::Software_Interrupt: return 1 + refill;
+  // the first half only sets up lr
+  case Instruction_Type::Thumb_Branch_Link: return instruction.bit_set(11) ? 1 + refill : 1;
+  case Instruction_Type::Thumb_PC_Relative: return instruction.bit_set(26) ? 3 : 1;
+  // a load, a store and the internal cycle writing Rd
+  case Instruction_Type::Single_Data_Swap: return 4;
+  case Instruction_Type::MRS:
+  case Instruction_Type::MSR:
+  case Instruction_Type::MSRF:
+  case Instruction_Type::Undefined:
+  case Instruction_Type::Coprocessor_Data_Transfer:
+  case Instruction_Type::Coprocessor_Data_Operation:
+  case Instruction_Type::Coprocessor_Register_Transfer: return 1;
+  }
+  return 1;
+}
+
+// Execution observers, called by System::process after each instruction.
+// The defaults do nothing and compile away entirely.
+struct No_Hooks
+{
+  // start() or run() set up a new call
+  template<typename System_Type> constexpr void started(const System_Type &) noexcept {}
+  // an instruction whose condition passed is about to run, the registers still hold its inputs
+  template<typename System_Type> constexpr void executing(const System_Type &, std::uint32_t, Instruction, Instruction_Type) noexcept {}
+  template<typename System_Type> constexpr void executed(const System_Type &, std::uint32_t, Instruction, Instruction_Type) noexcept {}
+  template<typename System_Type> constexpr void skipped(const System_Type &, std::uint32_t, Instruction, Instruction_Type) noexcept {}
+  // a store of size 1 or 4 bytes, reported before executed()
+  template<typename System_Type> constexpr void stored(const System_Type &, std::uint32_t, std::uint32_t, std::uint32_t) noexcept {}
+};
+
+// Guest addresses of library routines that System runs natively when they
+// are called, normally found in the ELF symbol table (see library_entries())
+struct Library_Entries
+{
+  constexpr static std::uint32_t none = 0xFFFF'FFFF;
+
+  std::uint32_t memcpy  = none;
+  std::uint32_t memmove = none;
+  std::uint32_t memset  = none;
+};
+
+struct Fault
+{
+  std::uint32_t address;
+  Instruction_Type type;
+};
+
+enum class Stop_Reason { Halted, Budget_Exhausted, Fault };
+
+struct Run_Result
+{
+  Stop_Reason reason;
+  std::uint64_t instructions;
+};
+
+template<typename Memory = Fixed_Memory<1024>, typename Hooks = No_Hooks> struct System
+{
+  std::uint32_t CSPR{};
+  Lazy_Flags flags{};
+
+  std::array<std::uint32_t, 16> registers{};
+  Memory RAM{};
+  [[no_unique_address]] Hooks hooks{};
+
+  // Set when execution stopped at an instruction that can't be executed
+  std::optional<Fault> fault{};
+
+  // Services SWIs, without one they fault
+  Semihosting *host{};
+
+  // Guest library routines to run natively when called
+  Library_Entries library{};
+
+  constexpr static auto halt_address = Memory::halt_address;
+  constexpr static bool observed     = !std::is_same_v<Hooks, No_Hooks>;
+  constexpr static std::uint64_t max_block_length = 64;
+
+  [[nodiscard]] constexpr auto &PC() noexcept { return registers[15]; }
+  [[nodiscard]] constexpr const auto &PC() const noexcept { return registers[15]; }
+
+  System() = default;
+
+  // A System is a value, a snapshot is a copy. With Paged_Memory copies share
+  // guest memory copy-on-write, so many forks of one warmed-up state are cheap.
+  [[nodiscard]] constexpr System snapshot() const { return *this; }
+  constexpr void restore(const System &snapshot) { *this = snapshot; }
+
+  // Compares architectural state, however the flags happen to be held
+  [[nodiscard]] constexpr bool operator==(const System &other) const noexcept
+  {
+    return cspr() == other.cspr() && registers == other.registers && RAM == other.RAM;
+  }
+
+  template<std::size_t Size>
+  constexpr System(const std::array<std::uint8_t, Size> &memory) noexcept
+  {
+    static_assert(Size <= Memory::halt_address);
+
+    // Workaround for missing constexpr copy (added in C++20, not in compilers yet)
+    for (std::size_t loc = 0; loc < Size; ++loc) {
+      RAM.write_byte(static_cast<std::uint32_t>(loc), memory[loc]);
+    }
+  }
+
+  constexpr Instruction get_instruction(const std::uint32_t PC) noexcept {
+    return Instruction{ RAM.read_word(PC) };
+  }
+
+  // Sets up a call of loc that returns to the host, to be executed with run_for()
+  // Like BX, an odd address starts in Thumb
+  constexpr void start(const std::uint32_t loc) noexcept
+  {
+    registers[14] = halt_address;
+    PC()          = loc & ~1u;
+    set_or_clear_bit(CSPR, t_bit, loc & 1);
+    hooks.started(*this);
+  }
+
+  [[nodiscard]] constexpr bool halted() const noexcept { return PC() >= halt_address; }
+
+  // Continues from the current PC until the guest returns to the host,
+  // faults or has executed max_instructions, and can be called again to
+  // resume. The budget is charged once per basic block: on entering a block
+  // the address the budget runs out at is worked out, straight-line code runs
+  // until the PC stops falling through or reaches that address, and the
+  // instructions run are counted from where it stopped. A block ends at the
+  // first instruction that doesn't fall through to the next one, which is
+  // also the only way to halt or fault. A faulting instruction is left
+  // under the PC and isn't counted.
+  constexpr Run_Result run_for(const std::uint64_t max_instructions) noexcept
+  {
+    std::uint64_t remaining = max_instructions;
+
+    while (true) {
+      if (halted()) {
+        return Run_Result{ Stop_Reason::Halted, max_instructions - remaining };
+      }
+      if (fault) {
+        return Run_Result{ Stop_Reason::Fault, max_instructions - remaining };
+      }
+      if (remaining == 0) {
+        return Run_Result{ Stop_Reason::Budget_Exhausted, max_instructions };
+      }
+
+      const auto size  = instruction_size();
+      const auto start = PC();
+
+      // never fall through into the halt address
+      const auto limit = std::min({ remaining, max_block_length, std::uint64_t{ (halt_address - start) / size } });
+      const auto stop  = start + static_cast<std::uint32_t>(limit) * size;
+
+      auto next = start;
+      do {
+        next += size;
+        process_next();
+      } while (PC() == next && next != stop);
+
+      remaining -= (next - start) / size - (fault ? 1 : 0);
+      if (PC() != next && !fault) {
+        remaining -= fast_path(next - size, remaining);
+      }
+    }
+  }
+
+  constexpr void run(const std::uint32_t loc) noexcept
+  {
+    start(loc);
+    const auto &pc = PC();
+    while (pc < halt_address && !fault) {
+//      std::cout << std::hex << PC() << ':';
+//      for (const auto r : registers) {
+//        std::cout << ' ' << r;
+//      }
+
+//      std::cout << "; ";
+
+//      for (int i = 100; i < 110; ++i) {
+//        std::cout << ' ' << static_cast<std::uint16_t>(RAM[i]);
+//      }
+
+//      std::cout << '\n';
+
+      const auto from = pc;
+      process_next();
+      if (pc - from != instruction_size() && !fault) {
+        fast_path(from, std::numeric_limits<std::uint64_t>::max());
+      }
+    }
+  }
+
+  // After a jump from `from`, stands in for a call to a known library
+  // routine, or for most of a recognised copy / fill loop, with host code.
+  // Returns how many guest instructions that accounts for, 0 if there was
+  // nothing to do. Observed and compile time runs are left to the
+  // interpreter.
+  constexpr std::uint64_t fast_path(const std::uint32_t from, const std::uint64_t max_instructions)
+  {
+    if (std::is_constant_evaluated() || observed || max_instructions == 0) {
+      return 0;
+    }
+
+    if (PC() == library.memcpy || PC() == library.memmove || PC() == library.memset) {
+      return library_call();
+    }
+
+    // the loops are at most 4 instructions, entered by the branch at the end
+    if (!thumb() && PC() < from && from - PC() <= 12) {
+      return loop_idiom(max_instructions);
+    }
+    return 0;
+  }
+
+  // Bulk transfers skip devices, they have to see each access
+  [[nodiscard]] bool plain_memory(const std::uint32_t loc, const std::uint64_t size) const noexcept
+  {
+    if (std::uint64_t{ loc } + size > halt_address) {
+      return false;
+    }
+    if constexpr (requires { RAM.devices_in(loc, std::uint32_t{}); }) {
+      return !RAM.devices_in(loc, static_cast<std::uint32_t>(size));
+    }
+    return true;
+  }
+
+  // memcpy / memmove (r0 = destination, r1 = source, r2 = size) and memset
+  // (r0 = destination, r1 = value, r2 = size), counted as one instruction
+  std::uint64_t library_call()
+  {
+    const auto destination = registers[0];
+    const auto size        = registers[2];
+
+    if (PC() == library.memset) {
+      if (!plain_memory(destination, size)) {
+        return 0;
+      }
+      RAM.fill_bytes(destination, static_cast<std::uint8_t>(registers[1]), size);
+    } else {
+      if (!plain_memory(destination, size) || !plain_memory(registers[1], size)) {
+        return 0;
+      }
+      RAM.copy_bytes(destination, registers[1], size);
+    }
+
+    // return like bx lr
+    set_or_clear_bit(CSPR, t_bit, registers[14] & 1);
+    PC() = registers[14] & ~1u;
+    return 1;
+  }
+
+  // The copy and fill loops compilers and hand written code use, in ARM:
+  //   loop: [ldr(b) t, [s], #k]
+  //         str(b) t, [d], #k
+  //         subs c, c, #1  or  cmp d / s, end
+  //         bne loop
+  // All but the last iteration are done natively. The interpreter runs the
+  // last one, so the flags come out of its compare exactly as they would.
+  std::uint64_t loop_idiom(const std::uint64_t max_instructions)
+  {
+    const auto loop = PC();
+
+    // post-indexed, stepping up by the size of the transfer
+    const auto transfer = [this, loop](const std::uint32_t index, const bool load) -> std::optional<Single_Data_Transfer> {
+      const auto instruction = get_instruction(loop + index * 4);
+      if (instruction.get_condition() != Condition::AL || decode(instruction) != Instruction_Type::Single_Data_Transfer) {
+        return std::nullopt;
+      }
+
+      const Single_Data_Transfer val = instruction;
+      if (val.load() != load || val.pre_indexing() || val.write_back() || !val.up_indexing() || !val.immediate_offset()
+          || val.offset() != (val.byte_transfer() ? 1u : 4u) || val.base_register() == 15 || val.src_dest_register() == 15
+          || val.base_register() == val.src_dest_register()) {
+        return std::nullopt;
+      }
+      return val;
+    };
+
+    const auto load  = transfer(0, true);
+    const auto store = transfer(load ? 1 : 0, false);
+    if (!store
+        || (load
+            && (load->byte_transfer() != store->byte_transfer() || load->src_dest_register() != store->src_dest_register()
+                || load->base_register() == store->base_register()))) {
+      return 0;
+    }
+
+    const std::uint32_t length = load ? 4 : 3;
+    const Instruction branch   = get_instruction(loop + (length - 1) * 4);
+    if (branch.get_condition() != Condition::NE || decode(branch) != Instruction_Type::Branch || branch.bit_set(24)
+        || branch_offset(branch) != -static_cast<std::int32_t>((length + 1) * 4)) {
+      return 0;
+    }
+
+    const auto step        = store->byte_transfer() ? 1u : 4u;
+    const auto value       = store->src_dest_register();
+    const auto destination = store->base_register();
+    const auto source      = load ? load->base_register() : destination;
+    const auto written     = [&](const std::uint32_t reg) { return reg == value || reg == destination || reg == source || reg == 15; };
+
+    // iterations left, including this one
+    std::uint64_t count = 0;
+    bool counted_down   = false;
+
+    const Instruction test = get_instruction(loop + (length - 2) * 4);
+    if (test.get_condition() != Condition::AL || decode(test) != Instruction_Type::Data_Processing) {
+      return 0;
+    }
+
+    const Data_Processing compare = test;
+    if (compare.get_opcode() == OpCode::SUB && compare.set_condition_code() && compare.immediate_operand()
+        && compare.operand_2_immediate() == 1 && compare.destination_register() == compare.operand_1_register()
+        && !written(compare.destination_register())) {
+      count        = registers[compare.destination_register()];
+      counted_down = true;
+    } else if (compare.get_opcode() == OpCode::CMP && !compare.immediate_operand() && (compare.operand_2() & 0xFF0) == 0
+               && (compare.operand_1_register() == destination || compare.operand_1_register() == source)
+               && !written(compare.operand_2_register())) {
+      const auto distance = registers[compare.operand_2_register()] - registers[compare.operand_1_register()];
+      if (distance % step != 0) {
+        return 0;
+      }
+      count = distance / step;
+    } else {
+      return 0;
+    }
+
+    if (count < 2) {
+      return 0;
+    }
+
+    const auto iterations = std::min(count - 1, max_instructions / length);
+    const auto bytes      = iterations * step;
+    const auto to         = registers[destination];
+    const auto from       = registers[source];
+
+    // the stores mustn't reach the loop itself, and a copy forwards onto a
+    // later part of its source repeats bytes, which memmove doesn't
+    if (iterations == 0 || !plain_memory(to, bytes) || (load && !plain_memory(from, bytes))
+        || (to < loop + length * 4 && loop < to + bytes) || (step == 4 && ((to | from) & 3) != 0)
+        || (load && to > from && to - from < bytes)) {
+      return 0;
+    }
+
+    if (load) {
+      registers[value] = step == 1 ? RAM.read_byte(static_cast<std::uint32_t>(from + bytes - 1))
+                                   : RAM.read_word(static_cast<std::uint32_t>(from + bytes - 4));
+      RAM.copy_bytes(to, from, static_cast<std::uint32_t>(bytes));
+      registers[source] += static_cast<std::uint32_t>(bytes);
+    } else if (const auto fill = registers[value]; step == 1 || fill == (fill & 0xFF) * 0x0101'0101u) {
+      RAM.fill_bytes(to, static_cast<std::uint8_t>(fill), static_cast<std::uint32_t>(bytes));
+    } else {
+      for (std::uint64_t word = 0; word < iterations; ++word) {
+        RAM.write_word(static_cast<std::uint32_t>(to + word * 4), fill);
+      }
+    }
+
+    registers[destination] += static_cast<std::uint32_t>(bytes);
+    if (counted_down) {
+      registers[compare.destination_register()] -= static_cast<std::uint32_t>(iterations);
+    }
+    return iterations * length;
+  }
+
+  [[nodiscard]] constexpr auto get_second_operand_shift_amount(const Data_Processing val) const noexcept
+  {
+    if (val.operand_2_immediate_shift()) {
+      return val.operand_2_shift_amount();
+    } else {
+      return 0xFF & registers[val.operand_2_shift_register()];
+    }
+  }
+
+  [[nodiscard]] constexpr Shifted shift_register(const bool c_flag, const Shift_Type type, std::uint32_t shift_amount, std::uint32_t value) const noexcept
+  {
+    switch (type) {
+    case Shift_Type::Logical_Left:
+      if (shift_amount == 0) {
+        return { c_flag, value };
+      } else {
+        return { (value & (1 << (32 - shift_amount))) != 0, value << shift_amount };
+      }
+    case Shift_Type::Logical_Right:
+      if (shift_amount == 0) {
+        return { (value & (1 << 31)) != 0, 0 };
+      } else {
+        return { (value & (1 << (shift_amount - 1))) != 0, value >> shift_amount };
+      }
+    case Shift_Type::Arithmetic_Right:
+      if (shift_amount == 0) {
+        const bool is_negative = value & (1 << 31);
+        return { is_negative, is_negative ? 0xFFFF'FFFFu : 0u };
+      } else {
+        return { (value & (1 << (shift_amount - 1))) != 0, static_cast<std::uint32_t>(static_cast<std::int32_t>(value) >> shift_amount) };
+      }
+    case Shift_Type::Rotate_Right:
+      if (shift_amount == 0) {
+        // This is rotate_right_extended
+        return { (value & 1) != 0, (std::uint32_t{ c_flag } << 31) | (value >> 1) };
+      } else {
+        return { (value & (1 << (shift_amount - 1))) != 0, (value >> shift_amount) | (value << (32 - shift_amount)) };
+      }
+    }
+
+    // Shift_Type only has the four values above
+    __builtin_unreachable();
+  }
+
+  // A shift by the bottom byte of a register. Unlike an immediate amount, 0
+  // leaves the value and carry alone, and amounts of 32 or more are allowed.
+  [[nodiscard]] constexpr Shifted shift_by_register(const bool c_flag, const Shift_Type type, const std::uint32_t shift_amount, const std::uint32_t value) const noexcept
+  {
+    if (shift_amount == 0) {
+      return { c_flag, value };
+    }
+    if (shift_amount < 32) {
+      return shift_register(c_flag, type, shift_amount, value);
+    }
+
+    const bool top_bit = (value >> 31) != 0;
+    switch (type) {
+    case Shift_Type::Logical_Left: return { shift_amount == 32 && (value & 1) != 0, 0 };
+    case Shift_Type::Logical_Right: return { shift_amount == 32 && top_bit, 0 };
+    case Shift_Type::Arithmetic_Right: return { top_bit, top_bit ? 0xFFFF'FFFFu : 0u };
+    case Shift_Type::Rotate_Right:
+      if (shift_amount % 32 == 0) {
+        return { top_bit, value };
+      }
+      return shift_register(c_flag, type, shift_amount % 32, value);
+    }
+
+    // Shift_Type only has the four values above
+    __builtin_unreachable();
+  }
+
+  [[nodiscard]] constexpr Shifted get_second_operand(const Data_Processing val) const noexcept
+  {
+    if (val.immediate_operand()) {
+      return { c_flag(), val.operand_2_immediate() };
+    } else if (val.operand_2_immediate_shift()) {
+      return shift_register(c_flag(), val.operand_2_shift_type(), val.operand_2_shift_amount(), registers[val.operand_2_register()]);
+    } else {
+      return shift_by_register(c_flag(), val.operand_2_shift_type(), get_second_operand_shift_amount(val), registers[val.operand_2_register()]);
+    }
+  }
+
+  constexpr auto offset(const Single_Data_Transfer val) const noexcept {
+    const auto offset = [=]() -> std::int32_t {
+      if (val.immediate_offset()) {
+        return val.offset();
+      } else {
+        const auto offset_register = registers[val.offset_register()];
+        // note: carry out seems to have no use with Single_Data_Transfer
+        return shift_register(c_flag(), val.offset_shift_type(), val.offset_shift_amount(), offset_register).value;
+      }
+    }();
+
+    if (val.up_indexing()) {
+      return offset;
+    } else {
+      return -offset;
+    }
+  }
+
+  constexpr void single_data_transfer(const Single_Data_Transfer val) noexcept {
+    const std::int32_t index_offset = offset(val);
+    const auto base_location = registers[val.base_register()];
+    const bool pre_indexed = val.pre_indexing();
+
+    const auto src_dest_register = val.src_dest_register();
+    const auto indexed_location = base_location + index_offset;
+
+    if (val.byte_transfer()) {
+      if (const auto location = pre_indexed ? indexed_location : base_location; val.load()) {
+        write_register(src_dest_register, RAM.read_byte(location));
+      } else {
+        RAM.write_byte(location, static_cast<std::uint8_t>(registers[src_dest_register]));
+        hooks.stored(*this, location, registers[src_dest_register] & 0xFF, 1);
+      }
+    } else {
+      // word transfer
+      if (const auto location = pre_indexed ? indexed_location : base_location; val.load()) {
+        write_register(src_dest_register, RAM.read_word(location));
+      } else {
+        RAM.write_word(location, registers[src_dest_register]);
+        hooks.stored(*this, location, registers[src_dest_register], 4);
+      }
+    }
+
+    if (!pre_indexed || val.write_back()) {
+      registers[val.base_register()] = indexed_location;
+    }
+  }
+
+  constexpr void data_processing(const Data_Processing val) noexcept
+  {
+    const auto first_operand        = registers[val.operand_1_register()];
+    const auto shifted              = get_second_operand(val);
+    const auto second_operand       = shifted.value;
+    const auto destination_register = val.destination_register();
+    const auto opcode               = val.get_opcode();
+
+    // use 64 bit operations to be able to capture carry
+    const std::uint64_t op_1 = first_operand;
+    const std::uint64_t op_2 = second_operand;
+
+    // One switch and one flag update, rather than a lambda per operation,
+    // so a compile time run has as little as possible to evaluate
+    std::uint64_t result = 0;
+    bool arithmetic      = true;
+
+    switch (opcode) {
+    // Logical Operations
+    case OpCode::AND:
+    case OpCode::TST: result = first_operand & second_operand; arithmetic = false; break;
+    case OpCode::EOR:
+    case OpCode::TEQ: result = first_operand ^ second_operand; arithmetic = false; break;
+    case OpCode::ORR: result = first_operand | second_operand; arithmetic = false; break;
+    case OpCode::MOV: result = second_operand; arithmetic = false; break;
+    case OpCode::BIC: result = first_operand & ~second_operand; arithmetic = false; break;
+    case OpCode::MVN: result = static_cast<std::uint32_t>(~second_operand); arithmetic = false; break;
+
+    // Arithmetic Operations
+    case OpCode::SUB:
+    case OpCode::CMP: result = op_1 - op_2; break;
+    case OpCode::RSB: result = op_2 - op_1; break;
+    case OpCode::ADD:
+    case OpCode::CMN: result = op_1 + op_2; break;
+    case OpCode::ADC: result = op_1 + op_2 + c_flag(); break;
+    case OpCode::SBC: result = op_1 - op_2 + c_flag() - 1; break;
+    case OpCode::RSC: result = op_2 - op_1 + c_flag() - 1; break;
+    }
+
+    if (val.set_condition_code() && destination_register != 15) {
+      if (arithmetic) {
+        // operands in the order they are subtracted in
+        const bool subtract = opcode == OpCode::SUB || opcode == OpCode::CMP || opcode == OpCode::SBC || opcode == OpCode::RSB
+                              || opcode == OpCode::RSC;
+        const bool reversed = opcode == OpCode::RSB || opcode == OpCode::RSC;
+        set_flags(Lazy_Flags{ Flag_Source::Arithmetic, false, subtract, reversed ? second_operand : first_operand,
+                              reversed ? first_operand : second_operand, result });
+      } else {
+        set_flags(Lazy_Flags{ Flag_Source::Logical, shifted.carry, false, 0, 0, result });
+      }
+    }
+
+    // TST, TEQ, CMP and CMN only set the flags
+    if (opcode < OpCode::TST || opcode > OpCode::CMN) {
+      write_register(destination_register, static_cast<std::uint32_t>(result));
+    }
+  }
+
+  constexpr void branch(const Instruction instruction) noexcept
+  {
+    if (instruction.bit_set(24)) {
+      // Link bit set
+      registers[14] = PC()-4;
+    }
+
+    PC() += branch_offset(instruction) + 4;
+  }
+
+  constexpr void multiply_long(const Multiply_Long val) noexcept
+  {
+    const auto product = [val, lhs = registers[val.operand_1()], rhs = registers[val.operand_2()]]() -> std::uint64_t {
+      if (val.signed_mul()) {
+        return static_cast<std::uint64_t>(std::int64_t{ static_cast<std::int32_t>(lhs) } * std::int64_t{ static_cast<std::int32_t>(rhs) });
+      } else {
+        return std::uint64_t{ lhs } * std::uint64_t{ rhs };
+      }
+    }();
+
+    // accumulates into RdHi:RdLo as one 64 bit value, so the low word carries into the high one
+    const auto accumulator = (std::uint64_t{ registers[val.high_result()] } << 32) | registers[val.low_result()];
+    const auto result      = val.accumulate() ? product + accumulator : product;
+
+    registers[val.high_result()] = static_cast<std::uint32_t>(result >> 32);
+    registers[val.low_result()]  = static_cast<std::uint32_t>(result);
+
+    if (val.status_register_update()) {
+      set_flags(Lazy_Flags{ Flag_Source::Multiply_Long, false, false, 0, 0, result });
+    }
+  }
+
+  constexpr void multiply(const Multiply val) noexcept
+  {
+    auto result = registers[val.operand_2()] * registers[val.operand_1()];
+    if (val.accumulate()) {
+      result += registers[val.accumulate_register()];
+    }
+
+    registers[val.destination_register()] = result;
+
+    if (val.set_condition_code()) {
+      // MUL sets N and Z only, which is a logical result that keeps the current carry
+      set_flags(Lazy_Flags{ Flag_Source::Logical, c_flag(), false, 0, 0, result });
+    }
+  }
+
+  // LDM / STM. The register list is gathered into (or scattered from) one
+  // contiguous buffer so memory sees a single block transfer. The S bit
+  // (user bank / SPSR restore) has no meaning without processor modes and is
+  // ignored.
+  constexpr void block_data_transfer(const Block_Data_Transfer val) noexcept
+  {
+    const auto count = val.register_count();
+    const auto base  = registers[val.base_register()];
+
+    // the lowest register always goes to the lowest address
+    const auto start = [&]() -> std::uint32_t {
+      if (val.up_indexing()) {
+        return val.pre_indexing() ? base + 4 : base;
+      } else {
+        return val.pre_indexing() ? base - count * 4 : base - count * 4 + 4;
+      }
+    }();
+
+    std::array<std::uint32_t, 16> values{};
+
+    if (val.load()) {
+      RAM.read_words(start, values.data(), count);
+
+      if (val.write_back()) {
+        registers[val.base_register()] = val.up_indexing() ? base + count * 4 : base - count * 4;
+      }
+
+      // loaded values win over the written back base
+      for (std::uint32_t reg = 0, word = 0; reg < 16; ++reg) {
+        if (val.transfers(reg)) {
+          write_register(reg, values[word++]);
+        }
+      }
+    } else {
+      for (std::uint32_t reg = 0, word = 0; reg < 16; ++reg) {
+        if (val.transfers(reg)) {
+          values[word++] = registers[reg];
+        }
+      }
+
+      RAM.write_words(start, values.data(), count);
+      if constexpr (observed) {
+        for (std::uint32_t word = 0; word < count; ++word) {
+          hooks.stored(*this, start + word * 4, values[word], 4);
+        }
+      }
+
+      if (val.write_back()) {
+        registers[val.base_register()] = val.up_indexing() ? base + count * 4 : base - count * 4;
+      }
+    }
+  }
+
+  // Writes to the PC land on the target address, process() takes the size of
+  // an instruction back off after every instruction to undo the prefetch
+  // (see branch()). In Thumb state bit 0 of the target is ignored, so
+  // `mov pc, lr` after a bl stays halfword aligned
+  constexpr void write_register(const std::uint32_t reg, const std::uint32_t value) noexcept
+  {
+    registers[reg] = reg == 15 ? (thumb() ? value & ~1u : value) + instruction_size() : value;
+  }
+
+  // LDRH / STRH / LDRSB / LDRSH, as single_data_transfer with an 8 bit offset
+  constexpr void halfword_data_transfer(const Halfword_Data_Transfer val) noexcept
+  {
+    const auto offset           = val.immediate_offset() ? val.offset() : registers[val.offset_register()];
+    const auto base_location    = registers[val.base_register()];
+    const auto indexed_location = val.up_indexing() ? base_location + offset : base_location - offset;
+    const auto location         = val.pre_indexing() ? indexed_location : base_location;
+
+    const auto src_dest_register = val.src_dest_register();
+
+    if (val.load()) {
+      if (val.halfword()) {
+        const auto value = static_cast<std::uint16_t>(RAM.read_byte(location) | (RAM.read_byte(location + 1) << 8));
+        write_register(src_dest_register, val.signed_transfer() ? static_cast<std::uint32_t>(static_cast<std::int16_t>(value)) : value);
+      } else {
+        write_register(src_dest_register, static_cast<std::uint32_t>(static_cast<std::int8_t>(RAM.read_byte(location))));
+      }
+    } else {
+      const auto value = registers[src_dest_register];
+      RAM.write_byte(location, static_cast<std::uint8_t>(value));
+      RAM.write_byte(location + 1, static_cast<std::uint8_t>(value >> 8));
+      hooks.stored(*this, location, value & 0xFF, 1);
+      hooks.stored(*this, location + 1, (value >> 8) & 0xFF, 1);
+    }
+
+    if (!val.pre_indexing() || val.write_back()) {
+      registers[val.base_register()] = indexed_location;
+    }
+  }
+
+  // BX, bit 0 of the target selects Thumb
+  constexpr void branch_exchange(const Instruction instruction) noexcept
+  {
+    const auto target = registers[instruction.data() & 0b1111];
+    const auto size   = instruction_size();  // of this instruction, the one process() undoes
+
+    set_or_clear_bit(CSPR, t_bit, target & 1);
+    PC() = (target & ~1u) + size;
+  }
+
+  // Thumb B and B<cond>, the byte offset is in the bottom 28 bits (see get_thumb_table())
+  constexpr void thumb_branch(const Instruction instruction) noexcept
+  {
+    const auto offset = static_cast<std::int32_t>(instruction.data() << 4) >> 4;
+    PC() += static_cast<std::uint32_t>(offset) + 2;
+  }
+
+  // Thumb BL is two instructions: the first leaves PC plus the high part of
+  // the offset in LR, the second adds the low part and branches
+  constexpr void thumb_branch_link(const Instruction instruction) noexcept
+  {
+    const auto offset = instruction.data() & 0x7FF;
+
+    if (!instruction.bit_set(11)) {
+      registers[14] = PC() + (static_cast<std::uint32_t>(static_cast<std::int32_t>(offset << 21) >> 21) << 12);
+    } else {
+      const auto return_address = PC() - 2;
+      PC()                      = registers[14] + (offset << 1) + 2;
+      registers[14]             = return_address | 1;
+    }
+  }
+
+  // Thumb LDR Rd, [PC, #imm] and ADD Rd, PC, #imm see the PC word aligned
+  constexpr void thumb_pc_relative(const Instruction instruction) noexcept
+  {
+    const auto pc = PC();
+    PC() &= ~3u;
+    if (decode(instruction) == Instruction_Type::Single_Data_Transfer) {
+      single_data_transfer(instruction);
+    } else {
+      data_processing(instruction);
+    }
+    PC() = pc;
+  }
+
+  constexpr static auto n_bit = 0b1000'0000'0000'0000'0000'0000'0000'0000;
+  constexpr static auto z_bit = 0b0100'0000'0000'0000'0000'0000'0000'0000;
+  constexpr static auto c_bit = 0b0010'0000'0000'0000'0000'0000'0000'0000;
   constexpr static auto v_bit = 0b0001'0000'0000'0000'0000'0000'0000'0000;
+  constexpr static auto t_bit = 0b0000'0000'0000'0000'0000'0000'0010'0000;
+
+  // Executing Thumb code
+  [[nodiscard]] constexpr bool thumb() const noexcept { return CSPR & t_bit; }
+  [[nodiscard]] constexpr std::uint32_t instruction_size() const noexcept { return thumb() ? 2 : 4; }
+
+  constexpr static void set_or_clear_bit(std::uint32_t &val, const std::uint32_t bit, const bool set)
+  {
+    if (set) {
+      val |= bit;
+    } else {
+      val &= ~bit;
+    }
+  }
+
+
+  // Which of N, Z, C, V a flag source determines, the rest come from CSPR
+  [[nodiscard]] constexpr static std::uint32_t flags_written(const Flag_Source source) noexcept
+  {
+    switch (source) {
+    case Flag_Source::CSPR: return 0;
+    case Flag_Source::Logical: return n_bit | z_bit | c_bit;
+    case Flag_Source::Arithmetic: return n_bit | z_bit | c_bit | v_bit;
+    case Flag_Source::Multiply_Long: return n_bit | z_bit;
+    }
+    return 0;
+  }
+
+  constexpr void set_flags(const Lazy_Flags &new_flags) noexcept
+  {
+    // only fold the pending result into CSPR if the new one doesn't replace all of it
+    if ((flags_written(flags.source) & ~flags_written(new_flags.source)) != 0) {
+      materialize_flags();
+    }
+    flags = new_flags;
+  }
+
+  // Replaces the status register, dropping any pending flag result
+  constexpr void set_cspr(const std::uint32_t value) noexcept
+  {
+    CSPR  = value;
+    flags = Lazy_Flags{};
+  }
+
+  constexpr void materialize_flags() noexcept
+  {
+    if (flags.source != Flag_Source::CSPR) {
+      CSPR  = cspr();
+      flags = Lazy_Flags{};
+    }
+  }
+
+  [[nodiscard]] constexpr std::uint32_t cspr() const noexcept { return (CSPR & ~(n_bit | z_bit | c_bit | v_bit)) | (nzcv() << 28); }
+
+  // The condition flags as a nibble, N in bit 3 down to V in bit 0, derived
+  // in one go rather than flag by flag
+  [[nodiscard]] constexpr std::uint32_t nzcv() const noexcept
+  {
+    const auto stored = CSPR >> 28;
+    const auto n      = static_cast<std::uint32_t>(flags.result >> 31) & 1;
+    const auto z      = static_cast<std::uint32_t>(static_cast<std::uint32_t>(flags.result) == 0);
+
+    switch (flags.source) {
+    case Flag_Source::CSPR: return stored;
+    case Flag_Source::Logical: return (n << 3) | (z << 2) | (static_cast<std::uint32_t>(flags.carry) << 1) | (stored & 0b0001);
+    case Flag_Source::Arithmetic:
+      return (n << 3) | (z << 2) | (static_cast<std::uint32_t>(c_flag()) << 1) | static_cast<std::uint32_t>(v_flag());
+    case Flag_Source::Multiply_Long:
+      return ((static_cast<std::uint32_t>(flags.result >> 63) & 1) << 3) | (static_cast<std::uint32_t>(flags.result == 0) << 2)
+             | (stored & 0b0011);
+    }
+    return stored;
+  }
+
+  constexpr bool n_flag() const noexcept
+  {
+    switch (flags.source) {
+    case Flag_Source::Logical:
+    case Flag_Source::Arithmetic: return flags.result & (1u << 31);
+    case Flag_Source::Multiply_Long: return flags.result & (static_cast<std::uint64_t>(1) << 63);
+    case Flag_Source::CSPR: break;
+    }
+    return CSPR & n_bit;
+  }
+  constexpr void n_flag(const bool val) noexcept { materialize_flags(); set_or_clear_bit(CSPR, n_bit, val); }
+
+  constexpr bool z_flag() const noexcept
+  {
+    switch (flags.source) {
+    case Flag_Source::Logical:
+    case Flag_Source::Arithmetic: return static_cast<std::uint32_t>(flags.result) == 0;
+    case Flag_Source::Multiply_Long: return flags.result == 0;
+    case Flag_Source::CSPR: break;
+    }
+    return CSPR & z_bit;
+  }
+  constexpr void z_flag(const bool val) noexcept { materialize_flags(); set_or_clear_bit(CSPR, z_bit, val); }
+
+  constexpr bool c_flag() const noexcept
+  {
+    switch (flags.source) {
+    case Flag_Source::Logical: return flags.carry;
+    // C is the carry out of an add, and no borrow out of a subtract
+    case Flag_Source::Arithmetic: return ((flags.result >> 32) & 1) != static_cast<std::uint64_t>(flags.subtract);
+    case Flag_Source::Multiply_Long:
+    case Flag_Source::CSPR: break;
+    }
+    return CSPR & c_bit;
+  }
+  constexpr void c_flag(const bool val) noexcept { materialize_flags(); set_or_clear_bit(CSPR, c_bit, val); }
+
+  constexpr bool v_flag() const noexcept
+  {
+    if (flags.source == Flag_Source::Arithmetic) {
+      const auto first_op_sign  = flags.first_operand & (1u << 31);
+      const auto second_op_sign = flags.second_operand & (1u << 31);
+      const auto result_sign    = static_cast<std::uint32_t>(flags.result) & (1u << 31);
+
+      // an add overflows when both operands have the same sign and the result
+      // doesn't, a subtract when the operands differ in sign and the result
+      // doesn't have the first one's
+      return ((first_op_sign == second_op_sign) != flags.subtract) && (result_sign != first_op_sign);
+    }
+    return CSPR & v_bit;
+  }
+  constexpr void v_flag(const bool val) noexcept { materialize_flags(); set_or_clear_bit(CSPR, v_bit, val); }
+
+  //  constexpr void process_instruction
+  [[nodiscard]] constexpr bool check_condition(const Instruction instruction) const noexcept
+  {
+    const auto condition = instruction.get_condition();
+
+    // most instructions are unconditional and don't need the flags at all
+    if (condition == Condition::AL) {
+      return true;
+    }
+
+    return (condition_table[static_cast<std::size_t>(condition)] >> nzcv()) & 1;
+  }
+
+  constexpr static auto lookup_table = get_lookup_table();
+
+  [[nodiscard]] constexpr static auto decode(const Instruction instruction) noexcept
+  {
+    if (const auto type = arm_decode_table[arm_decode_key(instruction)]; type != needs_search) {
+      return static_cast<Instruction_Type>(type);
+    }
+
+    for (const auto &elem : lookup_table) {
+      if ((std::get<0>(elem) & instruction) == std::get<1>(elem)) {
+        return std::get<2>(elem);
+      }
+    }
+
+    return Instruction_Type::Undefined;
+  }
+
+  // Runs a decoded instruction, shared by ARM and Thumb. Returns false for
+  // instructions that can't be executed.
+  [[nodiscard]] constexpr bool execute(const Instruction instruction, const Instruction_Type type) noexcept
+  {
+    switch (type) {
+    case Instruction_Type::Data_Processing: data_processing(instruction); return true;
+    case Instruction_Type::Multiply: multiply(instruction); return true;
+    case Instruction_Type::Multiply_Long: multiply_long(instruction); return true;
+    case Instruction_Type::Single_Data_Transfer: single_data_transfer(instruction); return true;
+    case Instruction_Type::Halfword_Data_Transfer: halfword_data_transfer(instruction); return true;
+    case Instruction_Type::Block_Data_Transfer: block_data_transfer(instruction); return true;
+    case Instruction_Type::Branch: branch(instruction); return true;
+    case Instruction_Type::Branch_Exchange: branch_exchange(instruction); return true;
+    case Instruction_Type::Thumb_Branch: thumb_branch(instruction); return true;
+    case Instruction_Type::Thumb_Branch_Link: thumb_branch_link(instruction); return true;
+    case Instruction_Type::Thumb_PC_Relative: thumb_pc_relative(instruction); return true;
+    case Instruction_Type::Software_Interrupt: return host != nullptr && host->call(*this, instruction.data() & 0x00FF'FFFF);
+    // Not implemented, or undefined
+    case Instruction_Type::MRS:
+    case Instruction_Type::MSR:
+    case Instruction_Type::MSRF:
+    case Instruction_Type::Single_Data_Swap:
+    case Instruction_Type::Undefined:
+    case Instruction_Type::Coprocessor_Data_Transfer:
+    case Instruction_Type::Coprocessor_Data_Operation:
+    case Instruction_Type::Coprocessor_Register_Transfer: return false;
+    }
+    return false;
+  }
+
+  [[nodiscard]] constexpr std::uint16_t get_thumb_instruction(const std::uint32_t loc) noexcept
+  {
+    return static_cast<std::uint16_t>(RAM.read_word(loc & ~3u) >> ((loc & 2) * 8));
+  }
+
+  // Executes the instruction at PC, in whichever state the processor is in
+  constexpr void process_next() noexcept
+  {
+    if (thumb()) {
+      process_thumb(get_thumb_instruction(PC()));
+    } else {
+      process(get_instruction(PC()));
+    }
+  }
+
+  constexpr void process(const Instruction instruction) noexcept
+  {
+    // one lookup of the PC, every PC() is a std::array access, which is
+    // what a compile time run spends most of its budget on
+    auto &pc       = PC();
+    const auto loc = pc;
+
+    // account for prefetch
+    pc += 8;
+    if (check_condition(instruction)) {
+      const auto type = decode(instruction);
+      if constexpr (observed) {
+        hooks.executing(*this, loc, instruction, type);
+      }
+      if (!execute(instruction, type)) {
+        pc    = loc;
+        fault = Fault{ loc, type };
+        return;
+      }
+
+      // discount prefetch
+      pc -= 4;
+      if constexpr (observed) {
+        hooks.executed(*this, loc, instruction, type);
+      }
+    } else {
+      // discount prefetch
+      pc -= 4;
+      if constexpr (observed) {
+        hooks.skipped(*this, loc, instruction, decode(instruction));
+      }
+    }
+  }
+
+
+  // Thumb instructions are translated to ARM and run by the same handlers.
+  // The PC reads 4 ahead instead of 8.
+  constexpr void process_thumb(const std::uint16_t thumb_instruction) noexcept
+  {
+    auto &pc                       = PC();
+    const auto loc                 = pc;
+    const auto [instruction, type] = decode_thumb(thumb_instruction);
+
+    // account for prefetch
+    pc += 4;
+    if (check_condition(Instruction{ instruction })) {
+      if constexpr (observed) {
+        hooks.executing(*this, loc, Instruction{ instruction }, type);
+      }
+      if (!execute(Instruction{ instruction }, type)) {
+        pc    = loc;
+        fault = Fault{ loc, type };
+        return;
+      }
+
+      // discount prefetch
+      pc -= 2;
+      if constexpr (observed) {
+        hooks.executed(*this, loc, Instruction{ instruction }, type);
+      }
+    } else {
+      // discount prefetch
+      pc -= 2;
+      if constexpr (observed) {
+        hooks.skipped(*this, loc, Instruction{ instruction }, type);
+      }
+    }
+  }
+
+};
+
+// Hooks that build an execution profile: how often each PC ran, the mix of
+// instruction types and data processing opcodes, and how often each
+// conditional branch was taken. Instructions whose condition failed are
+// counted as well, they still cost a fetch and a decode.
+struct Profiler : No_Hooks
+{
+  struct Branch_Counts
+  {
+    std::uint64_t taken{};
+    std::uint64_t not_taken{};
+  };
+
+  std::uint64_t instructions{};
+  std::uint64_t condition_failed{};
+  std::uint64_t cycles{};
+  std::unordered_map<std::uint32_t, std::uint64_t> pc_counts;
+  std::array<std::uint64_t, instruction_type_count> type_counts{};
+  std::array<std::uint64_t, instruction_type_count> type_cycles{};
+  std::array<std::uint64_t, 16> opcode_counts{};
+  std::unordered_map<std::uint32_t, Branch_Counts> branches;
+  std::uint32_t pending_cycles{};
+
+  // the cost depends on the registers before the instruction runs, a multiply may overwrite its Rs
+  template<typename System_Type>
+  void executing(const System_Type &system, std::uint32_t, const Instruction instruction, const Instruction_Type type) noexcept
+  {
+    pending_cycles = instruction_cycles(instruction, type, system.registers);
+  }
+
+  template<typename System_Type> void executed(const System_Type &, const std::uint32_t pc, const Instruction instruction, const Instruction_Type type)
+  {
+    count(pc, instruction, type, true, pending_cycles);
+  }
+
+  template<typename System_Type>
+  void skipped(const System_Type &, const std::uint32_t pc, const Instruction instruction, const Instruction_Type type)
+  {
+    ++condition_failed;
+    count(pc, instruction, type, false, 1);
+  }
+
+  void report(std::ostream &out, const std::size_t hot_spots = 20) const
+  {
+    const auto percent = [total = static_cast<double>(instructions)](const std::uint64_t value) { return 100.0 * value / total; };
+
+    out << "instructions: " << instructions << " (" << condition_failed << " condition failed)\n";
+    out << "cycles: " << cycles << " (" << static_cast<double>(cycles) / static_cast<double>(instructions) << " per instruction, "
+        << static_cast<double>(cycles) / arm7_clock * 1000.0 << " ms on a " << arm7_clock / 1'000'000 << " MHz ARM7TDMI)\n";
+
+    std::vector<std::pair<std::uint32_t, std::uint64_t>> hottest(pc_counts.begin(), pc_counts.end());
+    std::sort(hottest.begin(), hottest.end(), [](const auto &lhs, const auto &rhs) { return lhs.second > rhs.second; });
+    hottest.resize(std::min(hottest.size(), hot_spots));
+
+    out << "\nhot spots:\n";
+    for (const auto &[pc, count] : hottest) {
+      out << "  0x" << std::hex << pc << std::dec << ' ' << count << " (" << percent(count) << "%)\n";
+    }
+
+    out << "\ninstruction mix:\n";
+    for (std::size_t type = 0; type < type_counts.size(); ++type) {
+      if (type_counts[type] != 0) {
+        out << "  " << to_string(static_cast<Instruction_Type>(type)) << ' ' << type_counts[type] << " (" << percent(type_counts[type])
+            << "%), " << type_cycles[type] << " cycles\n";
+      }
+    }
+
+    out << "\ndata processing opcodes:\n";
+    for (std::size_t opcode = 0; opcode < opcode_counts.size(); ++opcode) {
+      if (opcode_counts[opcode] != 0) {
+        out << "  " << to_string(static_cast<OpCode>(opcode)) << ' ' << opcode_counts[opcode] << '\n';
+      }
+    }
+
+    std::vector<std::pair<std::uint32_t, Branch_Counts>> sorted_branches(branches.begin(), branches.end());
+    std::sort(sorted_branches.begin(), sorted_branches.end(), [](const auto &lhs, const auto &rhs) {
+      return lhs.second.taken + lhs.second.not_taken > rhs.second.taken + rhs.second.not_taken;
+    });
+    sorted_branches.resize(std::min(sorted_branches.size(), hot_spots));
+
+    out << "\nbranches (taken / not taken):\n";
+    for (const auto &[pc, counts] : sorted_branches) {
+      out << "  0x" << std::hex << pc << std::dec << ' ' << counts.taken << " / " << counts.not_taken << " ("
+          << 100.0 * counts.taken / (counts.taken + counts.not_taken) << "% taken)\n";
+    }
+  }
+
+private:
+  void count(const std::uint32_t pc, const Instruction instruction, const Instruction_Type type, const bool executed, const std::uint32_t cost)
+  {
+    ++instructions;
+    cycles += cost;
+    ++pc_counts[pc];
+    ++type_counts[static_cast<std::size_t>(type)];
+    type_cycles[static_cast<std::size_t>(type)] += cost;
+
+    if (type == Instruction_Type::Data_Processing) {
+      ++opcode_counts[static_cast<std::size_t>(Data_Processing{ instruction }.get_opcode())];
+    } else if (type == Instruction_Type::Branch || type == Instruction_Type::Thumb_Branch) {
+      auto &counts = branches[pc];
+      ++(executed ? counts.taken : counts.not_taken);
+    }
+  }
+};
+
+// Hooks that only count cycles (see instruction_cycles()), for an estimate
+// of how long guest code would take on hardware
+struct Cycle_Counter : No_Hooks
+{
+  std::uint64_t instructions{};
+  std::uint64_t cycles{};
+  std::uint32_t pending_cycles{};
+
+  // the cost depends on the registers before the instruction runs, a multiply may overwrite its Rs
+  template<typename System_Type>
+  constexpr void executing(const System_Type &system, std::uint32_t, const Instruction instruction, const Instruction_Type type) noexcept
+  {
+    pending_cycles = instruction_cycles(instruction, type, system.registers);
+  }
+
+  template<typename System_Type> constexpr void executed(const System_Type &, std::uint32_t, Instruction, Instruction_Type) noexcept
+  {
+    ++instructions;
+    cycles += pending_cycles;
+  }
+
+  template<typename System_Type> constexpr void skipped(const System_Type &, std::uint32_t, Instruction, Instruction_Type) noexcept
+  {
+    ++instructions;
+    ++cycles;
+  }
+
+  // at arm7_clock
+  [[nodiscard]] double seconds() const noexcept { return static_cast<double>(cycles) / arm7_clock; }
+};
+
+// Hooks that record execution as a compact binary trace, so a run can be
+// examined offline and the state after any recorded instruction rebuilt
+// with replay() instead of executing the guest again.
+//
+// Each instruction is one record, changes are stored relative to the state
+// before it: a header byte saying what changed, then zigzag LEB128 deltas of
+// the changed registers, the PC if it didn't just advance by 4, the flags,
+// and the addresses (relative to the previous store) and values of memory
+// stores. Arithmetic and loads usually take 3-4 bytes.
+//
+// Records go in chunks. Past `capacity` bytes the oldest chunk is folded
+// into the base state the trace starts from, so the trace keeps the most
+// recent part of the run, like a ring buffer, and memory is bounded by the
+// guest's working set rather than by the length of the run.
+class Trace_Recorder : public No_Hooks
+{
+public:
+  std::size_t capacity{ std::size_t{ 64 } << 20 };  // bytes of records to keep
+
+  template<typename System_Type> void started(const System_Type &system)
+  {
+    m_base   = Base_State{ State{ system.registers, system.cspr() }, {}, 0 };
+    m_last   = m_base.state;
+    m_chunks.clear();
+    m_stores.clear();
+    m_last_store   = 0;
+    m_size         = 0;
+    m_instructions = 0;
+  }
+
+  template<typename System_Type> void executed(const System_Type &system, std::uint32_t, Instruction, Instruction_Type)
+  {
+    record(system.registers, system.cspr());
+  }
+
+  template<typename System_Type> void skipped(const System_Type &system, std::uint32_t, Instruction, Instruction_Type)
+  {
+    record(system.registers, system.cspr());
+  }
+
+  template<typename System_Type> void stored(const System_Type &, const std::uint32_t address, const std::uint32_t value, const std::uint32_t size)
+  {
+    m_stores.push_back(Store{ address, value, size });
+  }
+
+  // Instructions recorded since started, and the first one still in the trace
+  [[nodiscard]] std::uint64_t instructions() const noexcept { return m_instructions; }
+  [[nodiscard]] std::uint64_t first_instruction() const noexcept { return m_base.instructions; }
+  [[nodiscard]] std::size_t size() const noexcept { return m_size; }
+
+  // Rebuilds the state after `instruction` instructions. system has to hold
+  // the state tracing started from, for instance a snapshot taken then.
+  template<typename System_Type> void replay(System_Type &system, const std::uint64_t instruction) const
+  {
+    if (instruction < m_base.instructions || instruction > m_instructions) {
+      throw std::out_of_range("instruction is not in the trace");
+    }
+
+    for (const auto &[address, value] : m_base.memory) {
+      system.RAM.write_byte(address, value);
+    }
+
+    auto state     = m_base.state;
+    auto remaining = instruction - m_base.instructions;
+    for (auto chunk = m_chunks.begin(); chunk != m_chunks.end() && remaining != 0; ++chunk) {
+      const auto records = std::min(remaining, chunk->instructions);
+      decode(*chunk, records, state, [&](const Store &store) {
+        if (store.size == 1) {
+          system.RAM.write_byte(store.address, static_cast<std::uint8_t>(store.value));
+        } else {
+          system.RAM.write_word(store.address, store.value);
+        }
+      });
+      remaining -= records;
+    }
+
+    system.registers = state.registers;
+    system.set_cspr(state.cspr);
+  }
+
+private:
+  constexpr static std::size_t chunk_size = 64 * 1024;
+
+  enum Changes : std::uint8_t { Registers = 1, Jump = 2, Flags = 4, Stores = 8 };
+
+  struct State
+  {
+    std::array<std::uint32_t, 16> registers{};
+    std::uint32_t cspr{};
+
+    // where the PC goes without a jump, Thumb instructions are 2 bytes
+    [[nodiscard]] constexpr std::uint32_t next_pc() const noexcept { return registers[15] + ((cspr & 0b10'0000) ? 2 : 4); }
+  };
+
+  struct Base_State
+  {
+    State state;
+    std::unordered_map<std::uint32_t, std::uint8_t> memory;  // bytes stored by folded chunks
+    std::uint64_t instructions{};
+  };
+
+  struct Store
+  {
+    std::uint32_t address;
+    std::uint32_t value;
+    std::uint32_t size;
+  };
+
+  struct Chunk
+  {
+    std::vector<std::uint8_t> bytes;
+    std::uint64_t instructions{};
+  };
+
+  [[nodiscard]] static constexpr std::uint64_t zigzag(const std::int64_t value) noexcept
+  {
+    return (static_cast<std::uint64_t>(value) << 1) ^ static_cast<std::uint64_t>(value >> 63);
+  }
+
+  [[nodiscard]] static constexpr std::int64_t unzigzag(const std::uint64_t value) noexcept
+  {
+    return static_cast<std::int64_t>(value >> 1) ^ -static_cast<std::int64_t>(value & 1);
+  }
+
+  static void put(std::vector<std::uint8_t> &bytes, std::uint64_t value)
+  {
+    while (value >= 0x80) {
+      bytes.push_back(static_cast<std::uint8_t>(value | 0x80));
+      value >>= 7;
+    }
+    bytes.push_back(static_cast<std::uint8_t>(value));
+  }
+
+  [[nodiscard]] static std::uint64_t get(const std::uint8_t *&pos) noexcept
+  {
+    std::uint64_t value = 0;
+    for (int shift = 0;; shift += 7) {
+      const auto byte = *pos++;
+      value |= std::uint64_t{ byte & 0x7Fu } << shift;
+      if ((byte & 0x80) == 0) {
+        return value;
+      }
+    }
+  }
+
+  [[nodiscard]] static std::int64_t difference(const std::uint32_t to, const std::uint32_t from) noexcept
+  {
+    return static_cast<std::int32_t>(to - from);
+  }
+
+  void record(const std::array<std::uint32_t, 16> &registers, const std::uint32_t cspr)
+  {
+    // chunks are decoded independently, so store addresses restart in each
+    if (m_chunks.empty() || m_chunks.back().bytes.size() >= chunk_size) {
+      m_chunks.emplace_back().bytes.reserve(chunk_size + 64);
+      m_last_store = 0;
+    }
+    auto &bytes       = m_chunks.back().bytes;
+    const auto before = bytes.size();
+
+    std::uint32_t changed = 0;
+    for (std::uint32_t reg = 0; reg < 15; ++reg) {
+      if (registers[reg] != m_last.registers[reg]) {
+        changed |= 1u << reg;
+      }
+    }
+    const auto expected_pc = m_last.next_pc();
+
+    bytes.push_back(static_cast<std::uint8_t>((changed != 0 ? Registers : 0) | (registers[15] != expected_pc ? Jump : 0)
+                                              | (cspr != m_last.cspr ? Flags : 0) | (!m_stores.empty() ? Stores : 0)));
+
+    if (changed != 0) {
+      put(bytes, changed);
+      for (std::uint32_t reg = 0; reg < 15; ++reg) {
+        if (changed & (1u << reg)) {
+          put(bytes, zigzag(difference(registers[reg], m_last.registers[reg])));
+        }
+      }
+    }
+
+    if (registers[15] != expected_pc) {
+      put(bytes, zigzag(difference(registers[15], expected_pc)));
+    }
+
+    // the flags live in the top nibble, rotate them down to keep the value small
+    if (cspr != m_last.cspr) {
+      put(bytes, std::rotl(cspr ^ m_last.cspr, 4));
+    }
+
+    if (!m_stores.empty()) {
+      put(bytes, m_stores.size());
+      auto last_address = m_last_store;
+      for (const auto &store : m_stores) {
+        put(bytes, zigzag(difference(store.address, last_address)) << 1 | (store.size == 4 ? 1 : 0));
+        put(bytes, store.value);
+        last_address = store.address;
+      }
+      m_last_store = last_address;
+      m_stores.clear();
+    }
+
+    m_last.registers = registers;
+    m_last.cspr      = cspr;
+    ++m_chunks.back().instructions;
+    ++m_instructions;
+    m_size += bytes.size() - before;
+
+    while (m_size > capacity && m_chunks.size() > 1) {
+      fold_oldest_chunk();
+    }
+  }
+
+  // Applies the first `records` records of chunk to state, passing each store to on_store
+  template<typename On_Store> static void decode(const Chunk &chunk, const std::uint64_t records, State &state, const On_Store &on_store)
+  {
+    const auto *pos            = chunk.bytes.data();
+    std::uint32_t last_address = 0;
+
+    for (std::uint64_t record = 0; record < records; ++record) {
+      const auto changes     = *pos++;
+      const auto expected_pc = state.next_pc();
+
+      if (changes & Registers) {
+        const auto changed = static_cast<std::uint32_t>(get(pos));
+        for (std::uint32_t reg = 0; reg < 15; ++reg) {
+          if (changed & (1u << reg)) {
+            state.registers[reg] += static_cast<std::uint32_t>(unzigzag(get(pos)));
+          }
+        }
+      }
+
+      state.registers[15] = expected_pc;
+      if (changes & Jump) {
+        state.registers[15] += static_cast<std::uint32_t>(unzigzag(get(pos)));
+      }
+
+      if (changes & Flags) {
+        state.cspr ^= std::rotr(static_cast<std::uint32_t>(get(pos)), 4);
+      }
+
+      if (changes & Stores) {
+        for (auto count = get(pos); count != 0; --count) {
+          const auto address_and_size = get(pos);
+          const auto address          = last_address + static_cast<std::uint32_t>(unzigzag(address_and_size >> 1));
+          on_store(Store{ address, static_cast<std::uint32_t>(get(pos)), (address_and_size & 1) ? 4u : 1u });
+          last_address = address;
+        }
+      }
+    }
+  }
+
+  void fold_oldest_chunk()
+  {
+    const auto &chunk = m_chunks.front();
+    decode(chunk, chunk.instructions, m_base.state, [&](const Store &store) {
+      for (std::uint32_t byte = 0; byte < store.size; ++byte) {
+        m_base.memory[store.address + byte] = static_cast<std::uint8_t>(store.value >> (byte * 8));
+      }
+    });
+    m_base.instructions += chunk.instructions;
+    m_size -= chunk.bytes.size();
+    m_chunks.pop_front();
+  }
+
+  Base_State m_base;
+  State m_last;
+  std::deque<Chunk> m_chunks;
+  std::vector<Store> m_stores;  // stores by the instruction being executed
+  std::uint32_t m_last_store{};
+  std::size_t m_size{};
+  std::uint64_t m_instructions{};
+};
+
+template<std::size_t Size> constexpr auto run_instructions(const std::array<Instruction, Size> &instructions)
+{
+  System system;
+  for (const auto instruction : instructions) {
+    system.process(instruction);
+  }
+  return system;
+}
+
+template<typename... T> constexpr auto run_instruction(T... instruction)
+{
+  return run_instructions(std::array<Instruction, sizeof...(T)>{ instruction... });
+}
+
+template<std::size_t Size> constexpr auto run_code(std::uint32_t start, const std::array<std::uint8_t, Size> &memory)
+{
+  System system{memory};
+  system.run(start);
+  return system;
+}
+
+// A compile time run is limited by how much the compiler lets one constant
+// evaluation do rather than by the program. An instruction costs about
+// 1,000 of GCC's operations, so its default -fconstexpr-ops-limit of
+// 33,554,432 runs somewhere between 30,000 and 40,000 instructions, and
+// Clang's default -fconstexpr-steps of 1,048,576 far fewer. run_for() resumes
+// where it stopped, so a long run is split into slices of Slice_Length
+// instructions, each one the initializer of its own constexpr variable and
+// evaluated under its own budget. Slice 0 continues from Start, which has to
+// have been start()ed.
+template<const auto &Start, std::uint64_t Slice_Length, std::size_t Slice>
+constexpr auto compile_time_run = [] {
+  auto system = [] {
+    if constexpr (Slice == 0) {
+      return Start;
+    } else {
+      return compile_time_run<Start, Slice_Length, Slice - 1>;
+    }
+  }();
+  system.run_for(Slice_Length);
+  return system;
+}();
+
+template<typename ... T> constexpr auto run_code(std::uint32_t start, T ... byte)
+{
+  return run_code(start, std::array<std::uint8_t, sizeof...(T)>{static_cast<std::uint8_t>(byte)...});
+}
+
+// Little endian memory image of a sequence of instructions, starting at 0
+template<std::size_t Size> constexpr auto to_memory(const std::array<Instruction, Size> &instructions)
+{
+  std::array<std::uint8_t, Size * 4> memory{};
+  for (std::size_t loc = 0; loc < Size; ++loc) {
+    for (std::size_t byte = 0; byte < 4; ++byte) {
+      memory[loc * 4 + byte] = static_cast<std::uint8_t>(instructions[loc].data() >> (byte * 8));
+    }
+  }
+  return memory;
+}
+
+#ifdef __unix__
+
+// Part of a file mapped privately (copy on write) into host memory
+struct Mapped_File
+{
+  std::shared_ptr<std::uint8_t> data;
+  std::size_t size{};
+};
+
+struct File_Descriptor
+{
+  int fd;
+
+  explicit File_Descriptor(const std::string &path) : fd{ open(path.c_str(), O_RDONLY) } {}
+  File_Descriptor(const File_Descriptor &) = delete;
+  File_Descriptor &operator=(const File_Descriptor &) = delete;
+  ~File_Descriptor()
+  {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+};
+
+// offset has to be page aligned
+[[nodiscard]] inline Mapped_File map_file(const int fd, const std::size_t offset, const std::size_t size)
+{
+  void *mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, static_cast<off_t>(offset));
+  if (mapping == MAP_FAILED) {
+    throw std::runtime_error("unable to map file");
+  }
+
+  return Mapped_File{ std::shared_ptr<std::uint8_t>(static_cast<std::uint8_t *>(mapping), [size](std::uint8_t *ptr) { munmap(ptr, size); }),
+                      size };
+}
+
+// Copies a segment's file bytes into any kind of guest memory and zero fills
+// the rest of it
+template<typename Memory> void copy_segment(Memory &memory, const Mapped_File &file, const Elf32_Phdr &segment)
+{
+  const auto *data = file.data.get() + segment.p_offset;
+  for (std::uint32_t offset = 0; offset < segment.p_memsz; ++offset) {
+    memory.write_byte(segment.p_vaddr + offset, offset < segment.p_filesz ? data[offset] : 0);
+  }
+}
+
+template<typename Memory> void load_segment(Memory &memory, int, const Mapped_File &file, const Elf32_Phdr &segment)
+{
+  copy_segment(memory, file, segment);
+}
+
+// On paged memory the segment is mapped on its own and those file pages
+// become guest pages directly. Only pages another segment already occupies,
+// or segments that are not page aligned in the file, fall back to copying.
+inline void load_segment(Paged_Memory &memory, const int fd, const Mapped_File &file, const Elf32_Phdr &segment)
+{
+  constexpr std::uint64_t page_size = Paged_Memory::page_size;
+  constexpr std::uint64_t page_mask = page_size - 1;
+
+  if ((segment.p_vaddr - segment.p_offset) % page_size != 0) {
+    copy_segment(memory, file, segment);
+    return;
+  }
+
+  const std::uint64_t begin = segment.p_vaddr;
+  const std::uint64_t end   = begin + segment.p_filesz;
+
+  if (segment.p_filesz != 0) {
+    // a mapping per segment, neighbouring segments often share file pages
+    const auto file_offset = segment.p_offset & ~page_mask;
+    const auto pages       = map_file(fd, file_offset, segment.p_offset + segment.p_filesz - file_offset);
+    const auto first_page  = begin & ~page_mask;
+
+    for (auto guest_page = first_page; guest_page < end; guest_page += page_size) {
+      const auto segment_begin = std::max(guest_page, begin);
+      const auto segment_end   = std::min(guest_page + page_size, end);
+      auto *host               = pages.data.get() + (guest_page - first_page);
+
+      if (memory.mapped(static_cast<std::uint32_t>(guest_page))) {
+        for (auto loc = segment_begin; loc < segment_end; ++loc) {
+          memory.write_byte(static_cast<std::uint32_t>(loc), host[loc - guest_page]);
+        }
+        continue;
+      }
+
+      // Bytes of the page outside the segment belong to other parts of the
+      // file, clearing them only touches our private copy of that page
+      std::fill(host, host + (segment_begin - guest_page), 0);
+      std::fill(host + (segment_end - guest_page), host + page_size, 0);
+
+      memory.map_host(static_cast<std::uint32_t>(guest_page), std::shared_ptr<std::uint8_t>(pages.data, host), page_size);
+    }
+  }
+
+  // .bss, pages that were never written already read as 0
+  const std::uint64_t bss_end = begin + segment.p_memsz;
+  for (auto loc = end; loc < bss_end; loc = (loc & ~page_mask) + page_size) {
+    if (memory.mapped(static_cast<std::uint32_t>(loc))) {
+      const auto page_end = std::min((loc & ~page_mask) + page_size, bss_end);
+      for (auto zero = loc; zero < page_end; ++zero) {
+        memory.write_byte(static_cast<std::uint32_t>(zero), 0);
+      }
+    }
+  }
+}
+
+template<typename Backing> void load_segment(Memory_Bus<Backing> &memory, const int fd, const Mapped_File &file, const Elf32_Phdr &segment)
+{
+  load_segment(memory.backing(), fd, file, segment);
+}
+
+// Loads the PT_LOAD segments of a 32 bit little endian ARM executable into
+// guest memory and returns its entry point
+template<typename Memory> std::uint32_t load_elf(Memory &memory, const std::string &path)
+{
+  const File_Descriptor descriptor{ path };
+  struct stat status{};
+  if (descriptor.fd < 0 || fstat(descriptor.fd, &status) != 0 || status.st_size == 0) {
+    throw std::runtime_error("unable to read " + path);
+  }
+
+  const auto file   = map_file(descriptor.fd, 0, static_cast<std::size_t>(status.st_size));
+  const auto *bytes = file.data.get();
+
+  Elf32_Ehdr header{};
+  if (file.size < sizeof(header)) {
+    throw std::runtime_error(path + " is not an ELF file");
+  }
+  std::memcpy(&header, bytes, sizeof(header));
+
+  if (std::memcmp(header.e_ident, ELFMAG, SELFMAG) != 0 || header.e_ident[EI_CLASS] != ELFCLASS32 || header.e_ident[EI_DATA] != ELFDATA2LSB) {
+    throw std::runtime_error(path + " is not a 32 bit little endian ELF file");
+  }
+
+  if (header.e_machine != EM_ARM || header.e_type != ET_EXEC) {
+    throw std::runtime_error(path + " is not an ARM executable");
+  }
+
+  if (header.e_phentsize != sizeof(Elf32_Phdr) || header.e_phoff + std::size_t{ header.e_phnum } * sizeof(Elf32_Phdr) > file.size) {
+    throw std::runtime_error(path + " has a malformed program header table");
+  }
+
+  for (std::size_t index = 0; index < header.e_phnum; ++index) {
+    Elf32_Phdr segment{};
+    std::memcpy(&segment, bytes + header.e_phoff + index * sizeof(Elf32_Phdr), sizeof(segment));
+
+    if (segment.p_type != PT_LOAD) {
+      continue;
+    }
+
+    if (std::size_t{ segment.p_offset } + segment.p_filesz > file.size || segment.p_filesz > segment.p_memsz
+        || std::uint64_t{ segment.p_vaddr } + segment.p_memsz > Memory::halt_address) {
+      throw std::runtime_error(path + " has a malformed PT_LOAD segment");
+    }
+
+    load_segment(memory, descriptor.fd, file, segment);
+  }
+
+  return header.e_entry;
+}
+
+// Defined function symbols from an executable's symbol tables, by name. A
+// stripped executable has none.
+inline std::unordered_map<std::string, std::uint32_t> load_symbols(const std::string &path)
+{
+  const File_Descriptor descriptor{ path };
+  struct stat status{};
+  if (descriptor.fd < 0 || fstat(descriptor.fd, &status) != 0 || status.st_size == 0) {
+    throw std::runtime_error("unable to read " + path);
+  }
+
+  const auto file   = map_file(descriptor.fd, 0, static_cast<std::size_t>(status.st_size));
+  const auto *bytes = file.data.get();
+
+  Elf32_Ehdr header{};
+  if (file.size < sizeof(header)) {
+    throw std::runtime_error(path + " is not an ELF file");
+  }
+  std::memcpy(&header, bytes, sizeof(header));
+
+  std::unordered_map<std::string, std::uint32_t> symbols;
+  if (header.e_shoff == 0 || header.e_shentsize != sizeof(Elf32_Shdr)) {
+    return symbols;
+  }
+
+  if (header.e_shoff + std::size_t{ header.e_shnum } * sizeof(Elf32_Shdr) > file.size) {
+    throw std::runtime_error(path + " has a malformed section header table");
+  }
+
+  const auto section = [&](const std::size_t index) {
+    Elf32_Shdr result{};
+    std::memcpy(&result, bytes + header.e_shoff + index * sizeof(Elf32_Shdr), sizeof(result));
+    return result;
+  };
+
+  for (std::size_t index = 0; index < header.e_shnum; ++index) {
+    const auto table = section(index);
+    if (table.sh_type != SHT_SYMTAB || table.sh_link >= header.e_shnum) {
+      continue;
+    }
+
+    const auto names = section(table.sh_link);
+    if (std::size_t{ table.sh_offset } + table.sh_size > file.size || std::size_t{ names.sh_offset } + names.sh_size > file.size) {
+      throw std::runtime_error(path + " has a malformed symbol table");
+    }
+
+    for (std::size_t offset = 0; offset + sizeof(Elf32_Sym) <= table.sh_size; offset += sizeof(Elf32_Sym)) {
+      Elf32_Sym symbol{};
+      std::memcpy(&symbol, bytes + table.sh_offset + offset, sizeof(symbol));
+
+      if (ELF32_ST_TYPE(symbol.st_info) != STT_FUNC || symbol.st_shndx == SHN_UNDEF || symbol.st_name >= names.sh_size) {
+        continue;
+      }
+
+      const auto *name = reinterpret_cast<const char *>(bytes + names.sh_offset + symbol.st_name);
+      symbols.emplace(std::string{ name, strnlen(name, names.sh_size - symbol.st_name) }, symbol.st_value);
+    }
+  }
+  return symbols;
+}
+
+// The routines System can run natively, found by name. Thumb functions have
+// bit 0 of their address set.
+inline Library_Entries library_entries(const std::unordered_map<std::string, std::uint32_t> &symbols)
+{
+  const auto entry = [&](const char *name) {
+    const auto symbol = symbols.find(name);
+    return symbol == symbols.end() ? Library_Entries::none : symbol->second & ~1u;
+  };
+
+  Library_Entries entries;
+  entries.memcpy  = entry("memcpy");
+  entries.memmove = entry("memmove");
+  entries.memset  = entry("memset");
+  return entries;
+}
+
+#endif
+
+#ifdef ARM_JIT_SUPPORTED
+
+// Minimal x86-64 encoder for the block translator below. Every guest access
+// is rbx relative (rbx holds the System * for the life of a block) and uses a
+// disp32 so no SIB / short-displacement special cases are needed.
+struct X86_Emitter
+{
+  std::vector<std::uint8_t> code;
+
+  void bytes(std::initializer_list<std::uint8_t> values) { code.insert(code.end(), values); }
+
+  void imm32(const std::uint32_t value)
+  {
+    for (int byte = 0; byte < 4; ++byte) { code.push_back(static_cast<std::uint8_t>(value >> (byte * 8))); }
+  }
+
+  void imm64(const std::uint64_t value)
+  {
+    for (int byte = 0; byte < 8; ++byte) { code.push_back(static_cast<std::uint8_t>(value >> (byte * 8))); }
+  }
+
+  void prologue() { bytes({ 0x53, 0x48, 0x89, 0xfb }); }  // push rbx; mov rbx, rdi
+  void epilogue() { bytes({ 0x5b, 0xc3 }); }              // pop rbx; ret
+
+  void load_eax(const std::uint32_t disp) { bytes({ 0x8b, 0x83 }); imm32(disp); }        // mov eax, [rbx+disp]
+  void load_ecx(const std::uint32_t disp) { bytes({ 0x8b, 0x8b }); imm32(disp); }        // mov ecx, [rbx+disp]
+  void store_eax(const std::uint32_t disp) { bytes({ 0x89, 0x83 }); imm32(disp); }       // mov [rbx+disp], eax
+  void store_edx(const std::uint32_t disp) { bytes({ 0x89, 0x93 }); imm32(disp); }       // mov [rbx+disp], edx
+  void add_store_eax(const std::uint32_t disp) { bytes({ 0x01, 0x83 }); imm32(disp); }   // add [rbx+disp], eax
+  void add_store_edx(const std::uint32_t disp) { bytes({ 0x01, 0x93 }); imm32(disp); }   // add [rbx+disp], edx
+  void adc_store_edx(const std::uint32_t disp) { bytes({ 0x11, 0x93 }); imm32(disp); }   // adc [rbx+disp], edx
+
+  void store_imm(const std::uint32_t disp, const std::uint32_t value)  // mov dword [rbx+disp], imm32
+  {
+    bytes({ 0xc7, 0x83 });
+    imm32(disp);
+    imm32(value);
+  }
+
+  void mov_eax_imm(const std::uint32_t value) { bytes({ 0xb8 }); imm32(value); }
+  void mov_ecx_imm(const std::uint32_t value) { bytes({ 0xb9 }); imm32(value); }
+
+  void shift_ecx(const Shift_Type type, const std::uint8_t amount)
+  {
+    switch (type) {
+    case Shift_Type::Logical_Left: bytes({ 0xc1, 0xe1, amount }); break;
+    case Shift_Type::Logical_Right: bytes({ 0xc1, 0xe9, amount }); break;
+    case Shift_Type::Arithmetic_Right: bytes({ 0xc1, 0xf9, amount }); break;
+    case Shift_Type::Rotate_Right: bytes({ 0xc1, 0xc9, amount }); break;
+    }
+  }
+
+  // mov rdi, rbx; mov esi, arg; mov rax, function; call rax
+  // The stack is 16 byte aligned here because of the single push in the prologue.
+  template<typename Function> void call(Function *function, const std::uint32_t arg)
+  {
+    bytes({ 0x48, 0x89, 0xdf, 0xbe });
+    imm32(arg);
+    bytes({ 0x48, 0xb8 });
+    imm64(reinterpret_cast<std::uint64_t>(function));
+    bytes({ 0xff, 0xd0 });
+  }
+
+  // test al, al; jz rel32 - returns the location of the rel32 for patch()
+  [[nodiscard]] std::size_t jump_if_false()
+  {
+    bytes({ 0x84, 0xc0, 0x0f, 0x84 });
+    const auto location = code.size();
+    imm32(0);
+    return location;
+  }
+
+  void patch(const std::size_t location)
+  {
+    const auto rel = static_cast<std::uint32_t>(code.size() - (location + 4));
+    for (int byte = 0; byte < 4; ++byte) { code[location + byte] = static_cast<std::uint8_t>(rel >> (byte * 8)); }
+  }
+};
+
+// Basic block translator. Hot guest blocks are compiled to x86-64 in an
+// mmapped buffer; guest registers and CSPR stay in the System object and are
+// read / written in place. Anything without a native translation is a call
+// back into the interpreter, so both modes share all instruction semantics.
+// Guest code is assumed not to be modified after it is compiled, call
+// invalidate() after writing to code memory.
+template<typename System_Type> class JIT
+{
+public:
+  explicit JIT(System_Type &system, const std::uint32_t hot_threshold = 8, const std::size_t buffer_size = 1 << 20)
+    : m_system{ system }, m_hot_threshold{ hot_threshold }, m_buffer_size{ buffer_size }
+  {
+    void *buffer = mmap(nullptr, m_buffer_size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer != MAP_FAILED) {
+      m_buffer = static_cast<std::uint8_t *>(buffer);
+    }
+  }
+
+  JIT(const JIT &) = delete;
+  JIT &operator=(const JIT &) = delete;
+
+  ~JIT()
+  {
+    if (m_buffer) {
+      munmap(m_buffer, m_buffer_size);
+    }
+  }
+
+  void invalidate() noexcept
+  {
+    m_blocks.clear();
+    m_used = 0;
+  }
+
+  void run(const std::uint32_t loc)
+  {
+    m_system.start(loc);
+    run_for(std::numeric_limits<std::uint64_t>::max());
+  }
+
+  // As System::run_for. A compiled block always runs to its end, so its
+  // whole length is charged on entry, blocks longer than the remaining
+  // budget are interpreted instead.
+  Run_Result run_for(const std::uint64_t max_instructions)
+  {
+    // Translated code doesn't report to hooks, observed systems are interpreted
+    if constexpr (System_Type::observed) {
+      return m_system.run_for(max_instructions);
+    }
+
+    std::uint64_t remaining = max_instructions;
+
+    while (true) {
+      if (m_system.halted()) {
+        return Run_Result{ Stop_Reason::Halted, max_instructions - remaining };
+      }
+      if (m_system.fault) {
+        return Run_Result{ Stop_Reason::Fault, max_instructions - remaining };
+      }
+      if (remaining == 0) {
+        return Run_Result{ Stop_Reason::Budget_Exhausted, max_instructions };
+      }
+
+      // the last instruction run, to find jumps
+      auto from = m_system.PC();
+
+      // only ARM code is translated
+      if (m_system.thumb()) {
+        m_system.process_next();
+        remaining -= m_system.fault ? 0 : 1;
+      } else {
+        auto *block = &m_blocks[from];
+
+        if (!block->code && m_buffer && block->hits++ >= m_hot_threshold) {
+          const auto [code, length] = compile(from);
+          // compile() may have flushed the block cache to make room
+          block         = &m_blocks[from];
+          block->code   = code;
+          block->length = length;
+        }
+
+        if (block->code && block->length <= remaining) {
+          remaining -= block->length;
+          from += (block->length - 1) * 4;
+          block->code(&m_system);
+          // only the interpreted instruction a block ends with can fault
+          remaining += m_system.fault ? 1 : 0;
+        } else {
+          m_system.process(m_system.get_instruction(from));
+          remaining -= m_system.fault ? 0 : 1;
+        }
+      }
+
+      // library calls and copy loops run natively, as they do interpreted
+      if (!m_system.fault && m_system.PC() - from != m_system.instruction_size()) {
+        remaining -= m_system.fast_path(from, remaining);
+      }
+    }
+  }
+
+private:
+  using Block_Function = void (*)(System_Type *);
+
+  struct Block
+  {
+    Block_Function code{};
+    std::uint32_t length{};  // instructions, including ones whose condition fails
+    std::uint32_t hits{};
+  };
+
+  static std::uint32_t register_offset(const std::uint32_t reg) noexcept
+  {
+    return static_cast<std::uint32_t>(offsetof(System_Type, registers) + reg * sizeof(std::uint32_t));
+  }
+
+  static void process_thunk(System_Type *system, const std::uint32_t instruction) { system->process(Instruction{ instruction }); }
+  static bool condition_thunk(System_Type *system, const std::uint32_t instruction) { return system->check_condition(Instruction{ instruction }); }
+  static void data_processing_thunk(System_Type *system, const std::uint32_t instruction) { system->data_processing(Instruction{ instruction }); }
+  static void single_data_transfer_thunk(System_Type *system, const std::uint32_t instruction)
+  {
+    system->single_data_transfer(Instruction{ instruction });
+  }
+  static void multiply_long_thunk(System_Type *system, const std::uint32_t instruction) { system->multiply_long(Instruction{ instruction }); }
+  static void multiply_thunk(System_Type *system, const std::uint32_t instruction) { system->multiply(Instruction{ instruction }); }
+  static void block_data_transfer_thunk(System_Type *system, const std::uint32_t instruction)
+  {
+    system->block_data_transfer(Instruction{ instruction });
+  }
+
+  // Can the data processing instruction be emitted as straight-line x86?
+  // Flag setting, carry consuming, PC relative and register-shifted forms go
+  // back through the interpreter.
+  [[nodiscard]] static bool native_data_processing(const Data_Processing val) noexcept
+  {
+    if (val.set_condition_code()) {
+      return false;
+    }
+
+    switch (val.get_opcode()) {
+    case OpCode::ADC:
+    case OpCode::SBC:
+    case OpCode::RSC:
+    case OpCode::TST:
+    case OpCode::TEQ:
+    case OpCode::CMP:
+    case OpCode::CMN: return false;
+    default: break;
+    }
+
+    if (val.operand_1_register() == 15) {
+      return false;
+    }
+
+    if (val.immediate_operand()) {
+      return true;
+    }
+
+    return val.operand_2_immediate_shift() && val.operand_2_register() != 15
+           && !(val.operand_2_shift_type() == Shift_Type::Rotate_Right && val.operand_2_shift_amount() == 0);
+  }
+
+  static void emit_data_processing(X86_Emitter &emitter, const Data_Processing val)
+  {
+    if (val.immediate_operand()) {
+      emitter.mov_ecx_imm(val.operand_2_immediate());
+    } else {
+      emitter.load_ecx(register_offset(val.operand_2_register()));
+
+      const auto amount = static_cast<std::uint8_t>(val.operand_2_shift_amount());
+      switch (val.operand_2_shift_type()) {
+      case Shift_Type::Logical_Left:
+      case Shift_Type::Rotate_Right:
+        if (amount != 0) {
+          emitter.shift_ecx(val.operand_2_shift_type(), amount);
+        }
+        break;
+      case Shift_Type::Logical_Right:
+        if (amount == 0) {
+          emitter.mov_ecx_imm(0);  // LSR #32
+        } else {
+          emitter.shift_ecx(Shift_Type::Logical_Right, amount);
+        }
+        break;
+      case Shift_Type::Arithmetic_Right:
+        emitter.shift_ecx(Shift_Type::Arithmetic_Right, amount == 0 ? 31 : amount);  // ASR #32 is a sign fill
+        break;
+      }
+    }
+
+    emitter.load_eax(register_offset(val.operand_1_register()));
+
+    switch (val.get_opcode()) {
+    case OpCode::AND: emitter.bytes({ 0x21, 0xc8 }); break;                // and eax, ecx
+    case OpCode::EOR: emitter.bytes({ 0x31, 0xc8 }); break;                // xor eax, ecx
+    case OpCode::ORR: emitter.bytes({ 0x09, 0xc8 }); break;                // or eax, ecx
+    case OpCode::ADD: emitter.bytes({ 0x01, 0xc8 }); break;                // add eax, ecx
+    case OpCode::SUB: emitter.bytes({ 0x29, 0xc8 }); break;                // sub eax, ecx
+    case OpCode::RSB: emitter.bytes({ 0x29, 0xc1, 0x89, 0xc8 }); break;    // sub ecx, eax; mov eax, ecx
+    case OpCode::MOV: emitter.bytes({ 0x89, 0xc8 }); break;                // mov eax, ecx
+    case OpCode::BIC: emitter.bytes({ 0xf7, 0xd1, 0x21, 0xc8 }); break;    // not ecx; and eax, ecx
+    case OpCode::MVN: emitter.bytes({ 0xf7, 0xd1, 0x89, 0xc8 }); break;    // not ecx; mov eax, ecx
+    default: assert(!"Unexpected native data processing opcode"); break;
+    }
+
+    emitter.store_eax(register_offset(val.destination_register()));
+  }
+
+  static void emit_multiply_long(X86_Emitter &emitter, const Multiply_Long val)
+  {
+    // the 32 bit loads zero extend, the signed forms sign extend instead,
+    // either way the 64 bit product is exact
+    emitter.load_eax(register_offset(val.operand_1()));
+    emitter.load_ecx(register_offset(val.operand_2()));
+    if (val.signed_mul()) {
+      emitter.bytes({ 0x48, 0x63, 0xc0, 0x48, 0x63, 0xc9 });  // movsxd rax, eax; movsxd rcx, ecx
+    }
+    emitter.bytes({ 0x48, 0x0f, 0xaf, 0xc1 });                    // imul rax, rcx
+    emitter.bytes({ 0x48, 0x89, 0xc2, 0x48, 0xc1, 0xea, 0x20 });  // mov rdx, rax; shr rdx, 32
+
+    // the carry out of the low word goes into the high one
+    if (val.accumulate()) {
+      emitter.add_store_eax(register_offset(val.low_result()));
+      emitter.adc_store_edx(register_offset(val.high_result()));
+    } else {
+      emitter.store_edx(register_offset(val.high_result()));
+      emitter.store_eax(register_offset(val.low_result()));
+    }
+  }
+
+  static void emit_multiply(X86_Emitter &emitter, const Multiply val)
+  {
+    emitter.load_eax(register_offset(val.operand_2()));
+    emitter.load_ecx(register_offset(val.operand_1()));
+    emitter.bytes({ 0x0f, 0xaf, 0xc1 });  // imul eax, ecx
+
+    if (val.accumulate()) {
+      emitter.load_ecx(register_offset(val.accumulate_register()));
+      emitter.bytes({ 0x01, 0xc8 });  // add eax, ecx
+    }
+
+    emitter.store_eax(register_offset(val.destination_register()));
+  }
+
+  [[nodiscard]] std::pair<Block_Function, std::uint32_t> compile(const std::uint32_t start)
+  {
+    X86_Emitter emitter;
+    emitter.prologue();
+
+    const auto pc = register_offset(15);
+
+    // Emits an instruction guarded by its condition code, unconditional
+    // instructions skip the check entirely
+    const auto conditional = [&](const Instruction instruction, const auto &body) {
+      if (instruction.get_condition() == Condition::AL) {
+        body();
+      } else {
+        emitter.call(&condition_thunk, instruction.data());
+        const auto skip = emitter.jump_if_false();
+        body();
+        emitter.patch(skip);
+      }
+    };
+
+    // Hands the instruction to the interpreter and leaves the block, used for
+    // anything that might write the PC
+    const auto exit_through_interpreter = [&](const std::uint32_t loc, const Instruction instruction) {
+      emitter.store_imm(pc, loc);
+      emitter.call(&process_thunk, instruction.data());
+      emitter.epilogue();
+    };
+
+    auto loc       = start;
+    bool cut_short = false;
+    for (std::size_t count = 0;; ++count, loc += 4) {
+      if (count == System_Type::max_block_length || loc + 4 > System_Type::halt_address) {
+        emitter.store_imm(pc, loc);
+        emitter.epilogue();
+        cut_short = true;
+        break;
+      }
+
+      const auto instruction = m_system.get_instruction(loc);
+
+      if (instruction.get_condition() == Condition::NV) {
+        continue;
+      }
+
+      const auto type = m_system.decode(instruction);
+
+      if (type == Instruction_Type::Branch) {
+        const auto offset = branch_offset(instruction);
+
+        std::size_t not_taken = 0;
+        if (instruction.get_condition() != Condition::AL) {
+          emitter.call(&condition_thunk, instruction.data());
+          not_taken = emitter.jump_if_false();
+        }
+
+        if (instruction.bit_set(24)) {
+          emitter.store_imm(register_offset(14), loc + 4);
+        }
+        emitter.store_imm(pc, static_cast<std::uint32_t>(loc + 8 + offset));
+        emitter.epilogue();
+
+        if (instruction.get_condition() != Condition::AL) {
+          emitter.patch(not_taken);
+          emitter.store_imm(pc, loc + 4);
+          emitter.epilogue();
+        }
+        break;
+      } else if (type == Instruction_Type::Data_Processing) {
+        const Data_Processing val = instruction;
+        if (val.destination_register() == 15) {
+          exit_through_interpreter(loc, instruction);
+          break;
+        }
+
+        if (native_data_processing(val)) {
+          conditional(instruction, [&] { emit_data_processing(emitter, val); });
+        } else {
+          conditional(instruction, [&] {
+            emitter.store_imm(pc, loc + 8);
+            emitter.call(&data_processing_thunk, instruction.data());
+          });
+        }
+      } else if (type == Instruction_Type::Single_Data_Transfer) {
+        const Single_Data_Transfer val = instruction;
+        if ((val.load() && val.src_dest_register() == 15)
+            || (val.base_register() == 15 && (!val.pre_indexing() || val.write_back()))) {
+          exit_through_interpreter(loc, instruction);
+          break;
+        }
+
+        conditional(instruction, [&] {
+          emitter.store_imm(pc, loc + 8);
+          emitter.call(&single_data_transfer_thunk, instruction.data());
+        });
+      } else if (type == Instruction_Type::Multiply_Long) {
+        const Multiply_Long val = instruction;
+        if (val.high_result() == 15 || val.low_result() == 15 || val.operand_1() == 15 || val.operand_2() == 15) {
+          exit_through_interpreter(loc, instruction);
+          break;
+        }
+
+        if (val.status_register_update()) {
+          conditional(instruction, [&] { emitter.call(&multiply_long_thunk, instruction.data()); });
+        } else {
+          conditional(instruction, [&] { emit_multiply_long(emitter, val); });
+        }
+      } else if (type == Instruction_Type::Multiply) {
+        const Multiply val = instruction;
+        if (val.destination_register() == 15) {
+          exit_through_interpreter(loc, instruction);
+          break;
+        }
+
+        if (val.set_condition_code()) {
+          conditional(instruction, [&] { emitter.call(&multiply_thunk, instruction.data()); });
+        } else {
+          conditional(instruction, [&] { emit_multiply(emitter, val); });
+        }
+      } else if (type == Instruction_Type::Block_Data_Transfer) {
+        const Block_Data_Transfer val = instruction;
+        if ((val.load() && val.transfers(15)) || val.base_register() == 15) {
+          exit_through_interpreter(loc, instruction);
+          break;
+        }
+
+        conditional(instruction, [&] {
+          emitter.store_imm(pc, loc + 8);
+          emitter.call(&block_data_transfer_thunk, instruction.data());
+        });
+      } else {
+        exit_through_interpreter(loc, instruction);
+        break;
+      }
+    }
+
+    if (m_used + emitter.code.size() > m_buffer_size) {
+      // Out of space, throw away everything compiled so far and start over
+      invalidate();
+      if (emitter.code.size() > m_buffer_size) {
+        return { nullptr, 0 };
+      }
+    }
+
+    auto *code = m_buffer + m_used;
+    std::copy(emitter.code.begin(), emitter.code.end(), code);
+    m_used += emitter.code.size();
+
+    // the block ends with the instruction at loc, unless it was cut short before it
+    const auto length = (loc - start) / 4 + (cut_short ? 0 : 1);
+    return { reinterpret_cast<Block_Function>(code), length };
+  }
+
+  System_Type &m_system;
+  std::uint32_t m_hot_threshold;
+  std::size_t m_buffer_size;
+  std::uint8_t *m_buffer{};
+  std::size_t m_used{};
+  std::unordered_map<std::uint32_t, Block> m_blocks;
+};
+
+#endif
+
+struct Batch_Options
+{
+  std::size_t threads{ std::max(1u, std::thread::hardware_concurrency()) };
+  std::uint64_t slice{ 1 << 16 };                                        // instructions per turn before yielding to other systems
+  std::uint64_t budget{ std::numeric_limits<std::uint64_t>::max() };  // instructions before a system is given up on
+};
+
+struct Batch_Report
+{
+  std::vector<std::uint64_t> retired;  // instructions executed, per system
+  std::uint64_t instructions{};
+  std::size_t halted{};
+  std::size_t faulted{};
+  std::size_t over_budget{};
+  double seconds{};
+
+  [[nodiscard]] double instructions_per_second() const noexcept { return static_cast<double>(instructions) / seconds; }
+};
+
+// One worker's share of the batch. The owner works from the back, idle
+// workers steal from the front.
+class Work_Queue
+{
+public:
+  void push(const std::size_t job)
+  {
+    const std::lock_guard lock{ m_mutex };
+    m_jobs.push_back(job);
+  }
+
+  [[nodiscard]] std::optional<std::size_t> pop()
+  {
+    const std::lock_guard lock{ m_mutex };
+    if (m_jobs.empty()) {
+      return std::nullopt;
+    }
+    const auto job = m_jobs.back();
+    m_jobs.pop_back();
+    return job;
+  }
+
+  [[nodiscard]] std::optional<std::size_t> steal()
+  {
+    const std::lock_guard lock{ m_mutex };
+    if (m_jobs.empty()) {
+      return std::nullopt;
+    }
+    const auto job = m_jobs.front();
+    m_jobs.pop_front();
+    return job;
+  }
+
+private:
+  std::mutex m_mutex;
+  std::deque<std::size_t> m_jobs;
+};
+
+// Runs every system that has been start()ed until it halts, faults or
+// exceeds its budget. Systems are time sliced, each turn runs at most options.slice
+// instructions and then goes back to the worker's queue, so a few long
+// runners can't starve the rest and idle workers can steal them.
+//
+// A worker only ever pushes the job it just ran, onto its own queue, so once
+// it finds every queue empty each unfinished job is running on a worker that
+// will carry on with it, and there is nothing left to steal: it exits
+// instead of waiting.
+template<typename System_Type> Batch_Report run_batch(std::vector<System_Type> &systems, const Batch_Options &options = {})
+{
+  Batch_Report report;
+  report.retired.resize(systems.size());
+
+  std::vector<Work_Queue> queues(std::max(std::size_t{ 1 }, options.threads));
+  for (std::size_t job = 0; job < systems.size(); ++job) {
+    if (!systems[job].halted() && !systems[job].fault) {
+      queues[job % queues.size()].push(job);
+    }
+  }
+
+  const auto worker = [&](const std::size_t self) {
+    while (true) {
+      auto job = queues[self].pop();
+      for (std::size_t other = 1; !job && other < queues.size(); ++other) {
+        job = queues[(self + other) % queues.size()].steal();
+      }
+
+      if (!job) {
+        return;
+      }
+
+      auto &system  = systems[*job];
+      auto &retired = report.retired[*job];
+      const auto result = system.run_for(std::min(options.slice, options.budget - retired));
+      retired += result.instructions;
+
+      if (result.reason == Stop_Reason::Budget_Exhausted && retired < options.budget) {
+        queues[self].push(*job);
+      }
+    }
+  };
+
+  const auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (std::size_t thread = 1; thread < queues.size(); ++thread) {
+    threads.emplace_back(worker, thread);
+  }
+  worker(0);
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  report.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  for (std::size_t job = 0; job < systems.size(); ++job) {
+    report.instructions += report.retired[job];
+    if (systems[job].halted()) {
+      ++report.halted;
+    } else if (systems[job].fault) {
+      ++report.faulted;
+    } else {
+      ++report.over_budget;
+    }
+  }
+
+  return report;
+}
+
+void require(const bool condition, const char *message)
+{
+  if (!condition) {
+    throw std::runtime_error(message);
+  }
+}
+
+// Runs a memory image through the interpreter and through the JIT, both with
+// every block compiled on first sight and with the default hot threshold,
+// and requires identical final state.
+template<std::size_t Size> void check_jit([[maybe_unused]] const std::uint32_t start, [[maybe_unused]] const std::array<std::uint8_t, Size> &memory)
+{
+#ifdef ARM_JIT_SUPPORTED
+  System interpreted{ memory };
+  interpreted.run(start);
+
+  for (const std::uint32_t hot_threshold : { 0u, 8u }) {
+    System jitted{ memory };
+    JIT{ jitted, hot_threshold }.run(start);
+
+    require(jitted == interpreted, "JIT and interpreter results differ");
+  }
+#endif
+}
+
+template<std::size_t Size> void check_jit(const std::array<Instruction, Size> &instructions)
+{
+  check_jit(0, to_memory(instructions));
+}
+
+void test_never_executing_jump()
+{
+  constexpr std::array program{ Instruction{ 0b1111'1010'0000'0000'0000'0000'0000'1111 } };
+  constexpr auto systest1 = run_instructions(program);
+  static_assert(systest1.PC() == 4);
+  check_jit(program);
+}
+
+void test_always_executing_jump()
+{
+  constexpr std::array program{ Instruction{ 0b1110'1010'0000'0000'0000'0000'0000'1111 } };
+  constexpr auto systest2 = run_instructions(program);
+  static_assert(systest2.PC() == 68);
+  static_assert(systest2.registers[14] == 0);
+  check_jit(program);
+}
+
+void test_always_executing_jump_with_saved_return()
+{
+  constexpr std::array program{ Instruction{ 0b1110'1011'0000'0000'0000'0000'0000'1111 } };
+  constexpr auto systest3 = run_instructions(program);
+  static_assert(systest3.PC() == 68);
+  static_assert(systest3.registers[14] == 4);
+  check_jit(program);
+}
+
+void test_add_of_register()
+{
+  constexpr std::array program{ Instruction{ 0xe2800055 } };  // add r0, r0, #85
+  constexpr auto systest4 = run_instructions(program);
+  static_assert(systest4.registers[0] == 0x55);
+  check_jit(program);
+}
+
+void test_add_of_register_with_shifts()
+{
+  constexpr std::array program{ Instruction{ 0xe2800055 },  // add r0, r0, #85
+                                Instruction{ 0xe2800c7e }   // add r0, r0, #32256
+  };
+  constexpr auto systest5 = run_instructions(program);
+  static_assert(systest5.registers[0] == (85 + 32256));
+  check_jit(program);
+}
+
+
+void test_multiple_adds_and_sub()
+{
+  constexpr std::array program{ Instruction{ 0xe2800001 },  // add r0, r0, #1
+                                Instruction{ 0xe2811009 },  // add r1, r1, #9
+                                Instruction{ 0xe2822002 },  // add r2, r2, #2
+                                Instruction{ 0xe0423001 }   // sub r3, r2, r1
+  };
+  constexpr auto systest6 = run_instructions(program);
+  static_assert(systest6.registers[3] == static_cast<std::uint32_t>(2 - 9));
+  check_jit(program);
+}
+
+void test_memory_writes()
+{
+  constexpr std::array program{ Instruction{ 0xe3a00064 },  // mov r0, #100 ; 0x64
+                                Instruction{ 0xe3a01005 },  // mov r1, #5
+                                Instruction{ 0xe5c01000 },  // strb r1, [r0]
+                                Instruction{ 0xe3a00000 },  // mov r0, #0
+                                Instruction{ 0xe1a0f00e }   // mov pc, lr
+  };
+  constexpr auto systest6 = run_instructions(program);
+
+  static_assert(systest6.RAM[100] == 5);
+  check_jit(program);
+}
+
+void test_scaled_register_offset()
+{
+  constexpr std::array program{ Instruction{ 0xe3a00c01 },  // mov r0, #256
+                                Instruction{ 0xe3a01003 },  // mov r1, #3
+                                Instruction{ 0xe3a02007 },  // mov r2, #7
+                                Instruction{ 0xe7802101 },  // str r2, [r0, r1, lsl #2]
+                                Instruction{ 0xe7903101 },  // ldr r3, [r0, r1, lsl #2]
+                                Instruction{ 0xe1a0f00e }   // mov pc, lr
+  };
+  constexpr auto sys = run_code(0, to_memory(program));
+  static_assert(sys.RAM.read_word(268) == 7);
+  static_assert(sys.registers[3] == 7);
+  check_jit(0, to_memory(program));
+}
+
+void test_lsr()
+{
+  constexpr std::array program{ Instruction{ 0xe3a03005 }, // mov r3, #5
+      Instruction{ 0xe1a02123 } // lsr r2, r3, #2
+      };
+  constexpr auto sys = run_instructions(program);
+  static_assert(sys.registers[2] == 1);
+  static_assert(sys.registers[3] == 5);
+  check_jit(program);
+}
+
+void test_multiply_long()
+{
+  // r3:r2 (= 2 for the accumulating forms) plus or times r0 = -1 and r1 = 2
+  constexpr auto multiply = [](const Instruction instruction) {
+    return run_instructions(std::array{ Instruction{ 0xe3e00000 },  // mvn r0, #0
+                                        Instruction{ 0xe3a01002 },  // mov r1, #2
+                                        Instruction{ 0xe3a02002 },  // mov r2, #2
+                                        instruction });
+  };
+  constexpr auto result = [](const auto &sys) { return std::array{ sys.registers[2], sys.registers[3] }; };
+
+  static_assert(result(multiply(Instruction{ 0xe0c32190 })) == std::array<std::uint32_t, 2>{ 0xFFFF'FFFE, 0xFFFF'FFFF });  // smull r2, r3, r0, r1
+  static_assert(result(multiply(Instruction{ 0xe0832190 })) == std::array<std::uint32_t, 2>{ 0xFFFF'FFFE, 1 });            // umull r2, r3, r0, r1
+  static_assert(result(multiply(Instruction{ 0xe0a32190 })) == std::array<std::uint32_t, 2>{ 0, 2 });                      // umlal r2, r3, r0, r1
+  static_assert(result(multiply(Instruction{ 0xe0e32190 })) == std::array<std::uint32_t, 2>{ 0, 0 });                      // smlal r2, r3, r0, r1
+
+  // the flags come from the accumulated 64 bit value
+  static_assert(multiply(Instruction{ 0xe0f32190 }).z_flag());  // smlals r2, r3, r0, r1
+
+  // translated the same way
+  for (const auto instruction : { 0xe0c32190u, 0xe0832190u, 0xe0a32190u, 0xe0e32190u }) {
+    check_jit(std::array{ Instruction{ 0xe3e00000 }, Instruction{ 0xe3a01002 }, Instruction{ 0xe3a02002 }, Instruction{ instruction } });
+  }
+}
+
+void test_shift_by_register()
+{
+  // r0 = r1 (0x80000000) or r3 (1) shifted by r2 = amount, flags set
+  constexpr auto shift_by = [](const std::uint32_t amount, const Instruction shift) {
+    return run_instructions(std::array{ Instruction{ 0xe3a01102 },           // mov r1, #0x80000000
+                                        Instruction{ 0xe3a03001 },           // mov r3, #1
+                                        Instruction{ 0xe3a02000 | amount },  // mov r2, #amount
+                                        shift });
+  };
+  constexpr Instruction lsl{ 0xe1b00213 };  // movs r0, r3, lsl r2
+  constexpr Instruction lsr{ 0xe1b00231 };  // movs r0, r1, lsr r2
+  constexpr Instruction asr{ 0xe1b00251 };  // movs r0, r1, asr r2
+  constexpr Instruction ror{ 0xe1b00271 };  // movs r0, r1, ror r2
+
+  // 0 leaves the value and the carry alone
+  static_assert(shift_by(0, lsr).registers[0] == 0x8000'0000 && !shift_by(0, lsr).c_flag());
+  static_assert(shift_by(0, asr).registers[0] == 0x8000'0000 && !shift_by(0, asr).c_flag());
+  static_assert(shift_by(0, ror).registers[0] == 0x8000'0000 && !shift_by(0, ror).c_flag());
+
+  // 32 shifts everything out, the carry is the last bit shifted out
+  static_assert(shift_by(32, lsl).registers[0] == 0 && shift_by(32, lsl).c_flag());
+  static_assert(shift_by(32, lsr).registers[0] == 0 && shift_by(32, lsr).c_flag());
+  static_assert(shift_by(32, asr).registers[0] == 0xFFFF'FFFF && shift_by(32, asr).c_flag());
+  static_assert(shift_by(32, ror).registers[0] == 0x8000'0000 && shift_by(32, ror).c_flag());
+
+  // past 32 nothing is left, rotates wrap around
+  static_assert(shift_by(33, lsl).registers[0] == 0 && !shift_by(33, lsl).c_flag());
+  static_assert(shift_by(33, lsr).registers[0] == 0 && !shift_by(33, lsr).c_flag());
+  static_assert(shift_by(33, asr).registers[0] == 0xFFFF'FFFF && shift_by(33, asr).c_flag());
+  static_assert(shift_by(33, ror).registers[0] == 0x4000'0000 && !shift_by(33, ror).c_flag());
+
+  // Thumb lsrs r1, r2 is the same instruction
+  static_assert(decode_thumb(0x40d1).instruction == 0xe1b01231);
+}
+
+void test_sub_with_shift()
+{
+  constexpr std::array program{ Instruction{ 0xe2800001 },  // add r0, r0, #1
+                                Instruction{ 0xe2811009 },  // add r1, r1, #9
+                                Instruction{ 0xe2822002 },  // add r2, r2, #2
+                                Instruction{ 0xe0403231 }   // sub r3, r0, r1, lsr r2
+                                                            // logical right shift r1 by the number in bottom byte of r2
+                                                            // subtract result from r0 and put answer in r3
+  };
+  constexpr auto systest7 = run_instructions(program);
+
+  static_assert(systest7.registers[3] == static_cast<std::uint32_t>(1 - (9 >> 2)));
+  check_jit(program);
+}
+
+void test_flags_survive_partial_update()
+{
+  constexpr std::array program{ Instruction{ 0xe3a00101 },  // mov r0, #1073741824
+                                Instruction{ 0xe0900000 },  // adds r0, r0, r0
+                                Instruction{ 0xe3b01000 }   // movs r1, #0
+  };
+  constexpr auto sys = run_instructions(program);
+
+  // movs replaces N, Z and C but V has to survive from the adds
+  static_assert(sys.cspr() == (decltype(sys)::z_bit | decltype(sys)::v_bit));
+  static_assert(sys.z_flag() && sys.v_flag() && !sys.n_flag() && !sys.c_flag());
+  check_jit(program);
+}
+
+void test_multiply()
+{
+  constexpr std::array program{ Instruction{ 0xe3a01006 },  // mov r1, #6
+                                Instruction{ 0xe3a02007 },  // mov r2, #7
+                                Instruction{ 0xe0000291 },  // mul r0, r1, r2
+                                Instruction{ 0xe0230291 },  // mla r3, r1, r2, r0
+                                Instruction{ 0xe0140291 }   // muls r4, r1, r2
+  };
+  constexpr auto sys = run_instructions(program);
+  static_assert(sys.registers[0] == 42);
+  static_assert(sys.registers[3] == 84);
+  static_assert(sys.registers[4] == 42);
+  static_assert(!sys.z_flag() && !sys.n_flag());
+  check_jit(program);
+}
+
+void test_block_data_transfer()
+{
+  constexpr std::array program{ Instruction{ 0xe3a00c01 },  // mov r0, #256
+                                Instruction{ 0xe3a01001 },  // mov r1, #1
+                                Instruction{ 0xe3a02002 },  // mov r2, #2
+                                Instruction{ 0xe3a03003 },  // mov r3, #3
+                                Instruction{ 0xe880000e },  // stmia r0, {r1, r2, r3}
+                                Instruction{ 0xe9900030 },  // ldmib r0, {r4, r5}
+                                Instruction{ 0xe8200006 },  // stmda r0!, {r1, r2}
+                                Instruction{ 0xe99000c0 },  // ldmib r0, {r6, r7}
+                                Instruction{ 0xe1a0f00e }   // mov pc, lr
+  };
+  constexpr auto sys = run_code(0, to_memory(program));
+  static_assert(sys.RAM.read_word(256) == 2);
+  static_assert(sys.RAM.read_word(260) == 2);
+  static_assert(sys.RAM.read_word(264) == 3);
+  static_assert(sys.registers[4] == 2 && sys.registers[5] == 3);
+  static_assert(sys.registers[0] == 248);
+  static_assert(sys.registers[6] == 1 && sys.registers[7] == 2);
+  check_jit(0, to_memory(program));
+}
+
+void test_function_call_with_push_and_pop()
+{
+  constexpr std::array program{ Instruction{ 0xe3a0dc02 },  // mov sp, #512
+                                Instruction{ 0xe52de004 },  // push {lr}
+                                Instruction{ 0xe3a04001 },  // mov r4, #1
+                                Instruction{ 0xeb000001 },  // bl func
+                                Instruction{ 0xe2844064 },  // add r4, r4, #100
+                                Instruction{ 0xe49df004 },  // pop {pc}
+                                Instruction{ 0xe92d4030 },  // func: push {r4, r5, lr}
+                                Instruction{ 0xe3a04007 },  // mov r4, #7
+                                Instruction{ 0xe3a05009 },  // mov r5, #9
+                                Instruction{ 0xe0000594 },  // mul r0, r4, r5
+                                Instruction{ 0xe8bd8030 }   // pop {r4, r5, pc}
+  };
+  constexpr auto sys = run_code(0, to_memory(program));
+  static_assert(sys.registers[0] == 63);
+  static_assert(sys.registers[4] == 101);
+  static_assert(sys.registers[5] == 0);
+  static_assert(sys.registers[13] == 512);
+  static_assert(sys.PC() == decltype(sys)::halt_address);
+  check_jit(0, to_memory(program));
+}
+
+void test_looping()
+{
+  /*
+  #include <cstdint>
+
+  template<typename T>
+    volatile T& get_loc(const std::uint32_t loc)
+    {
+      return *reinterpret_cast<T*>(loc);
+    }
+
+  int main()
+  {
+    for (int i = 0; i < 100; ++i) {
+      get_loc<std::int8_t>(100+i) = i%5;
+    }
+  }
+  */
+
+  // compiles to:
+
+  /*
+  00000000 <main>:
+   0:	e59f102c 	ldr	r1, [pc, #44]	; 34 <main+0x34>
+   4:	e3a00000 	mov	r0, #0
+   8:	e0832190 	umull	r2, r3, r0, r1
+   c:	e1a02123 	lsr	r2, r3, #2
+  10:	e0822102 	add	r2, r2, r2, lsl #2
+  14:	e2622000 	rsb	r2, r2, #0
+  18:	e0802002 	add	r2, r0, r2
+  1c:	e5c02064 	strb	r2, [r0, #100]	; 0x64
+  20:	e2800001 	add	r0, r0, #1
+  24:	e3500064 	cmp	r0, #100	; 0x64
+  28:	1afffff6 	bne	8 <main+0x8>
+  2c:	e3a00000 	mov	r0, #0
+  30:	e1a0f00e 	mov	pc, lr
+  34:	cccccccd 	.word	0xcccccccd
+  */
+
+  constexpr std::array<std::uint8_t, 56> program{
+    0x2c, 0x10, 0x9f, 0xe5, 0x00, 0x00, 0xa0, 0xe3, 0x90, 0x21, 0x83, 0xe0, 0x23, 0x21, 0xa0, 0xe1, 0x02, 0x21, 0x82, 0xe0, 0x00, 0x20, 0x62, 0xe2, 0x02, 0x20, 0x80, 0xe0, 0x64, 0x20, 0xc0, 0xe5, 0x01, 0x00, 0x80, 0xe2, 0x64, 0x00, 0x50, 0xe3, 0xf6, 0xff, 0xff, 0x1a, 0x00, 0x00, 0xa0, 0xe3, 0x0e, 0xf0, 0xa0, 0xe1, 0xcd, 0xcc, 0xcc, 0xcc};
+  constexpr auto system = run_code(0, program);
+
+//  std::cout << std::hex << static_cast<unsigned int>(system.RAM[0x34]) << '\n';
+
+//  std::cout << static_cast<int>(system.RAM[100]) << '\n';
+  static_assert(system.RAM[100] == 0);
+  static_assert(system.RAM[104] == 4);
+  static_assert(system.RAM[105] == 0);
+  static_assert(system.RAM[106] == 1);
+  check_jit(0, program);
+}
+
+
+void test_paged_memory()
+{
+  constexpr std::array program{ Instruction{ 0xe3a00102 },  // mov r0, #0x80000000
+                                Instruction{ 0xe2800c0f },  // add r0, r0, #3840
+                                Instruction{ 0xe280007f },  // add r0, r0, #127
+                                Instruction{ 0xe280007f },  // add r0, r0, #127
+                                Instruction{ 0xe3a01055 },  // mov r1, #85
+                                Instruction{ 0xe5801000 },  // str r1, [r0]
+                                Instruction{ 0xe5902000 },  // ldr r2, [r0]
+                                Instruction{ 0xe5903100 },  // ldr r3, [r0, #256]
+                                Instruction{ 0xe1a0f00e }   // mov pc, lr
+  };
+
+  System<Paged_Memory> system{ to_memory(program) };
+  system.run(0);
+
+  // the word store straddles the pages at 0x80000ffe
+  require(system.registers[2] == 85, "word written across a page boundary reads back");
+  require(system.RAM[0x8000'0ffe] == 85 && system.RAM[0x8000'1000] == 0, "word is stored little endian");
+  require(system.registers[3] == 0, "untouched memory reads as 0");
+
+#ifdef ARM_JIT_SUPPORTED
+  System<Paged_Memory> jitted{ to_memory(program) };
+  JIT{ jitted, 0 }.run(0);
+  require(jitted == system, "JIT on paged memory matches the interpreter");
+#endif
+}
+
+void test_memory_mapped_uart()
+{
+  constexpr std::array program{ Instruction{ 0xe3a00201 },  // mov r0, #0x10000000
+                                Instruction{ 0xe3a01048 },  // mov r1, #72
+                                Instruction{ 0xe5c01000 },  // strb r1, [r0]
+                                Instruction{ 0xe3a01069 },  // mov r1, #105
+                                Instruction{ 0xe5c01000 },  // strb r1, [r0]
+                                Instruction{ 0xe5902004 },  // ldr r2, [r0, #4]
+                                Instruction{ 0xe3a03064 },  // mov r3, #100
+                                Instruction{ 0xe5832000 },  // str r2, [r3]
+                                Instruction{ 0xe1a0f00e }   // mov pc, lr
+  };
+
+  UART uart;
+  System<Memory_Bus<>> system{ to_memory(program) };
+  system.RAM.attach(0x1000'0000, 8, uart);
+  system.run(0);
+
+  require(uart.output == "Hi", "bytes stored to the UART data register reach the host buffer");
+  require(system.RAM[100] == UART::transmit_ready, "status register read lands in RAM");
+  require(system.RAM.backing()[0x1000'0000] == 0, "device writes do not reach the backing memory");
+}
+
+void test_semihosting()
+{
+  constexpr std::array program{ Instruction{ 0xe3a05c02 },  // mov r5, #512
+                                Instruction{ 0xe3a06061 },  // mov r6, #'a'
+                                Instruction{ 0xe5c56000 },  // strb r6, [r5]
+                                Instruction{ 0xe3a04064 },  // mov r4, #100
+                                Instruction{ 0xe3a00001 },  // loop: mov r0, #1
+                                Instruction{ 0xe1a01005 },  // mov r1, r5
+                                Instruction{ 0xe3a02001 },  // mov r2, #1
+                                Instruction{ 0xef000002 },  // swi write
+                                Instruction{ 0xe2544001 },  // subs r4, r4, #1
+                                Instruction{ 0x1afffff9 },  // bne loop
+                                Instruction{ 0xe3a00000 },  // mov r0, #0
+                                Instruction{ 0xe1a01005 },  // mov r1, r5
+                                Instruction{ 0xe3a02004 },  // mov r2, #4
+                                Instruction{ 0xef000003 },  // swi read
+                                Instruction{ 0xe1a06000 },  // mov r6, r0
+                                Instruction{ 0xe5957000 },  // ldr r7, [r5]
+                                Instruction{ 0xef000004 },  // swi clock
+                                Instruction{ 0xe3a0002a },  // mov r0, #42
+                                Instruction{ 0xef000001 },  // swi exit
+                                Instruction{ 0xe3a00007 },  // mov r0, #7
+                                Instruction{ 0xe1a0f00e }   // mov pc, lr
+  };
+
+  const auto run = [&](auto &&runner) {
+    std::ostringstream out;
+    std::istringstream in{ "xyz" };
+    Semihosting host{ out, in };
+    System system{ to_memory(program) };
+    system.host = &host;
+    runner(system);
+
+    require(out.str() == std::string(100, 'a'), "guest output reaches the host stream");
+    require(host.host_writes == 1, "guest output is batched");
+    require(system.registers[6] == 3 && system.registers[7] == 0x007a7978, "guest reads host input");
+    require(host.exit_status == 42u && system.registers[0] == 42 && system.halted(), "exit stops the guest");
+  };
+
+  run([](auto &system) { system.run(0); });
+  run([](auto &system) {
+    system.start(0);
+    require(system.run_for(1000).reason == Stop_Reason::Halted, "exit is a normal stop");
+  });
+#ifdef ARM_JIT_SUPPORTED
+  run([](auto &system) { JIT{ system, 0 }.run(0); });
+#endif
+
+  // reads are taken a buffer at a time, so asking for 4 GB costs no more
+  // than what's there
+  {
+    constexpr std::array huge_read{ Instruction{ 0xe3a00000 },  // mov r0, #0
+                                    Instruction{ 0xe3a01c02 },  // mov r1, #512
+                                    Instruction{ 0xe3e02000 },  // mvn r2, #0
+                                    Instruction{ 0xef000003 },  // swi read
+                                    Instruction{ 0xe5917000 } };  // ldr r7, [r1]
+    std::ostringstream out;
+    std::istringstream in{ "xyz" };
+    Semihosting host{ out, in, 2 };
+    System system{ to_memory(huge_read) };
+    system.host = &host;
+    system.run(0);
+    require(system.registers[0] == 3 && system.registers[7] == 0x007a7978, "large reads stop at the end of the input");
+  }
+
+  // without a host SWIs fault, as do calls the host doesn't know
+  System no_host{ to_memory(program) };
+  no_host.run(0);
+  require(no_host.fault && no_host.fault->address == 28, "SWI without a host");
+
+  Semihosting host;
+  System unknown{ to_memory(std::array{ Instruction{ 0xef000063 } }) };  // swi 99
+  unknown.host = &host;
+  unknown.run(0);
+  require(unknown.fault && unknown.fault->type == Instruction_Type::Software_Interrupt, "unknown call");
+
+  static_assert(decode_thumb(0xdf02).instruction == 0xef000002);  // Thumb swi 2
+}
+
+void test_snapshot_and_fork()
+{
+  constexpr std::array program{ Instruction{ 0xe3a01801 },  // mov r1, #0x10000
+                                Instruction{ 0xe5912000 },  // ldr r2, [r1]
+                                Instruction{ 0xe0800002 },  // add r0, r0, r2
+                                Instruction{ 0xe5810000 },  // str r0, [r1]
+                                Instruction{ 0xe1a0f00e }   // mov pc, lr
+  };
+
+  // warm up: the accumulator at 0x10000 holds 5
+  System<Paged_Memory> warm{ to_memory(program) };
+  warm.registers[0] = 5;
+  warm.run(0);
+  require(warm.RAM.read_word(0x10000) == 5, "warm up run");
+
+  // restore undoes everything done after the snapshot
+  const auto snapshot = warm.snapshot();
+  warm.registers[0]   = 100;
+  warm.run(0);
+  require(warm.RAM.read_word(0x10000) == 105, "run after snapshot");
+  warm.restore(snapshot);
+  require(warm == snapshot && warm.RAM.read_word(0x10000) == 5, "restore");
+
+  // forks run concurrently, each sees the warmed-up state and only its own writes
+  std::vector<System<Paged_Memory>> forks(8, warm);
+  std::vector<std::thread> threads;
+  for (std::uint32_t fork = 0; fork < forks.size(); ++fork) {
+    threads.emplace_back([&system = forks[fork], fork] {
+      system.registers[0] = fork;
+      system.run(0);
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  for (std::uint32_t fork = 0; fork < forks.size(); ++fork) {
+    require(forks[fork].registers[0] == fork + 5 && forks[fork].RAM.read_word(0x10000) == fork + 5, "forked run");
+    require(forks[fork].RAM.private_pages() == 1, "forks only copy the pages they write");
+  }
+  require(warm.RAM.read_word(0x10000) == 5 && warm.RAM.read_word(0) == 0xe3a01801, "forks leave the original alone");
+
+  // the original gives up its pages to the copies, its own writes stay its own
+  warm.RAM.write_word(0x10000, 42);
+  require(forks[0].RAM.read_word(0x10000) == 5 && snapshot.RAM.read_word(0x10000) == 5, "the original copies what it writes");
+  require(warm.RAM.private_pages() == 1, "the original only copies the pages it writes");
+
+  // moving a memory that has been copied keeps the copy's pages shared
+  Paged_Memory copied;
+  copied.write_word(0, 1);
+  const auto copy = copied;
+  Paged_Memory moved;
+  moved = std::move(copied);
+  moved.write_word(0, 2);
+  require(copy.read_word(0) == 1 && moved.read_word(0) == 2, "move assignment after a copy");
+}
+
+#ifdef __unix__
+// Writes a minimal executable: code at 0x8000 followed in the file by a data
+// segment at 0x9000 + code size with .bss after it. Both segments share a
+// file page, and junk after the data must not show up in guest memory.
+template<std::size_t Size>
+std::string write_test_elf(const std::array<Instruction, Size> &program, const std::uint32_t data, const std::uint32_t bss_size,
+                           const std::vector<std::pair<std::string, std::uint32_t>> &functions = {})
+{
+  constexpr std::uint32_t code_offset  = 0x1000;
+  constexpr std::uint32_t code_address = 0x8000;
+
+  const auto code = to_memory(program);
+  const auto code_size = static_cast<std::uint32_t>(code.size());
+
+  Elf32_Ehdr header{};
+  std::memcpy(header.e_ident, ELFMAG, SELFMAG);
+  header.e_ident[EI_CLASS]   = ELFCLASS32;
+  header.e_ident[EI_DATA]    = ELFDATA2LSB;
+  header.e_ident[EI_VERSION] = EV_CURRENT;
+  header.e_type              = ET_EXEC;
+  header.e_machine           = EM_ARM;
+  header.e_version           = EV_CURRENT;
+  header.e_entry             = code_address;
+  header.e_phoff             = sizeof(Elf32_Ehdr);
+  header.e_ehsize            = sizeof(Elf32_Ehdr);
+  header.e_phentsize         = sizeof(Elf32_Phdr);
+  header.e_phnum             = 2;
+
+  std::array<Elf32_Phdr, 2> segments{};
+  segments[0].p_type   = PT_LOAD;
+  segments[0].p_offset = code_offset;
+  segments[0].p_vaddr  = code_address;
+  segments[0].p_filesz = code_size;
+  segments[0].p_memsz  = code_size;
+  segments[0].p_flags  = PF_R | PF_X;
+  segments[0].p_align  = 0x1000;
+
+  segments[1].p_type   = PT_LOAD;
+  segments[1].p_offset = code_offset + code_size;
+  segments[1].p_vaddr  = code_address + 0x1000 + code_size;
+  segments[1].p_filesz = sizeof(data);
+  segments[1].p_memsz  = sizeof(data) + bss_size;
+  segments[1].p_flags  = PF_R | PF_W;
+  segments[1].p_align  = 0x1000;
+
+  std::vector<std::uint8_t> file(code_offset + code_size + sizeof(data) + 16, 0xAA);
+  std::copy(code.begin(), code.end(), file.begin() + code_offset);
+  std::memcpy(file.data() + code_offset + code_size, &data, sizeof(data));
+
+  // a symbol table for the functions, after everything else
+  if (!functions.empty()) {
+    std::string names(1, '\0');
+    std::vector<Elf32_Sym> symbols(1);
+    for (const auto &[name, address] : functions) {
+      Elf32_Sym symbol{};
+      symbol.st_name  = static_cast<Elf32_Word>(names.size());
+      symbol.st_value = code_address + address;
+      symbol.st_info  = ELF32_ST_INFO(STB_GLOBAL, STT_FUNC);
+      symbol.st_shndx = SHN_ABS;
+      symbols.push_back(symbol);
+      names += name + '\0';
+    }
+
+    std::array<Elf32_Shdr, 3> sections{};
+    sections[1].sh_type    = SHT_SYMTAB;
+    sections[1].sh_offset  = static_cast<Elf32_Off>(file.size());
+    sections[1].sh_size    = static_cast<Elf32_Word>(symbols.size() * sizeof(Elf32_Sym));
+    sections[1].sh_link    = 2;
+    sections[1].sh_entsize = sizeof(Elf32_Sym);
+    sections[2].sh_type    = SHT_STRTAB;
+    sections[2].sh_offset  = sections[1].sh_offset + sections[1].sh_size;
+    sections[2].sh_size    = static_cast<Elf32_Word>(names.size());
+
+    header.e_shoff     = sections[2].sh_offset + sections[2].sh_size;
+    header.e_shentsize = sizeof(Elf32_Shdr);
+    header.e_shnum     = sections.size();
+
+    file.resize(header.e_shoff + sizeof(sections));
+    std::memcpy(file.data() + sections[1].sh_offset, symbols.data(), sections[1].sh_size);
+    std::memcpy(file.data() + sections[2].sh_offset, names.data(), names.size());
+    std::memcpy(file.data() + header.e_shoff, sections.data(), sizeof(sections));
+  }
+
+  std::memcpy(file.data(), &header, sizeof(header));
+  std::memcpy(file.data() + header.e_phoff, segments.data(), sizeof(segments));
+
+  char path[] = "/tmp/arm_elf_XXXXXX";
+  const int fd = mkstemp(path);
+  require(fd >= 0, "unable to create temporary file");
+  require(write(fd, file.data(), file.size()) == static_cast<ssize_t>(file.size()), "unable to write temporary file");
+  close(fd);
+
+  return path;
+}
+
+void test_elf_loader()
+{
+  constexpr std::array program{ Instruction{ 0xe59f200c },  // ldr r2, [pc, #12]
+                                Instruction{ 0xe5920000 },  // ldr r0, [r2]
+                                Instruction{ 0xe5921004 },  // ldr r1, [r2, #4]
+                                Instruction{ 0xe0800001 },  // add r0, r0, r1
+                                Instruction{ 0xe1a0f00e },  // mov pc, lr
+                                Instruction{ 0x00009018 }   // .word data
+  };
+
+  const auto path = write_test_elf(program, 0x12345, 0x100);
+
+  auto paged = std::make_unique<System<Paged_Memory>>();
+  paged->run(load_elf(paged->RAM, path));
+  require(paged->registers[0] == 0x12345, "program loaded onto paged memory runs");
+  require(paged->RAM.read_word(0x901c) == 0, ".bss reads as zero on paged memory");
+  require(paged->RAM.read_word(0x8018) == 0, "the data segment's bytes stay out of the code page");
+
+  auto fixed = std::make_unique<System<Fixed_Memory<0x10000>>>();
+  fixed->run(load_elf(fixed->RAM, path));
+  require(fixed->registers[0] == 0x12345, "program copied onto fixed memory runs");
+  require(fixed->RAM.read_word(0x901c) == 0, ".bss reads as zero on fixed memory");
+
+  unlink(path.c_str());
+}
+#endif
+
+void test_library_calls()
+{
+  constexpr std::array program{ Instruction{ 0xe3a0db01 },  // mov sp, #1024
+                                Instruction{ 0xe52de004 },  // push {lr}
+                                Instruction{ 0xe3a00c02 },  // mov r0, #512
+                                Instruction{ 0xe3a01000 },  // mov r1, #0
+                                Instruction{ 0xe3a02025 },  // mov r2, #37
+                                Instruction{ 0xeb000006 },  // bl memcpy
+                                Instruction{ 0xe2804001 },  // add r4, r0, #1
+                                Instruction{ 0xe3a00d0a },  // mov r0, #640
+                                Instruction{ 0xe3a0105a },  // mov r1, #90
+                                Instruction{ 0xe3a02013 },  // mov r2, #19
+                                Instruction{ 0xeb000007 },  // bl memset
+                                Instruction{ 0xe1a05000 },  // mov r5, r0
+                                Instruction{ 0xe49df004 },  // pop {pc}
+                                Instruction{ 0xe1a0c000 },  // memcpy: mov r12, r0
+                                Instruction{ 0xe2522001 },  // copy: subs r2, r2, #1
+                                Instruction{ 0x54d13001 },  // ldrbpl r3, [r1], #1
+                                Instruction{ 0x54cc3001 },  // strbpl r3, [r12], #1
+                                Instruction{ 0x5afffffb },  // bpl copy
+                                Instruction{ 0xe12fff1e },  // bx lr
+                                Instruction{ 0xe1a03000 },  // memset: mov r3, r0
+                                Instruction{ 0xe2522001 },  // set: subs r2, r2, #1
+                                Instruction{ 0x54c31001 },  // strbpl r1, [r3], #1
+                                Instruction{ 0x5afffffc },  // bpl set
+                                Instruction{ 0xe12fff1e }   // bx lr
+  };
+
+  const auto path = write_test_elf(program, 0, 0, { { "memcpy", 0x34 }, { "memset", 0x4c }, { "main", 0 } });
+  const auto symbols = load_symbols(path);
+  unlink(path.c_str());
+  require(symbols.size() == 3 && symbols.at("memset") == 0x804c, "function symbols are loaded");
+
+  const auto library = library_entries(symbols);
+  require(library.memcpy == 0x8034 && library.memmove == Library_Entries::none, "library entries found by name");
+
+  // the guest's routines leave scratch registers and flags differently, what
+  // the caller can rely on is the same
+  constexpr auto reference = run_code(0, to_memory(program));
+  const auto same_results  = [&](const auto &system) {
+    return system.RAM == reference.RAM && system.registers[4] == reference.registers[4]
+           && system.registers[5] == reference.registers[5] && system.registers[13] == reference.registers[13] && system.halted();
+  };
+
+  System native{ to_memory(program) };
+  native.library.memcpy = 0x34;
+  native.library.memset = 0x4c;
+  native.run(0);
+  require(same_results(native), "native library calls");
+
+#ifdef ARM_JIT_SUPPORTED
+  System jitted{ to_memory(program) };
+  jitted.library = native.library;
+  JIT{ jitted, 0 }.run(0);
+  require(same_results(jitted), "native library calls from translated code");
+#endif
+
+  // and calls are counted as one instruction
+  System budgeted{ to_memory(program) };
+  budgeted.library = native.library;
+  budgeted.start(0);
+  require(budgeted.run_for(1000).instructions == 15 && same_results(budgeted), "native library calls in run_for");
+}
+
+void test_loop_idioms()
+{
+  constexpr std::array program{ Instruction{ 0xe3a01c01 },  // mov r1, #256
+                                Instruction{ 0xe3a020c8 },  // mov r2, #200
+                                Instruction{ 0xe7c12002 },  // init: strb r2, [r1, r2]
+                                Instruction{ 0xe2522001 },  // subs r2, r2, #1
+                                Instruction{ 0x1afffffc },  // bne init
+                                Instruction{ 0xe3a00c02 },  // mov r0, #512
+                                Instruction{ 0xe3a020c8 },  // mov r2, #200
+                                Instruction{ 0xe4d13001 },  // copy: ldrb r3, [r1], #1
+                                Instruction{ 0xe4c03001 },  // strb r3, [r0], #1
+                                Instruction{ 0xe2522001 },  // subs r2, r2, #1
+                                Instruction{ 0x1afffffb },  // bne copy
+                                Instruction{ 0xe3a04c03 },  // mov r4, #768
+                                Instruction{ 0xe2845040 },  // add r5, r4, #64
+                                Instruction{ 0xe3a01c01 },  // mov r1, #256
+                                Instruction{ 0xe4913004 },  // words: ldr r3, [r1], #4
+                                Instruction{ 0xe4843004 },  // str r3, [r4], #4
+                                Instruction{ 0xe1540005 },  // cmp r4, r5
+                                Instruction{ 0x1afffffb },  // bne words
+                                Instruction{ 0xe3a06d0e },  // mov r6, #896
+                                Instruction{ 0xe3a070ab },  // mov r7, #171
+                                Instruction{ 0xe3a02032 },  // mov r2, #50
+                                Instruction{ 0xe4c67001 },  // fill: strb r7, [r6], #1
+                                Instruction{ 0xe2522001 },  // subs r2, r2, #1
+                                Instruction{ 0x1afffffc },  // bne fill
+                                Instruction{ 0xe3a06d0f },  // mov r6, #960
+                                Instruction{ 0xe2868020 },  // add r8, r6, #32
+                                Instruction{ 0xe3a07e1f },  // mov r7, #496
+                                Instruction{ 0xe4867004 },  // fill_words: str r7, [r6], #4
+                                Instruction{ 0xe1560008 },  // cmp r6, r8
+                                Instruction{ 0x1afffffc },  // bne fill_words
+                                Instruction{ 0xe3a01c01 },  // mov r1, #256
+                                Instruction{ 0xe2810001 },  // add r0, r1, #1
+                                Instruction{ 0xe3a02014 },  // mov r2, #20
+                                Instruction{ 0xe4d13001 },  // repeat: ldrb r3, [r1], #1
+                                Instruction{ 0xe4c03001 },  // strb r3, [r0], #1
+                                Instruction{ 0xe2522001 },  // subs r2, r2, #1
+                                Instruction{ 0x1afffffb },  // bne repeat
+                                Instruction{ 0xe1a0f00e }   // mov pc, lr
+  };
+
+  // the compile time run is all interpreted
+  constexpr auto reference    = run_code(0, to_memory(program));
+  constexpr auto instructions = [program] {
+    System system{ to_memory(program) };
+    system.start(0);
+    return system.run_for(100'000).instructions;
+  }();
+
+  System native{ to_memory(program) };
+  native.run(0);
+  require(native == reference, "copy and fill loops");
+
+  // budgets stop part way through a loop
+  for (const std::uint64_t budget : { 5u, 7u, 64u }) {
+    System budgeted{ to_memory(program) };
+    budgeted.start(0);
+    std::uint64_t total = 0;
+    Run_Result result{};
+    do {
+      result = budgeted.run_for(budget);
+      total += result.instructions;
+    } while (result.reason == Stop_Reason::Budget_Exhausted);
+    require(budgeted == reference && total == instructions, "copy and fill loops in run_for");
+  }
+
+#ifdef ARM_JIT_SUPPORTED
+  System jitted{ to_memory(program) };
+  JIT{ jitted, 0 }.run(0);
+  require(jitted == reference, "copy and fill loops from translated code");
+#endif
+
+  // entering the copy loop from its branch does all but the last iteration
+  System copying{ to_memory(program) };
+  copying.registers[0] = 0x200;
+  copying.registers[1] = 0x100;
+  copying.registers[2] = 100;
+  copying.PC()         = 0x1c;
+  require(copying.fast_path(0x28, 1000) == 99 * 4 && copying.registers[2] == 1 && copying.registers[0] == 0x263, "copy loop");
+  require(copying.fast_path(0x28, 3) == 0, "a budget short of an iteration");
+}
+
+void test_profiler()
+{
+  constexpr std::array program{ Instruction{ 0xe3a0000a },  // mov r0, #10
+                                Instruction{ 0xe2500001 },  // loop: subs r0, r0, #1
+                                Instruction{ 0x1afffffd },  // bne loop
+                                Instruction{ 0xe1a0f00e }   // mov pc, lr
+  };
+
+  System<Fixed_Memory<1024>, Profiler> system{ to_memory(program) };
+  system.run(0);
+
+  const auto &profile = system.hooks;
+  require(profile.pc_counts.at(4) == 10 && profile.pc_counts.at(8) == 10, "per PC counts");
+  require(profile.branches.at(8).taken == 9 && profile.branches.at(8).not_taken == 1, "branch taken / not taken");
+  require(profile.type_counts[static_cast<std::size_t>(Instruction_Type::Branch)] == 10, "per type counts");
+  require(profile.opcode_counts[static_cast<std::size_t>(OpCode::SUB)] == 10, "per opcode counts");
+  require(profile.opcode_counts[static_cast<std::size_t>(OpCode::MOV)] == 2, "per opcode counts");
+  require(profile.condition_failed == 1, "condition failed counts");
+}
+
+void test_batch_runner()
+{
+  // r0 = sum of 1..r0, r1 is clobbered
+  constexpr std::array program{ Instruction{ 0xe3a01000 },  // mov r1, #0
+                                Instruction{ 0xe0811000 },  // loop: add r1, r1, r0
+                                Instruction{ 0xe2500001 },  // subs r0, r0, #1
+                                Instruction{ 0x1afffffc },  // bne loop
+                                Instruction{ 0xe1a00001 },  // mov r0, r1
+                                Instruction{ 0xe1a0f00e }   // mov pc, lr
+  };
+
+  System<Paged_Memory> prototype{ to_memory(program) };
+  prototype.start(0);
+
+  // uneven run lengths, some far longer than a slice
+  std::vector<System<Paged_Memory>> systems(32, prototype);
+  for (std::uint32_t system = 0; system < systems.size(); ++system) {
+    systems[system].registers[0] = (system % 4 == 0) ? 5000 + system : system + 1;
+  }
 
-  constexpr static void set_or_clear_bit(std::uint32_t &val, const std::uint32_t bit, const bool set)
-  {
-    if (set) {
-      val |= bit;
-    } else {
-      val &= ~bit;
-    }
+  const auto report = run_batch(systems, Batch_Options{ 4, 100 });
+
+  require(report.halted == systems.size() && report.over_budget == 0, "every system halts");
+  std::uint64_t instructions = 0;
+  for (std::uint32_t system = 0; system < systems.size(); ++system) {
+    const std::uint32_t n = (system % 4 == 0) ? 5000 + system : system + 1;
+    require(systems[system].registers[0] == n * (n + 1) / 2, "batch result");
+    require(report.retired[system] == 3 + 3 * std::uint64_t{ n }, "retired instruction count");
+    instructions += report.retired[system];
   }
+  require(report.instructions == instructions, "total instruction count");
 
+  // a runaway guest is stopped at its budget, the others still finish
+  std::vector<System<Paged_Memory>> runaway(2, prototype);
+  runaway[0].registers[0] = 0;  // counts down through zero for 2^32 iterations
+  runaway[1].registers[0] = 10;
+  const auto limited = run_batch(runaway, Batch_Options{ 2, 64, 10'000 });
+  require(limited.over_budget == 1 && limited.halted == 1 && limited.retired[0] == 10'000, "instruction budget");
+  require(runaway[1].registers[0] == 55, "budget doesn't affect other systems");
+}
 
-  constexpr bool n_flag() const noexcept { return CSPR & n_bit; }
-  constexpr void n_flag(const bool val) noexcept { set_or_clear_bit(CSPR, n_bit, val); }
+// r0 = sum of 1..10, ready to run
+constexpr auto sum_loop_start = [] {
+  constexpr std::array program{ Instruction{ 0xe3a01000 },  // mov r1, #0
+                                Instruction{ 0xe0811000 },  // loop: add r1, r1, r0
+                                Instruction{ 0xe2500001 },  // subs r0, r0, #1
+                                Instruction{ 0x1afffffc },  // bne loop
+                                Instruction{ 0xe1a00001 },  // mov r0, r1
+                                Instruction{ 0xe1a0f00e }   // mov pc, lr
+  };
+  System system{ to_memory(program) };
+  system.registers[0] = 10;
+  system.start(0);
+  return system;
+}();
 
-  constexpr bool z_flag() const noexcept { return CSPR & z_bit; }
-  constexpr void z_flag(const bool val) noexcept { set_or_clear_bit(CSPR, z_bit, val); }
+void test_compile_time_run()
+{
+  // 33 instructions in slices of 8 end in the fifth slice, as if run in one go
+  constexpr auto whole = [] {
+    auto system = sum_loop_start;
+    system.run_for(1000);
+    return system;
+  }();
+  static_assert(!compile_time_run<sum_loop_start, 8, 3>.halted());
+  static_assert(compile_time_run<sum_loop_start, 8, 4>.halted());
+  static_assert(compile_time_run<sum_loop_start, 8, 4> == whole);
+  static_assert(whole.registers[0] == 55);
+}
 
-  constexpr bool c_flag() const noexcept { return CSPR & c_bit; }
-  constexpr void c_flag(const bool val) noexcept { set_or_clear_bit(CSPR, c_bit, val); }
+void test_run_for()
+{
+  // r0 = sum of 1..r0
+  constexpr std::array program{ Instruction{ 0xe3a01000 },  // mov r1, #0
+                                Instruction{ 0xe0811000 },  // loop: add r1, r1, r0
+                                Instruction{ 0xe2500001 },  // subs r0, r0, #1
+                                Instruction{ 0x1afffffc },  // bne loop
+                                Instruction{ 0xe1a00001 },  // mov r0, r1
+                                Instruction{ 0xe1a0f00e }   // mov pc, lr
+  };
 
-  constexpr bool v_flag() const noexcept { return CSPR & v_bit; }
-  constexpr void v_flag(const bool val) noexcept { set_or_clear_bit(CSPR, v_bit, val); }
+  // budgets are charged per block but still exact, and execution resumes where it stopped
+  System<Paged_Memory> system{ to_memory(program) };
+  system.registers[0] = 10;
+  system.start(0);
 
-  //  constexpr void process_instruction
-  [[nodiscard]] constexpr bool check_condition(const Instruction instruction) const noexcept
-  {
-    switch (instruction.get_condition()) {
-    case Condition::EQ:  // Z set (==)
-      return z_flag();
-    case Condition::NE:  // Z clear (!=)
-      return !z_flag();
-    case Condition::HS:  // AKA CS C set (unsigned >=)
-      return c_flag();
-    case Condition::LO:  // AKA CC C clear (unsigned <)
-      return !c_flag();
-    case Condition::MI:  // N set (negative)
-      return n_flag();
-    case Condition::PL:  // N clear (positive or zero)
-      return !n_flag();
-    case Condition::VS:  // V set (overflow)
-      return v_flag();
-    case Condition::VC:  // V clear (no overflow)
-      return !v_flag();
-    case Condition::HI:  // C set and Z clear (unsigned higher)
-      return c_flag() && !z_flag();
-    case Condition::LS:  // C clear or Z (set unsigned lower or same)
-      return !c_flag() && z_flag();
-    case Condition::GE:  // N set and V set, or N clear and V clear (>=)
-      return (n_flag() && v_flag()) || (!n_flag() && !v_flag());
-    case Condition::LT:  // N set and V clear, or N clear and V set (<)
-      return (n_flag() && !v_flag()) || (!n_flag() && v_flag());
-    case Condition::GT:  // Z clear, and either N set and V set, or N clear and V clear (>)
-      return !z_flag() && ((n_flag() && v_flag()) || (!n_flag() && !v_flag()));
-    case Condition::LE:  // Z set, or N set and V clear,or N clear and V set (<=)
-      return z_flag() || (n_flag() && !v_flag()) || (!n_flag() && v_flag());
-    case Condition::AL:  // Always
-      return true;
-    case Condition::NV:  // Reserved
-      return false;
-    };
+  std::uint64_t total = 0;
+  Run_Result result{};
+  do {
+    result = system.run_for(7);
+    total += result.instructions;
+    require(result.reason == Stop_Reason::Halted || result.instructions == 7, "budget is exact");
+  } while (result.reason == Stop_Reason::Budget_Exhausted);
+  require(result.reason == Stop_Reason::Halted && total == 3 + 3 * 10 && system.registers[0] == 55, "resumed run");
+
+#ifdef ARM_JIT_SUPPORTED
+  // compiled blocks longer than the remaining budget aren't entered
+  System<Paged_Memory> interpreted{ to_memory(program) };
+  System<Paged_Memory> jitted{ to_memory(program) };
+  interpreted.registers[0] = jitted.registers[0] = 10;
+  interpreted.start(0);
+  jitted.start(0);
+
+  JIT jit{ jitted, 0 };
+  do {
+    result                = interpreted.run_for(5);
+    const auto jit_result = jit.run_for(5);
+    require(result.reason == jit_result.reason && result.instructions == jit_result.instructions, "JIT run_for result");
+    require(interpreted == jitted, "JIT run_for state");
+  } while (result.reason == Stop_Reason::Budget_Exhausted);
+#endif
+
+  // an undefined instruction stops execution on it
+  constexpr std::array faulting{ Instruction{ 0xe3a00001 },  // mov r0, #1
+                                 Instruction{ 0xe6000010 },  // undefined
+                                 Instruction{ 0xe3a00002 },  // mov r0, #2
+                                 Instruction{ 0xe1a0f00e }   // mov pc, lr
+  };
+
+  System<Paged_Memory> faulted{ to_memory(faulting) };
+  faulted.start(0);
+  result = faulted.run_for(100);
+  require(result.reason == Stop_Reason::Fault && result.instructions == 1, "fault stop reason");
+  require(faulted.fault->address == 4 && faulted.fault->type == Instruction_Type::Undefined, "fault details");
+  require(faulted.PC() == 4 && faulted.registers[0] == 1, "state at fault");
+}
+
+void test_trace_replay()
+{
+  // stack traffic, flag changes and a loop: r0 = 3 * 2^r0 computed recursively
+  constexpr std::array program{ Instruction{ 0xe92d4010 },  // func: push {r4, lr}
+                                Instruction{ 0xe1b04000 },  // movs r4, r0
+                                Instruction{ 0x03a00003 },  // moveq r0, #3
+                                Instruction{ 0x0a000002 },  // beq done
+                                Instruction{ 0xe2440001 },  // sub r0, r4, #1
+                                Instruction{ 0xebfffff9 },  // bl func
+                                Instruction{ 0xe0800000 },  // add r0, r0, r0
+                                Instruction{ 0xe8bd8010 }   // done: pop {r4, pc}
+  };
+
+  System<Paged_Memory, Trace_Recorder> system{ to_memory(program) };
+  system.registers[0]  = 12;
+  system.registers[13] = 0x8000;
+  const System<Paged_Memory> initial{ to_memory(program) };
+
+  system.run(0);
+  require(system.registers[0] == 3 << 12, "traced run");
+
+  const auto &trace = system.hooks;
+  require(trace.instructions() == 12 * 8 + 5, "recorded instruction count");
+  require(trace.size() < trace.instructions() * 8, "a few bytes per instruction");
+
+  // the state after every instruction matches a run stopped at that point
+  System<Paged_Memory> reference = initial;
+  reference.registers[0]         = 12;
+  reference.registers[13]        = 0x8000;
+  reference.start(0);
+
+  for (std::uint64_t instruction = 0; instruction <= trace.instructions(); ++instruction) {
+    System<Paged_Memory> replayed = initial;
+    trace.replay(replayed, instruction);
+    require(replayed == reference, "replayed state");
+    (void)reference.run_for(1);
   }
 
-  constexpr static auto lookup_table = get_lookup_table();
+  // with a small capacity only the end of a long run is kept
+  constexpr std::array loop{ Instruction{ 0xe3a01801 },  // mov r1, #0x10000
+                             Instruction{ 0xe3a02000 },  // mov r2, #0
+                             Instruction{ 0xe5812000 },  // loop: str r2, [r1]
+                             Instruction{ 0xe2822003 },  // add r2, r2, #3
+                             Instruction{ 0xe2500001 },  // subs r0, r0, #1
+                             Instruction{ 0x1afffffb },  // bne loop
+                             Instruction{ 0xe1a0f00e }   // mov pc, lr
+  };
 
-  [[nodiscard]] constexpr auto decode(const Instruction instruction) noexcept
-  {
-    for (const auto &elem : lookup_table) {
-      if ((std::get<0>(elem) & instruction) == std::get<1>(elem)) {
-        return std::get<2>(elem);
-      }
-    }
+  System<Paged_Memory, Trace_Recorder> looping{ to_memory(loop) };
+  looping.hooks.capacity = 100'000;
+  looping.registers[0]   = 20'000;
+  looping.run(0);
 
-    return Instruction_Type::Undefined;
+  const auto &ring = looping.hooks;
+  require(ring.first_instruction() > 0 && ring.size() <= ring.capacity, "old records are dropped");
+
+  System<Paged_Memory> long_reference{ to_memory(loop) };
+  long_reference.registers[0] = 20'000;
+  long_reference.start(0);
+  (void)long_reference.run_for(ring.instructions() - 10);
+
+  System<Paged_Memory> long_replayed{ to_memory(loop) };
+  ring.replay(long_replayed, ring.instructions() - 10);
+  require(long_replayed == long_reference, "replay after dropping records");
+
+  bool out_of_range = false;
+  try {
+    ring.replay(long_replayed, 0);
+  } catch (const std::out_of_range &) {
+    out_of_range = true;
   }
+  require(out_of_range, "dropped instructions can't be replayed");
+}
 
-  constexpr void process(const Instruction instruction) noexcept
-  {
-    // account for prefetch
-    PC() += 8;
-    if (check_condition(instruction)) {
-      switch (decode(instruction)) {
-      case Instruction_Type::Data_Processing: data_processing(instruction); break;
-      case Instruction_Type::MRS: assert(!"MRS Not Implemented"); break;
-      case Instruction_Type::MSR: assert(!"MSR Not Implemented"); break;
-      case Instruction_Type::MSRF: assert(!"MSR flags Not Implemented"); break;
-      case Instruction_Type::Multiply: assert(!"Multiply Not Implemented"); break;
-      case Instruction_Type::Multiply_Long: multiply_long(instruction); break;
-      case Instruction_Type::Single_Data_Swap: assert(!"Single_Data_Swap Not Implemented"); break;
-      case Instruction_Type::Single_Data_Transfer: single_data_transfer(instruction); break;
-      case Instruction_Type::Undefined: assert(!"Undefined Opcode"); break;
-      case Instruction_Type::Block_Data_Transfer: assert(!"Block_Data_Transfer Not Implemented"); break;
-      case Instruction_Type::Branch: branch(instruction); break;
-      case Instruction_Type::Coprocessor_Data_Transfer: assert(!"Coprocessor_Data_Transfer Not Implemented"); break;
-      case Instruction_Type::Coprocessor_Data_Operation: assert(!"Coprocessor_Data_Operation Not Implemented"); break;
-      case Instruction_Type::Coprocessor_Register_Transfer: assert(!"Coprocessor_Register_Transfer Not Implemented"); break;
-      case Instruction_Type::Software_Interrupt: assert(!"Software_Interrupt Not Implemented"); break;
+void test_condition_table()
+{
+  static_assert(condition_table[static_cast<std::size_t>(Condition::EQ)] == 0b1111'0000'1111'0000);
+  static_assert(condition_table[static_cast<std::size_t>(Condition::NE)] == 0b0000'1111'0000'1111);
+  static_assert(condition_table[static_cast<std::size_t>(Condition::HS)] == 0b1100'1100'1100'1100);
+  static_assert(condition_table[static_cast<std::size_t>(Condition::VS)] == 0b1010'1010'1010'1010);
+  static_assert(condition_table[static_cast<std::size_t>(Condition::HI)] == 0b0000'1100'0000'1100);
+  static_assert(condition_table[static_cast<std::size_t>(Condition::LS)] == 0b1111'0011'1111'0011);
+  static_assert(condition_table[static_cast<std::size_t>(Condition::GE)] == 0b1010'1010'0101'0101);
+  static_assert(condition_table[static_cast<std::size_t>(Condition::AL)] == 0xFFFF);
+  static_assert(condition_table[static_cast<std::size_t>(Condition::NV)] == 0);
+
+  // the table agrees with the individual flags, whatever produced them
+  constexpr auto agrees = [](const auto &sys) {
+    for (std::uint32_t condition = 0; condition < 16; ++condition) {
+      const Instruction instruction{ (condition << 28) | 0x01a00000 };  // mov r0, r0
+      if (sys.check_condition(instruction)
+          != condition_passes(static_cast<Condition>(condition), sys.n_flag(), sys.z_flag(), sys.c_flag(), sys.v_flag())) {
+        return false;
       }
     }
-    // discount prefetch
-    PC() -= 4;
+    return true;
+  };
 
-  }
-};
+  static_assert(agrees(run_instruction(Instruction{ 0xe3a00102 }, Instruction{ 0xe2500001 })));  // mov r0, #0x80000000; subs r0, r0, #1
+  static_assert(agrees(run_instruction(Instruction{ 0xe3b00000 })));                             // movs r0, #0
+  static_assert(agrees(run_instruction(Instruction{ 0xe3a00003 }, Instruction{ 0xe0921090 })));  // mov r0, #3; umulls r1, r2, r0, r0
+  static_assert(agrees(run_instruction(Instruction{ 0xe3a0000a }, Instruction{ 0xe350000a })));  // mov r0, #10; cmp r0, #10
+}
 
-template<typename... T> constexpr auto run_instruction(T... instruction)
+void test_arithmetic_flags()
 {
-  System system;
-  (system.process(instruction), ...);
-  return system;
+  // r2..r5 = 1 for HS, LO, HI, LS after cmp r0, r1
+  constexpr auto compare = [](const std::uint32_t lhs, const std::uint32_t rhs) {
+    return run_instructions(std::array{ Instruction{ 0xe3a00000 | lhs },  // mov r0, #lhs
+                                        Instruction{ 0xe3a01000 | rhs },  // mov r1, #rhs
+                                        Instruction{ 0xe1500001 },        // cmp r0, r1
+                                        Instruction{ 0x23a02001 },        // movhs r2, #1
+                                        Instruction{ 0x33a03001 },        // movlo r3, #1
+                                        Instruction{ 0x83a04001 },        // movhi r4, #1
+                                        Instruction{ 0x93a05001 } });     // movls r5, #1
+  };
+  constexpr auto conditions = [](const auto &sys) {
+    return std::array{ sys.registers[2], sys.registers[3], sys.registers[4], sys.registers[5] };
+  };
+  static_assert(conditions(compare(5, 3)) == std::array<std::uint32_t, 4>{ 1, 0, 1, 0 });
+  static_assert(conditions(compare(3, 3)) == std::array<std::uint32_t, 4>{ 1, 0, 0, 1 });
+  static_assert(conditions(compare(3, 5)) == std::array<std::uint32_t, 4>{ 0, 1, 0, 1 });
+
+  // carry out of an add of zero extended operands
+  constexpr auto carried = run_instruction(Instruction{ 0xe3a00001 },   // mov r0, #1
+                                           Instruction{ 0xe3e01000 },   // mvn r1, #0
+                                           Instruction{ 0xe0902001 });  // adds r2, r0, r1
+  static_assert(carried.registers[2] == 0 && carried.c_flag() && carried.z_flag() && !carried.v_flag());
+
+  // signed overflow of a subtract, with no borrow
+  constexpr auto overflowed = run_instruction(Instruction{ 0xe3a00102 },   // mov r0, #0x80000000
+                                              Instruction{ 0xe2502001 });  // subs r2, r0, #1
+  static_assert(overflowed.registers[2] == 0x7FFF'FFFF && overflowed.v_flag() && overflowed.c_flag() && !overflowed.n_flag());
+
+  // 64 bit add and subtract, r5:r4 = (0:0xFFFFFFFF) + (0:1) and (0:1) - (0:0xFFFFFFFF)
+  constexpr auto added = run_instruction(Instruction{ 0xe3e00000 },   // mvn r0, #0
+                                         Instruction{ 0xe3a01001 },   // mov r1, #1
+                                         Instruction{ 0xe0904001 },   // adds r4, r0, r1
+                                         Instruction{ 0xe0a25003 });  // adc r5, r2, r3
+  static_assert(added.registers[4] == 0 && added.registers[5] == 1);
+  constexpr auto subtracted = run_instruction(Instruction{ 0xe3e00000 },   // mvn r0, #0
+                                              Instruction{ 0xe3a01001 },   // mov r1, #1
+                                              Instruction{ 0xe0514000 },   // subs r4, r1, r0
+                                              Instruction{ 0xe0c25003 });  // sbc r5, r2, r3
+  static_assert(subtracted.registers[4] == 2 && subtracted.registers[5] == 0xFFFF'FFFF);
+
+  // rsbs r2, r0, #0 with r0 = 1 borrows
+  constexpr auto reversed = run_instruction(Instruction{ 0xe3a00001 }, Instruction{ 0xe2702000 });
+  static_assert(reversed.registers[2] == 0xFFFF'FFFF && !reversed.c_flag() && reversed.n_flag());
 }
 
-template<typename ... T> constexpr auto run_code(std::uint32_t start, T ... byte)
+void test_decode_table()
 {
-  std::array<std::uint8_t, sizeof...(T)> memory{static_cast<std::uint8_t>(byte)...};
-  System system{memory};
-  system.run(start);
-  return system;
+  // the table gives the same answer as searching, with any bits outside the key
+  constexpr auto agrees = [](const std::uint32_t other_bits) {
+    for (std::uint32_t key = 0; key < 4096; ++key) {
+      const Instruction instruction{ ((key & 0xFF0) << 16) | ((key & 0xF) << 4) | other_bits };
+
+      auto expected = Instruction_Type::Undefined;
+      for (const auto &[mask, value, type] : get_lookup_table()) {
+        if ((mask & instruction) == value) {
+          expected = type;
+          break;
+        }
+      }
+
+      if (System<>::decode(instruction) != expected) {
+        return false;
+      }
+    }
+    return true;
+  };
+
+  static_assert(agrees(0xE0000000));
+  static_assert(agrees(0xE00FFF0F));
+  static_assert(agrees(0xE0021005));
+  static_assert(System<>::decode(Instruction{ 0xe12fff1e }) == Instruction_Type::Branch_Exchange);         // bx lr
+  static_assert(System<>::decode(Instruction{ 0xe1d010b2 }) == Instruction_Type::Halfword_Data_Transfer);  // ldrh r1, [r0, #2]
 }
 
-void test_never_executing_jump()
+void test_thumb()
 {
-  constexpr auto systest1 = run_instruction(Instruction{ 0b1111'1010'0000'0000'0000'0000'0000'1111 });
-  static_assert(systest1.PC() == 4);
+  constexpr std::array program{ Instruction{ 0xe3a0dc02 },  // mov sp, #512
+                                Instruction{ 0xe28f0001 },  // add r0, pc, #1
+                                Instruction{ 0xe12fff10 },  // bx r0
+                                Instruction{ 0x220a2100 },  // movs r1, #0; movs r2, #10
+                                Instruction{ 0x3a011889 },  // loop: adds r1, r1, r2; subs r2, #1
+                                Instruction{ 0x4b0ad1fc },  // bne loop; ldr r3, literal
+                                Instruction{ 0x012524c8 },  // movs r4, #200; lsls r5, r4, #4
+                                Instruction{ 0xf000b502 },  // push {r1, lr}; bl func
+                                Instruction{ 0xbc02f80c },  // (bl); pop {r1}
+                                Instruction{ 0x3e08ae00 },  // add r6, sp, #0; subs r6, #8
+                                Instruction{ 0x88778075 },  // strh r5, [r6, #2]; ldrh r7, [r6, #2]
+                                Instruction{ 0x56b22202 },  // movs r2, #2; ldrsb r2, [r6, r2]
+                                Instruction{ 0x428b4361 },  // muls r1, r4; cmp r3, r1
+                                Instruction{ 0x2100dc00 },  // bgt done; movs r1, #0
+                                Instruction{ 0x1908bd00 },  // done: pop {pc}; func: adds r0, r1, r4
+                                Instruction{ 0x46c04770 },  // bx lr; nop
+                                Instruction{ 0x12345678 }   // literal
+  };
+  constexpr auto sys = run_code(0, to_memory(program));
+  static_assert(sys.registers[0] == 255);
+  static_assert(sys.registers[1] == 11000);
+  static_assert(sys.registers[2] == 0xFFFFFF80);
+  static_assert(sys.registers[3] == 0x12345678);
+  static_assert(sys.registers[4] == 200);
+  static_assert(sys.registers[5] == 3200);
+  static_assert(sys.registers[7] == 3200);
+  static_assert(sys.registers[13] == 512);
+  static_assert(sys.PC() == decltype(sys)::halt_address);
+  static_assert(sys.thumb());
+  check_jit(0, to_memory(program));
+
+  // translated Thumb matches the ARM instruction that does the same thing
+  static_assert(decode_thumb(0x1889).instruction == 0xe0911002);  // adds r1, r1, r2 = adds r1, r1, r2
+  static_assert(decode_thumb(0xb502).instruction == 0xe92d4002);  // push {r1, lr} = stmdb sp!, {r1, lr}
+  static_assert(decode_thumb(0x4361).instruction == 0xe0110194);  // muls r1, r4 = muls r1, r4, r1
+  static_assert(decode_thumb(0x56b2).instruction == 0xe19620d2);  // ldrsb r2, [r6, r2]
+
+  // bl leaves bit 0 set in lr, mov pc, lr has to drop it again
+  constexpr std::array return_program{ Instruction{ 0xe3a0dc02 },  // mov sp, #512
+                                       Instruction{ 0xe28f0001 },  // add r0, pc, #1
+                                       Instruction{ 0xe12fff10 },  // bx r0
+                                       Instruction{ 0xf000b500 },  // push {lr}; bl func
+                                       Instruction{ 0x467af802 },  // (bl); mov r2, pc
+                                       Instruction{ 0x2001bd00 },  // pop {pc}; func: movs r0, #1
+                                       Instruction{ 0x46c046f7 }   // mov pc, lr; nop
+  };
+  constexpr auto returned = run_code(0, to_memory(return_program));
+  static_assert(returned.registers[0] == 1);
+  static_assert(returned.registers[2] == 0x16);
+  static_assert(returned.PC() == decltype(returned)::halt_address);
+  check_jit(0, to_memory(return_program));
+
+  // undefined encodings fault even with Z clear
+  constexpr std::array undefined_program{ Instruction{ 0xe28f0001 },  // add r0, pc, #1
+                                          Instruction{ 0xe12fff10 },  // bx r0
+                                          Instruction{ 0xde002001 },  // movs r0, #1; udf #0
+                                          Instruction{ 0x47702002 }   // movs r0, #2; bx lr
+  };
+  constexpr auto undefined = run_code(0, to_memory(undefined_program));
+  static_assert(undefined.fault && undefined.fault->address == 10 && undefined.fault->type == Instruction_Type::Undefined);
+  static_assert(undefined.registers[0] == 1);
+  static_assert(decode_thumb(0xde00).instruction >> 28 == 0b1110);
 }
 
-void test_always_executing_jump()
+void test_cycle_counting()
 {
-  constexpr auto systest2 = run_instruction(Instruction{ 0b1110'1010'0000'0000'0000'0000'0000'1111 });
-  static_assert(systest2.PC() == 68);
-  static_assert(systest2.registers[14] == 0);
+  constexpr std::array<std::uint32_t, 16> registers{ 0, 0xFF, 0xFFFF'FF00, 0x1'0000, 0x8000'0000 };
+
+  static_assert(instruction_cycles(Instruction{ 0xe0811002 }, Instruction_Type::Data_Processing, registers) == 1);       // add r1, r1, r2
+  static_assert(instruction_cycles(Instruction{ 0xe0811312 }, Instruction_Type::Data_Processing, registers) == 2);       // add r1, r1, r2, lsl r3
+  static_assert(instruction_cycles(Instruction{ 0xe1a0f00e }, Instruction_Type::Data_Processing, registers) == 3);       // mov pc, lr
+  static_assert(instruction_cycles(Instruction{ 0xe0000190 }, Instruction_Type::Multiply, registers) == 2);              // mul r0, r0, r1
+  static_assert(instruction_cycles(Instruction{ 0xe0000290 }, Instruction_Type::Multiply, registers) == 2);              // mul r0, r0, r2
+  static_assert(instruction_cycles(Instruction{ 0xe0000390 }, Instruction_Type::Multiply, registers) == 4);              // mul r0, r0, r3
+  static_assert(instruction_cycles(Instruction{ 0xe0000490 }, Instruction_Type::Multiply, registers) == 5);              // mul r0, r0, r4
+  static_assert(instruction_cycles(Instruction{ 0xe5910000 }, Instruction_Type::Single_Data_Transfer, registers) == 3);  // ldr r0, [r1]
+  static_assert(instruction_cycles(Instruction{ 0xe5810000 }, Instruction_Type::Single_Data_Transfer, registers) == 2);  // str r0, [r1]
+  static_assert(instruction_cycles(Instruction{ 0xe8bd8030 }, Instruction_Type::Block_Data_Transfer, registers) == 7);   // pop {r4, r5, pc}
+  static_assert(instruction_cycles(Instruction{ 0xe92d4030 }, Instruction_Type::Block_Data_Transfer, registers) == 4);   // push {r4, r5, lr}
+  static_assert(instruction_cycles(Instruction{ 0xe0c10292 }, Instruction_Type::Multiply_Long, registers) == 3);         // smull r0, r1, r2, r2
+  static_assert(instruction_cycles(Instruction{ 0xe0810292 }, Instruction_Type::Multiply_Long, registers) == 6);         // umull r0, r1, r2, r2
+  static_assert(instruction_cycles(Instruction{ 0xe1020091 }, Instruction_Type::Single_Data_Swap, registers) == 4);      // swp r0, r1, [r2]
+
+  // r0 = sum of 1..10: taken branches cost 3, the one that falls through 1
+  constexpr std::array program{ Instruction{ 0xe3a0000a },  // mov r0, #10
+                                Instruction{ 0xe3a01000 },  // mov r1, #0
+                                Instruction{ 0xe0811000 },  // loop: add r1, r1, r0
+                                Instruction{ 0xe2500001 },  // subs r0, r0, #1
+                                Instruction{ 0x1afffffc },  // bne loop
+                                Instruction{ 0xe1a00001 },  // mov r0, r1
+                                Instruction{ 0xe1a0f00e }   // mov pc, lr
+  };
+  constexpr auto counted = [program] {
+    System<Fixed_Memory<1024>, Cycle_Counter> system{ to_memory(program) };
+    system.run(0);
+    return system.hooks;
+  }();
+  static_assert(counted.instructions == 2 + 3 * 10 + 2);
+  static_assert(counted.cycles == 2 + 2 * 10 + 3 * 9 + 1 + 1 + 3);
+
+  // the profiler counts the same
+  System<Fixed_Memory<1024>, Profiler> profiled{ to_memory(program) };
+  profiled.run(0);
+  require(profiled.hooks.cycles == counted.cycles, "profiler cycle count");
+
+  // a multiply is charged for its Rs before it overwrites it
+  constexpr std::array overwriting{ Instruction{ 0xe3a00801 },  // mov r0, #0x10000
+                                    Instruction{ 0xe3a01000 },  // mov r1, #0
+                                    Instruction{ 0xe0000091 },  // mul r0, r1, r0
+                                    Instruction{ 0xe1a0f00e }   // mov pc, lr
+  };
+  constexpr auto overwritten = [overwriting] {
+    System<Fixed_Memory<1024>, Cycle_Counter> system{ to_memory(overwriting) };
+    system.run(0);
+    return system.hooks;
+  }();
+  static_assert(overwritten.cycles == 1 + 1 + 4 + 3);
 }
 
-void test_always_executing_jump_with_saved_return()
+void test_condition_parsing() { static_assert(Instruction{ 0b1110'1010'0000'0000'0000'0000'0000'1111 }.get_condition() == Condition::AL); }
+
+// Wall time of one call of function, in nanoseconds
+template<typename Function> [[nodiscard]] double time_benchmark(Function function)
 {
-  constexpr auto systest3 = run_instruction(Instruction{ 0b1110'1011'0000'0000'0000'0000'0000'1111 });
-  static_assert(systest3.PC() == 68);
-  static_assert(systest3.registers[14] == 4);
+  const auto start = std::chrono::steady_clock::now();
+  function();
+  return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
 }
 
-void test_add_of_register()
+void print_benchmark(const std::string_view name, const std::uint64_t instructions, const double elapsed)
 {
-  constexpr auto systest4 = run_instruction(Instruction{ 0xe2800055 });  // add r0, r0, #85
-  static_assert(systest4.registers[0] == 0x55);
+  std::cout << name << ": " << instructions << " instructions, " << elapsed / static_cast<double>(instructions)
+            << " ns/instruction, " << static_cast<double>(instructions) / elapsed * 1000.0 << " MIPS\n";
 }
 
-void test_add_of_register_with_shifts()
+template<typename Function> void report_benchmark(const std::string_view name, const std::uint64_t instructions, Function function)
 {
-  constexpr auto systest5 = run_instruction(Instruction{ 0xe2800055 },  // add r0, r0, #85
-                                            Instruction{ 0xe2800c7e }   // add r0, r0, #32256
-  );
-  static_assert(systest5.registers[0] == (85 + 32256));
+  print_benchmark(name, instructions, time_benchmark(function));
 }
 
+void benchmark_arithmetic_loop()
+{
+  // Flag setting arithmetic, only the loop branch and one addne read flags
+  constexpr std::array program{ Instruction{ 0xe3a00601 },  // mov r0, #1048576
+                                Instruction{ 0xe3a01000 },  // mov r1, #0
+                                Instruction{ 0xe3a02001 },  // mov r2, #1
+                                Instruction{ 0xe0911002 },  // loop: adds r1, r1, r2
+                                Instruction{ 0xe0213182 },  // eor r3, r1, r2, lsl #3
+                                Instruction{ 0xe0532001 },  // subs r2, r3, r1
+                                Instruction{ 0xe1944002 },  // orrs r4, r4, r2
+                                Instruction{ 0x12811001 },  // addne r1, r1, #1
+                                Instruction{ 0xe2500001 },  // subs r0, r0, #1
+                                Instruction{ 0x1afffff8 },  // bne loop
+                                Instruction{ 0xe1a0f00e }   // mov pc, lr
+  };
+  constexpr std::uint64_t instructions = 3 + 7 * 1048576 + 1;
 
-void test_multiple_adds_and_sub()
+  System interpreted{ to_memory(program) };
+  report_benchmark("arithmetic loop, interpreted", instructions, [&] { interpreted.run(0); });
+
+  System<Paged_Memory> paged{ to_memory(program) };
+  report_benchmark("arithmetic loop, interpreted, paged memory", instructions, [&] { paged.run(0); });
+
+  UART uart;
+  System<Memory_Bus<>> bus{ to_memory(program) };
+  bus.RAM.attach(0x1000'0000, 8, uart);
+  report_benchmark("arithmetic loop, interpreted, memory bus", instructions, [&] { bus.run(0); });
+
+  // what counting costs, and how long the loop would take on hardware
+  System<Fixed_Memory<1024>, Cycle_Counter> counted{ to_memory(program) };
+  report_benchmark("arithmetic loop, interpreted, counting cycles", instructions, [&] { counted.run(0); });
+  std::cout << "  " << counted.hooks.cycles << " ARM7TDMI cycles, " << counted.hooks.seconds() * 1000.0 << " ms at "
+            << arm7_clock / 1'000'000 << " MHz\n";
+
+#ifdef ARM_JIT_SUPPORTED
+  System jitted{ to_memory(program) };
+  JIT jit{ jitted };
+  report_benchmark("arithmetic loop, JIT", instructions, [&] { jit.run(0); });
+#endif
+}
+
+void benchmark_conditions()
 {
-  constexpr auto systest6 = run_instruction(Instruction{ 0xe2800001 },  // add r0, r0, #1
-                                            Instruction{ 0xe2811009 },  // add r1, r1, #9
-                                            Instruction{ 0xe2822002 },  // add r2, r2, #2
-                                            Instruction{ 0xe0423001 }   // sub r3, r2, r1
-  );
-  static_assert(systest6.registers[3] == static_cast<std::uint32_t>(2 - 9));
+  // every instruction in the loop is conditional
+  constexpr std::array program{ Instruction{ 0xe3a00601 },  // mov r0, #1048576
+                                Instruction{ 0xe3a01000 },  // mov r1, #0
+                                Instruction{ 0xe2500001 },  // loop: subs r0, r0, #1
+                                Instruction{ 0x02811001 },  // addeq r1, r1, #1
+                                Instruction{ 0x12822001 },  // addne r2, r2, #1
+                                Instruction{ 0xc2833001 },  // addgt r3, r3, #1
+                                Instruction{ 0xd2844001 },  // addle r4, r4, #1
+                                Instruction{ 0x82855001 },  // addhi r5, r5, #1
+                                Instruction{ 0x42866001 },  // addmi r6, r6, #1
+                                Instruction{ 0xa2877001 },  // addge r7, r7, #1
+                                Instruction{ 0x1afffff6 },  // bne loop
+                                Instruction{ 0xe1a0f00e }   // mov pc, lr
+  };
+  constexpr std::uint64_t instructions = 2 + 9 * 1048576 + 1;
+
+  System interpreted{ to_memory(program) };
+  report_benchmark("conditional loop, interpreted", instructions, [&] { interpreted.run(0); });
+
+#ifdef ARM_JIT_SUPPORTED
+  System jitted{ to_memory(program) };
+  JIT jit{ jitted };
+  report_benchmark("conditional loop, JIT", instructions, [&] { jit.run(0); });
+#endif
 }
 
-void test_memory_writes()
+void benchmark_thumb()
 {
-  constexpr auto systest6 = run_instruction(Instruction{ 0xe3a00064 },  // mov r0, #100 ; 0x64
-                                            Instruction{ 0xe3a01005 },  // mov r1, #5
-                                            Instruction{ 0xe5c01000 },  // strb r1, [r0]
-                                            Instruction{ 0xe3a00000 },  // mov r0, #0
-                                            Instruction{ 0xe1a0f00e }   // mov pc, lr
-  );
+  // the same memory bound loop in both instruction sets, 10 bytes of Thumb to 20 of ARM
+  constexpr std::array arm{ Instruction{ 0xe3a00601 },  // mov r0, #1048576
+                            Instruction{ 0xe3a01000 },  // mov r1, #0
+                            Instruction{ 0xe3a02c01 },  // mov r2, #256
+                            Instruction{ 0xe5923000 },  // loop: ldr r3, [r2]
+                            Instruction{ 0xe0833000 },  // add r3, r3, r0
+                            Instruction{ 0xe5823000 },  // str r3, [r2]
+                            Instruction{ 0xe2500001 },  // subs r0, r0, #1
+                            Instruction{ 0x1afffffa },  // bne loop
+                            Instruction{ 0xe1a0f00e }   // mov pc, lr
+  };
+  constexpr std::array thumb{ Instruction{ 0xe28f4001 },  // add r4, pc, #1
+                              Instruction{ 0xe12fff14 },  // bx r4
+                              Instruction{ 0x05002001 },  // movs r0, #1; lsls r0, r0, #20
+                              Instruction{ 0x22012100 },  // movs r1, #0; movs r2, #1
+                              Instruction{ 0x68130212 },  // lsls r2, r2, #8; loop: ldr r3, [r2]
+                              Instruction{ 0x6013181b },  // adds r3, r3, r0; str r3, [r2]
+                              Instruction{ 0xd1fa3801 },  // subs r0, #1; bne loop
+                              Instruction{ 0x00004770 }   // bx lr
+  };
+  constexpr std::uint64_t instructions = 5 * 1048576;
 
-  static_assert(systest6.RAM[100] == 5);
+  System arm_system{ to_memory(arm) };
+  report_benchmark("ARM loop, interpreted", instructions, [&] { arm_system.run(0); });
+
+  System thumb_system{ to_memory(thumb) };
+  report_benchmark("Thumb loop, interpreted", instructions, [&] { thumb_system.run(0); });
+
+  require(arm_system.RAM.read_word(256) == thumb_system.RAM.read_word(256), "ARM and Thumb loops agree");
+
+#ifdef ARM_JIT_SUPPORTED
+  // the JIT only translates ARM code and interprets Thumb, so Thumb trails here
+  System arm_jitted{ to_memory(arm) };
+  JIT arm_jit{ arm_jitted };
+  report_benchmark("ARM loop, JIT", instructions, [&] { arm_jit.run(0); });
+
+  System thumb_jitted{ to_memory(thumb) };
+  JIT thumb_jit{ thumb_jitted };
+  report_benchmark("Thumb loop, JIT", instructions, [&] { thumb_jit.run(0); });
+
+  require(arm_jitted.RAM.read_word(256) == thumb_jitted.RAM.read_word(256), "ARM and Thumb loops agree under the JIT");
+#endif
 }
 
-void test_lsr()
+void benchmark_batch()
 {
-  constexpr auto sys = run_instruction(Instruction{ 0xe3a03005 }, // mov r3, #5
-      Instruction{ 0xe1a02123 } // lsr r2, r3, #2
-      );
-  static_assert(sys.registers[2] == 1);
-  static_assert(sys.registers[3] == 5);
+  // independent copies of a register only loop, scaling is limited by cores
+  constexpr std::array program{ Instruction{ 0xe3a00701 },  // mov r0, #262144
+                                Instruction{ 0xe3a01000 },  // mov r1, #0
+                                Instruction{ 0xe0811000 },  // loop: add r1, r1, r0
+                                Instruction{ 0xe2500001 },  // subs r0, r0, #1
+                                Instruction{ 0x1afffffc },  // bne loop
+                                Instruction{ 0xe1a0f00e }   // mov pc, lr
+  };
+
+  System<Paged_Memory> prototype{ to_memory(program) };
+  prototype.start(0);
+
+  std::vector<std::size_t> thread_counts{ 1 };
+  if (Batch_Options{}.threads > 1) {
+    thread_counts.push_back(Batch_Options{}.threads);
+  }
+
+  for (const auto threads : thread_counts) {
+    std::vector<System<Paged_Memory>> systems(64, prototype);
+    const auto report = run_batch(systems, Batch_Options{ threads });
+    std::cout << "batch of " << systems.size() << ", " << threads << " threads: " << report.instructions << " instructions, "
+              << report.instructions_per_second() / 1e6 << " MIPS\n";
+  }
 }
 
-void test_sub_with_shift()
+// The guest kernels make their data with a linear congruential generator,
+// so every run does the same work and the host versions can check r0
+[[nodiscard]] constexpr std::uint32_t next_random(const std::uint32_t x) noexcept { return x * 1664525 + 1013904223; }
+
+// Runs a guest kernel until it returns, interpreted and translated, and
+// checks its result against the host's. The first run warms up the caches
+// (and the JIT's translations) and isn't timed, the median of the rest is
+// reported.
+template<std::size_t Size>
+void benchmark_kernel(const std::string_view name, const std::array<Instruction, Size> &program, const std::uint32_t expected)
 {
-  constexpr auto systest7 = run_instruction(Instruction{ 0xe2800001 },  // add r0, r0, #1
-                                            Instruction{ 0xe2811009 },  // add r1, r1, #9
-                                            Instruction{ 0xe2822002 },  // add r2, r2, #2
-                                            Instruction{ 0xe0403231 }   // sub r3, r0, r1, lsr r2
-                                                                        // logical right shift r1 by the number in bottom byte of r2
-                                                                        // subtract result from r0 and put answer in r3
-  );
+  using Kernel_System = System<Fixed_Memory<0x1'0000>>;
 
-  static_assert(systest7.registers[3] == static_cast<std::uint32_t>(1 - (9 >> 2)));
+  constexpr std::size_t timed_runs = 5;
+
+  const auto measure = [&](const std::string &how, auto execute) {
+    const auto start     = std::make_unique<Kernel_System>(to_memory(program));
+    start->registers[13] = Kernel_System::halt_address;
+    start->start(0);
+    const auto system = std::make_unique<Kernel_System>(*start);
+
+    Run_Result result{};
+    std::vector<double> elapsed;
+    for (std::size_t run = 0; run <= timed_runs; ++run) {
+      *system         = *start;
+      const auto time = time_benchmark([&] { result = execute(*system); });
+      require(result.reason == Stop_Reason::Halted && system->registers[0] == expected, "guest kernel result");
+      if (run > 0) {
+        elapsed.push_back(time);
+      }
+    }
+
+    const auto median = elapsed.begin() + static_cast<std::ptrdiff_t>(elapsed.size() / 2);
+    std::nth_element(elapsed.begin(), median, elapsed.end());
+    print_benchmark(std::string{ name } + how, result.instructions, *median);
+  };
+
+  measure(", interpreted", [](auto &system) { return system.run_for(std::numeric_limits<std::uint64_t>::max()); });
+#ifdef ARM_JIT_SUPPORTED
+  // one JIT for all the runs, they reuse the same system and code
+  measure(", JIT", [jit = std::unique_ptr<JIT<Kernel_System>>{}](auto &system) mutable {
+    if (!jit) {
+      jit = std::make_unique<JIT<Kernel_System>>(system);
+    }
+    return jit->run_for(std::numeric_limits<std::uint64_t>::max());
+  });
+#endif
 }
 
-void test_looping()
+void benchmark_checksum()
 {
-  /*
-  #include <cstdint>
+  // a running sum and sum of sums over 16KiB of bytes, 16 times
+  constexpr std::array program{ Instruction{ 0xe59f805c },  // ldr r8, =1664525
+                                Instruction{ 0xe59f905c },  // ldr r9, =1013904223
+                                Instruction{ 0xe3a04901 },  // mov r4, #0x4000
+                                Instruction{ 0xe2842901 },  // add r2, r4, #0x4000
+                                Instruction{ 0xe3a00001 },  // mov r0, #1
+                                Instruction{ 0xe1a01004 },  // mov r1, r4
+                                Instruction{ 0xe0239890 },  // fill: mla r3, r0, r8, r9
+                                Instruction{ 0xe1a00003 },  // mov r0, r3
+                                Instruction{ 0xe1a03c20 },  // mov r3, r0, lsr #24
+                                Instruction{ 0xe4c13001 },  // strb r3, [r1], #1
+                                Instruction{ 0xe1510002 },  // cmp r1, r2
+                                Instruction{ 0x1afffff9 },  // bne fill
+                                Instruction{ 0xe3a0a010 },  // mov r10, #16
+                                Instruction{ 0xe3a06001 },  // mov r6, #1
+                                Instruction{ 0xe3a07000 },  // mov r7, #0
+                                Instruction{ 0xe1a01004 },  // pass: mov r1, r4
+                                Instruction{ 0xe4d13001 },  // sum: ldrb r3, [r1], #1
+                                Instruction{ 0xe0866003 },  // add r6, r6, r3
+                                Instruction{ 0xe0877006 },  // add r7, r7, r6
+                                Instruction{ 0xe1510002 },  // cmp r1, r2
+                                Instruction{ 0x1afffffa },  // bne sum
+                                Instruction{ 0xe25aa001 },  // subs r10, r10, #1
+                                Instruction{ 0x1afffff7 },  // bne pass
+                                Instruction{ 0xe0270806 },  // eor r0, r7, r6, lsl #16
+                                Instruction{ 0xe1a0f00e },  // mov pc, lr
+                                Instruction{ 0x0019660d },  // .word 0x0019660d
+                                Instruction{ 0x3c6ef35f }   // .word 0x3c6ef35f
+  };
 
-  template<typename T>
-    volatile T& get_loc(const std::uint32_t loc)
-    {
-      return *reinterpret_cast<T*>(loc);
+  std::vector<std::uint8_t> data(0x4000);
+  std::uint32_t x = 1;
+  for (auto &byte : data) {
+    x    = next_random(x);
+    byte = static_cast<std::uint8_t>(x >> 24);
+  }
+
+  std::uint32_t sum         = 1;
+  std::uint32_t sum_of_sums = 0;
+  for (int pass = 0; pass < 16; ++pass) {
+    for (const auto byte : data) {
+      sum += byte;
+      sum_of_sums += sum;
     }
+  }
 
-  int main()
-  {
-    for (int i = 0; i < 100; ++i) {
-      get_loc<std::int8_t>(100+i) = i%5;
+  benchmark_kernel("checksum kernel", program, sum_of_sums ^ (sum << 16));
+}
+
+void benchmark_sort()
+{
+  // insertion sort of 512 words, 4 times, hashing each sorted array
+  constexpr std::array program{ Instruction{ 0xe59f80a0 },  // ldr r8, =1664525
+                                Instruction{ 0xe59f90a0 },  // ldr r9, =1013904223
+                                Instruction{ 0xe3a04a01 },  // mov r4, #0x1000
+                                Instruction{ 0xe3a05c02 },  // mov r5, #512
+                                Instruction{ 0xe3a00007 },  // mov r0, #7
+                                Instruction{ 0xe3a0a004 },  // mov r10, #4
+                                Instruction{ 0xe3a0b000 },  // mov r11, #0
+                                Instruction{ 0xe3a01000 },  // again: mov r1, #0
+                                Instruction{ 0xe0239890 },  // fill: mla r3, r0, r8, r9
+                                Instruction{ 0xe1a00003 },  // mov r0, r3
+                                Instruction{ 0xe1a030a0 },  // mov r3, r0, lsr #1
+                                Instruction{ 0xe7843101 },  // str r3, [r4, r1, lsl #2]
+                                Instruction{ 0xe2811001 },  // add r1, r1, #1
+                                Instruction{ 0xe1510005 },  // cmp r1, r5
+                                Instruction{ 0x1afffff8 },  // bne fill
+                                Instruction{ 0xe3a01001 },  // mov r1, #1
+                                Instruction{ 0xe7942101 },  // outer: ldr r2, [r4, r1, lsl #2]
+                                Instruction{ 0xe2413001 },  // sub r3, r1, #1
+                                Instruction{ 0xe794c103 },  // inner: ldr r12, [r4, r3, lsl #2]
+                                Instruction{ 0xe152000c },  // cmp r2, r12
+                                Instruction{ 0x5a000003 },  // bpl place
+                                Instruction{ 0xe2836001 },  // add r6, r3, #1
+                                Instruction{ 0xe784c106 },  // str r12, [r4, r6, lsl #2]
+                                Instruction{ 0xe2533001 },  // subs r3, r3, #1
+                                Instruction{ 0x5afffff8 },  // bpl inner
+                                Instruction{ 0xe2833001 },  // place: add r3, r3, #1
+                                Instruction{ 0xe7842103 },  // str r2, [r4, r3, lsl #2]
+                                Instruction{ 0xe2811001 },  // add r1, r1, #1
+                                Instruction{ 0xe1510005 },  // cmp r1, r5
+                                Instruction{ 0x1afffff1 },  // bne outer
+                                Instruction{ 0xe3a01000 },  // mov r1, #0
+                                Instruction{ 0xe3a0601f },  // mov r6, #31
+                                Instruction{ 0xe7943101 },  // weigh: ldr r3, [r4, r1, lsl #2]
+                                Instruction{ 0xe02c369b },  // mla r12, r11, r6, r3
+                                Instruction{ 0xe1a0b00c },  // mov r11, r12
+                                Instruction{ 0xe2811001 },  // add r1, r1, #1
+                                Instruction{ 0xe1510005 },  // cmp r1, r5
+                                Instruction{ 0x1afffff9 },  // bne weigh
+                                Instruction{ 0xe25aa001 },  // subs r10, r10, #1
+                                Instruction{ 0x1affffde },  // bne again
+                                Instruction{ 0xe1a0000b },  // mov r0, r11
+                                Instruction{ 0xe1a0f00e },  // mov pc, lr
+                                Instruction{ 0x0019660d },  // .word 0x0019660d
+                                Instruction{ 0x3c6ef35f }   // .word 0x3c6ef35f
+  };
+
+  std::vector<std::uint32_t> data(512);
+  std::uint32_t x    = 7;
+  std::uint32_t hash = 0;
+  for (int round = 0; round < 4; ++round) {
+    for (auto &value : data) {
+      x     = next_random(x);
+      value = x >> 1;
+    }
+    std::sort(data.begin(), data.end());
+    for (const auto value : data) {
+      hash = hash * 31 + value;
     }
   }
-  */
 
-  // compiles to:
+  benchmark_kernel("sort kernel", program, hash);
+}
 
-  /*
-  00000000 <main>:
-   0:	e59f102c 	ldr	r1, [pc, #44]	; 34 <main+0x34>
-   4:	e3a00000 	mov	r0, #0
-   8:	e0832190 	umull	r2, r3, r0, r1
-   c:	e1a02123 	lsr	r2, r3, #2
-  10:	e0822102 	add	r2, r2, r2, lsl #2
-  14:	e2622000 	rsb	r2, r2, #0
-  18:	e0802002 	add	r2, r0, r2
-  1c:	e5c02064 	strb	r2, [r0, #100]	; 0x64
-  20:	e2800001 	add	r0, r0, #1
-  24:	e3500064 	cmp	r0, #100	; 0x64
-  28:	1afffff6 	bne	8 <main+0x8>
-  2c:	e3a00000 	mov	r0, #0
-  30:	e1a0f00e 	mov	pc, lr
-  34:	cccccccd 	.word	0xcccccccd
-  */
+void benchmark_matrix_multiply()
+{
+  // C = A * B for 24x24 word matrices, 16 times, hashing C
+  constexpr std::array program{ Instruction{ 0xe92d4ff0 },  // push {r4-r11, lr}
+                                Instruction{ 0xe59f80c8 },  // ldr r8, =1664525
+                                Instruction{ 0xe59f90c8 },  // ldr r9, =1013904223
+                                Instruction{ 0xe3a04a01 },  // mov r4, #0x1000
+                                Instruction{ 0xe2845a01 },  // add r5, r4, #0x1000
+                                Instruction{ 0xe2856a01 },  // add r6, r5, #0x1000
+                                Instruction{ 0xe3a07018 },  // mov r7, #24
+                                Instruction{ 0xe3a00003 },  // mov r0, #3
+                                Instruction{ 0xe1a01004 },  // mov r1, r4
+                                Instruction{ 0xe2842a02 },  // add r2, r4, #0x2000
+                                Instruction{ 0xe0239890 },  // fill: mla r3, r0, r8, r9
+                                Instruction{ 0xe1a00003 },  // mov r0, r3
+                                Instruction{ 0xe1a03c20 },  // mov r3, r0, lsr #24
+                                Instruction{ 0xe4813004 },  // str r3, [r1], #4
+                                Instruction{ 0xe1510002 },  // cmp r1, r2
+                                Instruction{ 0x1afffff9 },  // bne fill
+                                Instruction{ 0xe3a0c010 },  // mov r12, #16
+                                Instruction{ 0xe52dc004 },  // str r12, [sp, #-4]!
+                                Instruction{ 0xe3a08000 },  // again: mov r8, #0
+                                Instruction{ 0xe3a09000 },  // i_loop: mov r9, #0
+                                Instruction{ 0xe3a0a000 },  // j_loop: mov r10, #0
+                                Instruction{ 0xe3a0b000 },  // mov r11, #0
+                                Instruction{ 0xe0000798 },  // mul r0, r8, r7
+                                Instruction{ 0xe0841100 },  // add r1, r4, r0, lsl #2
+                                Instruction{ 0xe0852109 },  // add r2, r5, r9, lsl #2
+                                Instruction{ 0xe4913004 },  // k_loop: ldr r3, [r1], #4
+                                Instruction{ 0xe692c107 },  // ldr r12, [r2], r7, lsl #2
+                                Instruction{ 0xe02bbc93 },  // mla r11, r3, r12, r11
+                                Instruction{ 0xe28aa001 },  // add r10, r10, #1
+                                Instruction{ 0xe15a0007 },  // cmp r10, r7
+                                Instruction{ 0x1afffff9 },  // bne k_loop
+                                Instruction{ 0xe0800009 },  // add r0, r0, r9
+                                Instruction{ 0xe786b100 },  // str r11, [r6, r0, lsl #2]
+                                Instruction{ 0xe2899001 },  // add r9, r9, #1
+                                Instruction{ 0xe1590007 },  // cmp r9, r7
+                                Instruction{ 0x1affffef },  // bne j_loop
+                                Instruction{ 0xe2888001 },  // add r8, r8, #1
+                                Instruction{ 0xe1580007 },  // cmp r8, r7
+                                Instruction{ 0x1affffeb },  // bne i_loop
+                                Instruction{ 0xe59dc000 },  // ldr r12, [sp]
+                                Instruction{ 0xe25cc001 },  // subs r12, r12, #1
+                                Instruction{ 0xe58dc000 },  // str r12, [sp]
+                                Instruction{ 0x1affffe6 },  // bne again
+                                Instruction{ 0xe28dd004 },  // add sp, sp, #4
+                                Instruction{ 0xe3a00000 },  // mov r0, #0
+                                Instruction{ 0xe1a01006 },  // mov r1, r6
+                                Instruction{ 0xe2862c09 },  // add r2, r6, #0x900
+                                Instruction{ 0xe4913004 },  // weigh: ldr r3, [r1], #4
+                                Instruction{ 0xe0800280 },  // add r0, r0, r0, lsl #5
+                                Instruction{ 0xe0800003 },  // add r0, r0, r3
+                                Instruction{ 0xe1510002 },  // cmp r1, r2
+                                Instruction{ 0x1afffffa },  // bne weigh
+                                Instruction{ 0xe8bd8ff0 },  // pop {r4-r11, pc}
+                                Instruction{ 0x0019660d },  // .word 0x0019660d
+                                Instruction{ 0x3c6ef35f }   // .word 0x3c6ef35f
+  };
 
-  constexpr auto system = run_code(0,
-    0x2c, 0x10, 0x9f, 0xe5, 0x00, 0x00, 0xa0, 0xe3, 0x90, 0x21, 0x83, 0xe0, 0x23, 0x21, 0xa0, 0xe1, 0x02, 0x21, 0x82, 0xe0, 0x00, 0x20, 0x62, 0xe2, 0x02, 0x20, 0x80, 0xe0, 0x64, 0x20, 0xc0, 0xe5, 0x01, 0x00, 0x80, 0xe2, 0x64, 0x00, 0x50, 0xe3, 0xf6, 0xff, 0xff, 0x1a, 0x00, 0x00, 0xa0, 0xe3, 0x0e, 0xf0, 0xa0, 0xe1, 0xcd, 0xcc, 0xcc, 0xcc);
+  constexpr std::size_t n = 24;
+  std::vector<std::uint32_t> data(2048);
+  std::uint32_t x = 3;
+  for (auto &value : data) {
+    x     = next_random(x);
+    value = x >> 24;
+  }
 
-//  std::cout << std::hex << static_cast<unsigned int>(system.RAM[0x34]) << '\n';
+  // B starts 4KiB after A
+  const auto *a = data.data();
+  const auto *b = data.data() + 1024;
 
-//  std::cout << static_cast<int>(system.RAM[100]) << '\n';
-  static_assert(system.RAM[100] == 0);
-  static_assert(system.RAM[104] == 4);
-  static_assert(system.RAM[105] == 0);
-  static_assert(system.RAM[106] == 1);
+  std::uint32_t hash = 0;
+  for (std::size_t i = 0; i < n; ++i) {
+    for (std::size_t j = 0; j < n; ++j) {
+      std::uint32_t sum = 0;
+      for (std::size_t k = 0; k < n; ++k) {
+        sum += a[i * n + k] * b[k * n + j];
+      }
+      hash = hash * 33 + sum;
+    }
+  }
+
+  benchmark_kernel("matrix multiply kernel", program, hash);
 }
 
+void benchmark_string_search()
+{
+  // naive search for every (overlapping) "abca" in 8KiB of a-d, 16 times
+  constexpr std::array program{ Instruction{ 0xe92d4ff0 },  // push {r4-r11, lr}
+                                Instruction{ 0xe59f8090 },  // ldr r8, =1664525
+                                Instruction{ 0xe59f9090 },  // ldr r9, =1013904223
+                                Instruction{ 0xe3a04a01 },  // mov r4, #0x1000
+                                Instruction{ 0xe2845a02 },  // add r5, r4, #0x2000
+                                Instruction{ 0xe3a00005 },  // mov r0, #5
+                                Instruction{ 0xe1a01004 },  // mov r1, r4
+                                Instruction{ 0xe0239890 },  // fill: mla r3, r0, r8, r9
+                                Instruction{ 0xe1a00003 },  // mov r0, r3
+                                Instruction{ 0xe1a03f20 },  // mov r3, r0, lsr #30
+                                Instruction{ 0xe2833061 },  // add r3, r3, #97
+                                Instruction{ 0xe4c13001 },  // strb r3, [r1], #1
+                                Instruction{ 0xe1510005 },  // cmp r1, r5
+                                Instruction{ 0x1afffff8 },  // bne fill
+                                Instruction{ 0xe28f6058 },  // adr r6, pattern
+                                Instruction{ 0xe3a07004 },  // mov r7, #4
+                                Instruction{ 0xe0458004 },  // sub r8, r5, r4
+                                Instruction{ 0xe0488007 },  // sub r8, r8, r7
+                                Instruction{ 0xe2888001 },  // add r8, r8, #1
+                                Instruction{ 0xe3a00000 },  // mov r0, #0
+                                Instruction{ 0xe3a0a010 },  // mov r10, #16
+                                Instruction{ 0xe3a01000 },  // pass: mov r1, #0
+                                Instruction{ 0xe3a02000 },  // outer: mov r2, #0
+                                Instruction{ 0xe0813002 },  // inner: add r3, r1, r2
+                                Instruction{ 0xe7d43003 },  // ldrb r3, [r4, r3]
+                                Instruction{ 0xe7d6c002 },  // ldrb r12, [r6, r2]
+                                Instruction{ 0xe153000c },  // cmp r3, r12
+                                Instruction{ 0x1a000003 },  // bne next
+                                Instruction{ 0xe2822001 },  // add r2, r2, #1
+                                Instruction{ 0xe1520007 },  // cmp r2, r7
+                                Instruction{ 0x1afffff7 },  // bne inner
+                                Instruction{ 0xe2800001 },  // add r0, r0, #1
+                                Instruction{ 0xe2811001 },  // next: add r1, r1, #1
+                                Instruction{ 0xe1510008 },  // cmp r1, r8
+                                Instruction{ 0x1afffff2 },  // bne outer
+                                Instruction{ 0xe25aa001 },  // subs r10, r10, #1
+                                Instruction{ 0x1affffef },  // bne pass
+                                Instruction{ 0xe8bd8ff0 },  // pop {r4-r11, pc}
+                                Instruction{ 0x61636261 },  // pattern: "abca"
+                                Instruction{ 0x0019660d },  // .word 0x0019660d
+                                Instruction{ 0x3c6ef35f }   // .word 0x3c6ef35f
+  };
 
-void test_condition_parsing() { static_assert(Instruction{ 0b1110'1010'0000'0000'0000'0000'0000'1111 }.get_condition() == Condition::AL); }
+  std::string text(0x2000, ' ');
+  std::uint32_t x = 5;
+  for (auto &c : text) {
+    x = next_random(x);
+    c = static_cast<char>('a' + (x >> 30));
+  }
+
+  std::uint32_t matches = 0;
+  for (auto found = text.find("abca"); found != std::string::npos; found = text.find("abca", found + 1)) {
+    ++matches;
+  }
+
+  benchmark_kernel("string search kernel", program, matches * 16);
+}
+
+void benchmark_looping()
+{
+  // test_looping, storing i%5 for 4096 bytes instead of 100, 64 times
+  constexpr std::array program{ Instruction{ 0xe59f103c },  // ldr r1, =0xcccccccd
+                                Instruction{ 0xe3a04a01 },  // mov r4, #0x1000
+                                Instruction{ 0xe3a05040 },  // mov r5, #64
+                                Instruction{ 0xe3a00000 },  // pass: mov r0, #0
+                                Instruction{ 0xe0832190 },  // loop: umull r2, r3, r0, r1
+                                Instruction{ 0xe1a02123 },  // lsr r2, r3, #2
+                                Instruction{ 0xe0822102 },  // add r2, r2, r2, lsl #2
+                                Instruction{ 0xe2622000 },  // rsb r2, r2, #0
+                                Instruction{ 0xe0802002 },  // add r2, r0, r2
+                                Instruction{ 0xe7c42000 },  // strb r2, [r4, r0]
+                                Instruction{ 0xe2800001 },  // add r0, r0, #1
+                                Instruction{ 0xe3500a01 },  // cmp r0, #4096
+                                Instruction{ 0x1afffff6 },  // bne loop
+                                Instruction{ 0xe2555001 },  // subs r5, r5, #1
+                                Instruction{ 0x1afffff3 },  // bne pass
+                                Instruction{ 0xe5940ffc },  // ldr r0, [r4, #4092]
+                                Instruction{ 0xe1a0f00e },  // mov pc, lr
+                                Instruction{ 0xcccccccd }   // .word 0xcccccccd
+  };
+
+  std::uint32_t last_word = 0;
+  for (std::uint32_t i = 4092; i < 4096; ++i) {
+    last_word |= (i % 5) << ((i - 4092) * 8);
+  }
+
+  benchmark_kernel("looping kernel", program, last_word);
+}
+
+void benchmark_kernels()
+{
+  benchmark_checksum();
+  benchmark_sort();
+  benchmark_matrix_multiply();
+  benchmark_string_search();
+  benchmark_looping();
+}
+
+#ifdef ARM_CONSTEXPR_BENCHMARK
+// r1 = sum of 1..33333, 100002 instructions run entirely by the compiler, in
+// slices of 1,000 so that each one should also fit Clang's default step
+// limit (only checked with GCC, see compile_time_run).
+// make_constexpr_benchmark.sh reports how long the compile takes.
+constexpr std::uint32_t compile_time_iterations   = 33'333;
+constexpr std::uint64_t compile_time_instructions = 2 + 3 * std::uint64_t{ compile_time_iterations } + 1;
+constexpr std::uint64_t compile_time_slice_length = 1'000;
+
+constexpr auto compile_time_start = [] {
+  constexpr std::array program{ Instruction{ 0xe59f0010 },              // ldr r0, iterations
+                                Instruction{ 0xe3a01000 },              // mov r1, #0
+                                Instruction{ 0xe0811000 },              // loop: add r1, r1, r0
+                                Instruction{ 0xe2500001 },              // subs r0, r0, #1
+                                Instruction{ 0x1afffffc },              // bne loop
+                                Instruction{ 0xe1a0f00e },              // mov pc, lr
+                                Instruction{ compile_time_iterations }  // iterations: .word 33333
+  };
+  System system{ to_memory(program) };
+  system.start(0);
+  return system;
+}();
+
+void benchmark_compile_time()
+{
+  constexpr auto &finished =
+    compile_time_run<compile_time_start, compile_time_slice_length, compile_time_instructions / compile_time_slice_length>;
+  static_assert(finished.halted());
+  static_assert(finished.registers[1] == compile_time_iterations * (compile_time_iterations + 1) / 2);
+
+  std::cout << "compile time run: " << compile_time_instructions << " instructions, r1 = " << finished.registers[1] << '\n';
+}
+#endif
+
+#ifdef __unix__
+// Loads an ARM executable and runs it with the profiler attached, then
+// prints the profile
+int profile_program(const std::string &path)
+{
+  constexpr std::uint32_t stack_top = 0xFFFF'0000;
+
+  Semihosting host;
+  auto system           = std::make_unique<System<Paged_Memory, Profiler>>();
+  const auto entry      = load_elf(system->RAM, path);
+  system->registers[13] = stack_top;
+  system->host          = &host;
+  system->run(entry);
+  host.flush();
+
+  system->hooks.report(std::cout);
+  return static_cast<int>(system->registers[0] & 0xFF);
+}
+
+// Loads an ARM executable and runs it while recording a trace, then prints
+// how large the trace is and replays the final state as a check
+int trace_program(const std::string &path)
+{
+  constexpr std::uint32_t stack_top = 0xFFFF'0000;
+
+  auto system           = std::make_unique<System<Paged_Memory, Trace_Recorder>>();
+  const auto entry      = load_elf(system->RAM, path);
+  system->registers[13] = stack_top;
+  auto replayed         = std::make_unique<System<Paged_Memory>>();
+  (void)load_elf(replayed->RAM, path);
+
+  system->run(entry);
+
+  const auto &trace = system->hooks;
+  trace.replay(*replayed, trace.instructions());
+  require(replayed->registers == system->registers, "replayed state differs from the traced run");
+
+  std::cout << path << ": " << trace.instructions() << " instructions, " << trace.size() << " bytes of trace, "
+            << static_cast<double>(trace.size()) / static_cast<double>(trace.instructions()) << " bytes/instruction\n";
+  return static_cast<int>(system->registers[0] & 0xFF);
+}
+
+// Loads an ARM executable and runs it to completion with the semihosting
+// calls connected to stdin / stdout. The guest's r0 (or its exit status) is
+// the exit code.
+int run_program(const std::string &path, [[maybe_unused]] const bool use_jit)
+{
+  // the stack grows down from below the reserved return-to-host address
+  constexpr std::uint32_t stack_top = 0xFFFF'0000;
+
+  Semihosting host;
+  auto system       = std::make_unique<System<Paged_Memory>>();
+  const auto entry  = load_elf(system->RAM, path);
+  system->registers[13] = stack_top;
+  system->host          = &host;
+  system->library       = library_entries(load_symbols(path));
+
+  const auto start = std::chrono::steady_clock::now();
+#ifdef ARM_JIT_SUPPORTED
+  if (use_jit) {
+    JIT{ *system }.run(entry);
+  } else {
+    system->run(entry);
+  }
+#else
+  system->run(entry);
+#endif
+  const auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  host.flush();
 
-int main(int argc, const char *[])
+  std::cout << path << ": r0 = " << system->registers[0] << ", " << elapsed << " ms\n";
+  return static_cast<int>(system->registers[0] & 0xFF);
+}
+#endif
+
+int main(int argc, const char *argv[])
 {
 //  System s;
 //  s.process(Instruction{ static_cast<std::uint32_t>(argc) });
 
+  // arm bench kernels
+  if (argc > 2 && std::string_view{ argv[1] } == "bench" && std::string_view{ argv[2] } == "kernels") {
+    benchmark_kernels();
+    return 0;
+  }
+
+  if (argc > 1 && std::string_view{ argv[1] } == "bench") {
+    benchmark_arithmetic_loop();
+    benchmark_conditions();
+    benchmark_thumb();
+    benchmark_batch();
+    benchmark_kernels();
+#ifdef ARM_CONSTEXPR_BENCHMARK
+    benchmark_compile_time();
+#endif
+    return 0;
+  }
+
+#ifdef __unix__
+  // arm run program.elf [jit]
+  if (argc > 2 && std::string_view{ argv[1] } == "run") {
+    return run_program(argv[2], argc > 3 && std::string_view{ argv[3] } == "jit");
+  }
+
+  // arm profile program.elf
+  if (argc > 2 && std::string_view{ argv[1] } == "profile") {
+    return profile_program(argv[2]);
+  }
+
+  // arm trace program.elf
+  if (argc > 2 && std::string_view{ argv[1] } == "trace") {
+    return trace_program(argv[2]);
+  }
+#endif
+
+  test_never_executing_jump();
+  test_always_executing_jump();
+  test_always_executing_jump_with_saved_return();
+  test_add_of_register();
+  test_add_of_register_with_shifts();
+  test_multiple_adds_and_sub();
+  test_memory_writes();
+  test_scaled_register_offset();
+  test_lsr();
+  test_shift_by_register();
+  test_multiply_long();
+  test_sub_with_shift();
+  test_flags_survive_partial_update();
+  test_multiply();
+  test_block_data_transfer();
+  test_function_call_with_push_and_pop();
   test_looping();
+  test_paged_memory();
+  test_memory_mapped_uart();
+  test_semihosting();
+  test_loop_idioms();
+  test_profiler();
+  test_snapshot_and_fork();
+  test_batch_runner();
+  test_run_for();
+  test_compile_time_run();
+  test_trace_replay();
+  test_condition_table();
+  test_arithmetic_flags();
+  test_decode_table();
+  test_thumb();
+  test_cycle_counting();
+#ifdef __unix__
+  test_elf_loader();
+  test_library_calls();
+#endif
 }
 
@@ -0,0 +1,3 @@
+# How long the compiler takes to run a 100k instruction guest program, compare with the plain build
+time g++ arm.cpp -std=c++2a -Wall -Wextra -fsyntax-only
+time g++ arm.cpp -std=c++2a -Wall -Wextra -fsyntax-only -DARM_CONSTEXPR_BENCHMARK
@@ -0,0 +1,2 @@
+# Batch rendering only (mandelbrot render ...), without SFML
+g++ mandelbrot.cpp -std=c++2a -Wall -Wextra -DMANDELBROT_HEADLESS -pthread -O3 -ltbb -o mandelbrot_headless
@@ -1,5 +1,8 @@
+// MANDELBROT_HEADLESS builds without SFML, for batch rendering only
+#ifndef MANDELBROT_HEADLESS
 #include <SFML/Graphics.hpp>
 #include <SFML/Window.hpp>
+#endif
 #include <cmath>
 #include <iostream>
 #include <thread>
@@ -7,6 +10,24 @@
 #include <complex>
 #include <cassert>
 #include <execution>
+#include <array>
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <span>
+#include <string_view>
+#include <cstdint>
+#include <vector>
+#include <optional>
+#include <tuple>
+#include <type_traits>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <cstdlib>
+#include <charconv>
+#include <random>
 
 constexpr std::size_t max_max_iterations      = 2000;
 constexpr std::size_t max_iteration_increment = 200;
@@ -17,6 +38,7 @@ template<typename T> struct Point
   T x{};
   T y{};
   bool operator!=(const Point &p) { return p.x != x || p.y != y; }
+  bool operator==(const Point &) const = default;
 };
 
 template<typename T> Point(T x, T y) -> Point<T>;
@@ -24,13 +46,84 @@ template<typename T> Point(T x, T y) -> Point<T>;
 struct Settings
 {
   Point<double> center{ 0.001643721971153, -0.822467633298876 };
+  // the rest of the center beyond double precision, for deep zooms (see
+  // DoubleDouble), the view is centered on center + center_low
+  Point<double> center_low{};
   double scale                   = 3.0;
   double power                   = 2.0;
   double do_abs                  = false;
   std::size_t cur_max_iterations = start_max_iterations;
   bool canceling                 = false;
+
+  bool operator==(const Settings &) const = default;
 };
 
+// An unevaluated sum of two doubles, about 106 bits of mantissa
+struct DoubleDouble
+{
+  double hi{};
+  double lo{};
+
+  [[nodiscard]] static constexpr DoubleDouble quick_two_sum(const double a, const double b) noexcept
+  {
+    const auto sum = a + b;
+    return { sum, b - (sum - a) };
+  }
+
+  [[nodiscard]] static constexpr DoubleDouble two_sum(const double a, const double b) noexcept
+  {
+    const auto sum = a + b;
+    const auto b_part = sum - a;
+    return { sum, (a - (sum - b_part)) + (b - b_part) };
+  }
+
+  [[nodiscard]] static DoubleDouble two_product(const double a, const double b) noexcept
+  {
+    const auto product = a * b;
+    return { product, std::fma(a, b, -product) };
+  }
+
+  [[nodiscard]] friend constexpr DoubleDouble operator+(const DoubleDouble a, const DoubleDouble b) noexcept
+  {
+    auto sum         = two_sum(a.hi, b.hi);
+    const auto small = two_sum(a.lo, b.lo);
+    sum.lo += small.hi;
+    sum = quick_two_sum(sum.hi, sum.lo);
+    sum.lo += small.lo;
+    return quick_two_sum(sum.hi, sum.lo);
+  }
+
+  [[nodiscard]] friend constexpr DoubleDouble operator-(const DoubleDouble a, const DoubleDouble b) noexcept { return a + DoubleDouble{ -b.hi, -b.lo }; }
+
+  [[nodiscard]] friend DoubleDouble operator*(const DoubleDouble a, const DoubleDouble b) noexcept
+  {
+    auto product = two_product(a.hi, b.hi);
+    product.lo += a.hi * b.lo + a.lo * b.hi;
+    return quick_two_sum(product.hi, product.lo);
+  }
+
+  [[nodiscard]] friend DoubleDouble operator/(const DoubleDouble a, const DoubleDouble b) noexcept
+  {
+    // long division, one double of quotient at a time
+    const auto first     = a.hi / b.hi;
+    const auto remainder = a - b * DoubleDouble{ first };
+    const auto second    = remainder.hi / b.hi;
+    const auto third     = (remainder - b * DoubleDouble{ second }).hi / b.hi;
+    return quick_two_sum(first, second) + DoubleDouble{ third };
+  }
+
+  [[nodiscard]] constexpr double to_double() const noexcept { return hi + lo; }
+};
+
+// A move smaller than the center's precision still accumulates in center_low
+constexpr void move_center(Settings &settings, const double x, const double y) noexcept
+{
+  const auto new_x    = DoubleDouble{ settings.center.x, settings.center_low.x } + DoubleDouble{ x };
+  const auto new_y    = DoubleDouble{ settings.center.y, settings.center_low.y } + DoubleDouble{ y };
+  settings.center     = Point{ new_x.hi, new_y.hi };
+  settings.center_low = Point{ new_x.lo, new_y.lo };
+}
+
 struct Size
 {
   unsigned int width{};
@@ -113,18 +206,26 @@ template<typename ComplexType, typename PowerType> constexpr auto opt_pow(const
   }
 }
 
+// Where a point ended up: the iteration it stopped at (a few past the
+// escape, for the smoothing) and its value there
+template<typename T> struct Escape
+{
+  std::size_t iteration{};
+  std::complex<T> current{};
+};
+
 template<typename PointType, typename CenterType, typename ScaleType>
-constexpr auto get_color(const Point<PointType> t_point,
-                         const Point<CenterType> t_center,
-                         const Size t_size,
-                         const ScaleType t_scale,
-                         std::size_t max_iteration,
-                         const CenterType power,
-                         const bool do_abs) noexcept
+constexpr auto get_scaled(const Point<PointType> t_point, const Point<CenterType> t_center, const Size t_size, const ScaleType t_scale) noexcept
 {
-  const std::complex scaled{ t_point.x / (t_size.width / t_scale) + (t_center.x - (t_scale / static_cast<CenterType>(2.0))),
-                             t_point.y / (t_size.height / t_scale) + (t_center.y - (t_scale / static_cast<CenterType>(2.0))) };
+  // scale is the view's width, pixels are square so the height follows the aspect ratio
+  const auto aspect = static_cast<ScaleType>(t_size.height) / static_cast<ScaleType>(t_size.width);
+  return std::complex{ t_point.x / (t_size.width / t_scale) + (t_center.x - (t_scale / static_cast<CenterType>(2.0))),
+                       t_point.y / (t_size.width / t_scale) + (t_center.y - (t_scale / static_cast<CenterType>(2.0)) * aspect) };
+}
 
+template<typename ComplexType, typename PowerType>
+constexpr auto escape(const std::complex<ComplexType> scaled, std::size_t max_iteration, const PowerType power, const bool do_abs) noexcept
+{
   auto current = scaled;
 
   auto iteration      = 0u;
@@ -141,6 +242,15 @@ constexpr auto get_color(const Point<PointType> t_point,
     ++iteration;
   }
 
+  return Escape<ComplexType>{ iteration, current };
+}
+
+template<typename ComplexType, typename PowerType>
+constexpr auto get_color(const Escape<ComplexType> &t_escape, std::size_t max_iteration, const PowerType power) noexcept
+{
+  const auto iteration = t_escape.iteration;
+  const auto current   = t_escape.current;
+
   if (iteration == max_iteration) {
     return Color{ 0.0, 0.0, 0.0 };
   } else {
@@ -165,69 +275,915 @@ constexpr auto get_color(const Point<PointType> t_point,
   }
 }
 
-template<typename PointType, typename ColorType> void set_pixel(sf::Image &img, const Point<PointType> &t_point, const Color<ColorType> &t_color)
+template<typename PointType, typename CenterType, typename ScaleType>
+constexpr auto get_color(const Point<PointType> t_point,
+                         const Point<CenterType> t_center,
+                         const Size t_size,
+                         const ScaleType t_scale,
+                         std::size_t max_iteration,
+                         const CenterType power,
+                         const bool do_abs) noexcept
+{
+  return get_color(escape(get_scaled(t_point, t_center, t_size, t_scale), max_iteration, power, do_abs), max_iteration, power);
+}
+
+// Vectorized escape: several points iterate in lockstep, each lane stops
+// updating once it passes its own stop iteration and the loop ends when
+// every lane has. Only powers 2 and 3 have a fast path, the arithmetic
+// matches opt_pow operation for operation so the results are identical
+// to the scalar escape.
+enum struct Kernel { Scalar, SSE2, AVX2 };
+
+template<std::size_t Lanes> struct LaneVectors;
+
+template<> struct LaneVectors<2>
+{
+  using Doubles  = double __attribute__((vector_size(16)));
+  using Integers = std::int64_t __attribute__((vector_size(16)));
+};
+
+template<> struct LaneVectors<4>
 {
-  const auto to_sf_color = [](const auto &color) {
-    const auto to_8bit = [](const auto &f) { return static_cast<std::uint8_t>(std::floor(f * 255)); };
-    return sf::Color(to_8bit(color.r), to_8bit(color.g), to_8bit(color.b));
+  using Doubles  = double __attribute__((vector_size(32)));
+  using Integers = std::int64_t __attribute__((vector_size(32)));
+};
+
+template<std::size_t Lanes, bool Cubed>
+[[gnu::always_inline]] inline void
+  escape_lanes(const std::complex<double> *scaled, Escape<double> *escapes, const std::size_t max_iteration, const bool do_abs) noexcept
+{
+  using Doubles  = typename LaneVectors<Lanes>::Doubles;
+  using Integers = typename LaneVectors<Lanes>::Integers;
+
+  Doubles scaled_real{};
+  Doubles scaled_imag{};
+  for (std::size_t lane = 0; lane < Lanes; ++lane) {
+    scaled_real[lane] = std::real(scaled[lane]);
+    scaled_imag[lane] = std::imag(scaled[lane]);
+  }
+
+  // the counts are kept as doubles (exact far beyond any max iteration),
+  // SSE2 has no 64 bit integer compare
+  const auto max = static_cast<double>(max_iteration);
+
+  auto real          = scaled_real;
+  auto imag          = scaled_imag;
+  Doubles iteration  = {};
+  Doubles stop       = iteration + max;
+  Integers active    = iteration < stop;
+
+  const auto any_active = [&] {
+    for (std::size_t lane = 0; lane < Lanes; ++lane) {
+      if (active[lane] != 0) { return true; }
+    }
+    return false;
   };
-  img.setPixel(t_point.x, t_point.y, to_sf_color(t_color));
+
+  // clearing the sign bit, unlike a compare and negate, also turns -0.0 into 0.0 like std::abs
+  constexpr Integers sign_clear = Integers{} + INT64_MAX;
+
+  // Lanes are selected with and/or on the masks rather than a vector ?:,
+  // which needs SSE4.1 blends and is otherwise done one lane at a time
+  const Doubles one = Doubles{} + 1.0;
+
+  while (any_active()) {
+    const auto escaped = (real * real + imag * imag > 2.0 * 2.0) & (stop == max) & active;
+    stop               = (Doubles)(((Integers)(iteration + 5.0) & escaped) | ((Integers)stop & ~escaped));
+
+    const auto a = do_abs ? (Doubles)((Integers)real & sign_clear) : real;
+    const auto b = do_abs ? (Doubles)((Integers)imag & sign_clear) : imag;
+
+    Doubles next_real;
+    Doubles next_imag;
+    if constexpr (Cubed) {
+      next_real = -3.0 * a * (b * b) + a * a * a + scaled_real;
+      next_imag = 3.0 * (a * a) * b - b * b * b + scaled_imag;
+    } else {
+      next_real = a * a - b * b + scaled_real;
+      next_imag = 2.0 * a * b + scaled_imag;
+    }
+
+    real      = (Doubles)(((Integers)next_real & active) | ((Integers)real & ~active));
+    imag      = (Doubles)(((Integers)next_imag & active) | ((Integers)imag & ~active));
+    iteration = iteration + (Doubles)((Integers)one & active);
+    active    = iteration < stop;
+  }
+
+  for (std::size_t lane = 0; lane < Lanes; ++lane) {
+    escapes[lane] = Escape<double>{ static_cast<std::size_t>(iteration[lane]), std::complex{ real[lane], imag[lane] } };
+  }
 }
 
-template<std::size_t Width, std::size_t Height> struct Image
+// Whole vectors of points go through the lanes, whatever is left over
+// through the scalar escape
+template<std::size_t Lanes>
+[[gnu::always_inline]] inline void escape_vectors(std::span<const std::complex<double>> scaled,
+                                                  std::span<Escape<double>> escapes,
+                                                  const std::size_t max_iteration,
+                                                  const double power,
+                                                  const bool do_abs) noexcept
 {
-  std::array<Color<double>, Width * Height> colors;
+  std::size_t index = 0;
+  for (; index + Lanes <= scaled.size(); index += Lanes) {
+    if (power == 3.0) {
+      escape_lanes<Lanes, true>(&scaled[index], &escapes[index], max_iteration, do_abs);
+    } else {
+      escape_lanes<Lanes, false>(&scaled[index], &escapes[index], max_iteration, do_abs);
+    }
+  }
+
+  for (; index < scaled.size(); ++index) { escapes[index] = escape(scaled[index], max_iteration, power, do_abs); }
+}
+
+#if defined(__x86_64__)
+[[gnu::target("avx2")]] void escape_avx2(std::span<const std::complex<double>> scaled,
+                                         std::span<Escape<double>> escapes,
+                                         const std::size_t max_iteration,
+                                         const double power,
+                                         const bool do_abs) noexcept
+{
+  escape_vectors<4>(scaled, escapes, max_iteration, power, do_abs);
+}
+
+// SSE2 is part of x86-64, so this needs no check
+void escape_sse2(std::span<const std::complex<double>> scaled,
+                 std::span<Escape<double>> escapes,
+                 const std::size_t max_iteration,
+                 const double power,
+                 const bool do_abs) noexcept
+{
+  escape_vectors<2>(scaled, escapes, max_iteration, power, do_abs);
+}
+#endif
+
+// Two SSE2 lanes only pay for the lockstep overhead with power 3's longer
+// arithmetic, power 2 is faster scalar (see mandelbrot bench)
+[[nodiscard]] Kernel best_kernel(const double power) noexcept
+{
+#if defined(__x86_64__)
+  static const auto has_avx2 = __builtin_cpu_supports("avx2") != 0;
+  if (has_avx2) { return Kernel::AVX2; }
+  return power == 3.0 ? Kernel::SSE2 : Kernel::Scalar;
+#else
+  static_cast<void>(power);
+  return Kernel::Scalar;
+#endif
+}
+
+void escape_points(const Kernel kernel,
+                   std::span<const std::complex<double>> scaled,
+                   std::span<Escape<double>> escapes,
+                   const std::size_t max_iteration,
+                   const double power,
+                   const bool do_abs) noexcept
+{
+  assert(scaled.size() == escapes.size());
+
+  if (power == 2.0 || power == 3.0) {
+    switch (kernel) {
+#if defined(__x86_64__)
+    case Kernel::AVX2: escape_avx2(scaled, escapes, max_iteration, power, do_abs); return;
+    case Kernel::SSE2: escape_sse2(scaled, escapes, max_iteration, power, do_abs); return;
+#endif
+    default: break;
+    }
+  }
+
+  for (std::size_t index = 0; index < scaled.size(); ++index) { escapes[index] = escape(scaled[index], max_iteration, power, do_abs); }
+}
 
-  const auto &operator[](const std::pair<std::size_t, std::size_t> &loc) const { return colors[loc.second * Width + loc.first]; }
-  auto &operator[](const std::pair<std::size_t, std::size_t> &loc) { return colors[loc.second * Width + loc.first]; }
+// Past this scale a double can't tell neighboring pixels apart any more
+constexpr double deep_zoom_scale = 1e-10;
+
+[[nodiscard]] constexpr bool is_deep_zoom(const Settings &settings) noexcept
+{
+  return settings.scale < deep_zoom_scale && settings.power == 2.0 && settings.do_abs == false;
+}
+
+// Deep zoom by perturbation: only the orbit of the view's center, Z, is
+// iterated in double-double. A pixel at c = C + dc only follows its
+// difference from it, z = Z + dz, in double:
+//
+//   dz' = 2 Z dz + dz^2 + dc
+//
+// which stays accurate because dz and dc are small. When z gets closer to
+// zero than dz (or Z runs out) the pixel rebases onto the start of the
+// orbit, dz = z, which avoids the glitches a single reference causes.
+//
+// The first iterations are skipped with the cubic series
+//
+//   dz_n = A_n dc + B_n dc^2 + C_n dc^3
+//
+// for as long as it is accurate for every pixel of the view.
+class ReferenceOrbit
+{
+public:
+  // How far the third order term may grow relative to the first
+  static constexpr double series_tolerance = 1e-12;
+
+  ReferenceOrbit(const Settings &settings, const Size size)
+  {
+    const DoubleDouble center_x{ settings.center.x, settings.center_low.x };
+    const DoubleDouble center_y{ settings.center.y, settings.center_low.y };
+
+    // orbit[n] is Z_n, from Z_0 = 0, Z_1 = C; the escape starts from z_1 = c
+    orbit.emplace_back(0.0, 0.0);
+    auto x = center_x;
+    auto y = center_y;
+    orbit.emplace_back(x.to_double(), y.to_double());
+
+    while (orbit.size() < 3 || (orbit.size() < settings.cur_max_iterations + 2 && std::norm(orbit.back()) <= 2.0 * 2.0)) {
+      const auto xy = x * y;
+      x             = x * x - y * y + center_x;
+      y             = xy + xy + center_y;
+      orbit.emplace_back(x.to_double(), y.to_double());
+    }
+
+    // the pixel farthest from the center, in the corners
+    const auto radius = std::hypot(settings.scale, settings.scale * size.height / size.width) / 2.0;
+
+    std::complex<double> a{ 1.0 };
+    std::complex<double> b{};
+    std::complex<double> c{};
+
+    for (std::size_t n = 1; n + 2 < orbit.size() && n + 1 < settings.cur_max_iterations; ++n) {
+      const auto twice_z = 2.0 * orbit[n];
+      const auto next_a  = twice_z * a + 1.0;
+      const auto next_b  = twice_z * b + a * a;
+      const auto next_c  = twice_z * c + 2.0 * a * b;
+
+      // no pixel may escape during the skipped iterations either
+      if (std::abs(next_c) * radius * radius > series_tolerance * std::abs(next_a)
+          || std::abs(orbit[n + 1]) + 2.0 * std::abs(next_a) * radius > 2.0) {
+        break;
+      }
+
+      a       = next_a;
+      b       = next_b;
+      c       = next_c;
+      skipped = n + 1;
+    }
+
+    series = { a, b, c };
+  }
+
+  // Same result as escape() on C + delta, with delta the offset from the
+  // view's center
+  [[nodiscard]] Escape<double> escape(const std::complex<double> delta, const std::size_t max_iteration) const noexcept
+  {
+    const auto multiply = [](const double a_real, const double a_imag, const double b_real, const double b_imag) {
+      return std::pair{ a_real * b_real - a_imag * b_imag, a_real * b_imag + a_imag * b_real };
+    };
+
+    const auto delta_real = std::real(delta);
+    const auto delta_imag = std::imag(delta);
+
+    // dz = ((C dc + B) dc + A) dc
+    auto [real, imag] = multiply(std::real(series[2]), std::imag(series[2]), delta_real, delta_imag);
+    std::tie(real, imag) = multiply(real + std::real(series[1]), imag + std::imag(series[1]), delta_real, delta_imag);
+    std::tie(real, imag) = multiply(real + std::real(series[0]), imag + std::imag(series[0]), delta_real, delta_imag);
+
+    auto reference      = skipped;
+    auto iteration      = skipped - 1;
+    auto stop_iteration = max_iteration;
+
+    while (iteration < stop_iteration) {
+      const auto z_real = std::real(orbit[reference]) + real;
+      const auto z_imag = std::imag(orbit[reference]) + imag;
+      if (z_real * z_real + z_imag * z_imag > (2.0 * 2.0) && stop_iteration == max_iteration) { stop_iteration = iteration + 5; }
+
+      // dz' = (2 Z + dz) dz + dc
+      const auto [next_real, next_imag] = multiply(2.0 * std::real(orbit[reference]) + real, 2.0 * std::imag(orbit[reference]) + imag, real, imag);
+      real = next_real + delta_real;
+      imag = next_imag + delta_imag;
+
+      ++reference;
+      ++iteration;
+
+      const auto next_z_real = std::real(orbit[reference]) + real;
+      const auto next_z_imag = std::imag(orbit[reference]) + imag;
+      if (reference + 1 == orbit.size() || next_z_real * next_z_real + next_z_imag * next_z_imag < real * real + imag * imag) {
+        real      = next_z_real;
+        imag      = next_z_imag;
+        reference = 0;
+      }
+    }
+
+    return Escape<double>{ iteration, orbit[reference] + std::complex{ real, imag } };
+  }
+
+  [[nodiscard]] std::size_t skipped_iterations() const noexcept { return skipped - 1; }
+
+private:
+  std::vector<std::complex<double>> orbit;
+  std::array<std::complex<double>, 3> series{};
+  std::size_t skipped = 1;
+};
+
+// 8 bits per channel, laid out the way sf::Texture::update reads pixels
+struct Rgba8
+{
+  std::uint8_t r{};
+  std::uint8_t g{};
+  std::uint8_t b{};
+  std::uint8_t a{ 255 };
+};
+
+static_assert(sizeof(Rgba8) == 4);
+
+template<typename ColorType> constexpr Rgba8 to_rgba8(const Color<ColorType> &t_color) noexcept
+{
+  const auto to_8bit = [](const auto &f) { return static_cast<std::uint8_t>(std::floor(f * 255)); };
+  return Rgba8{ to_8bit(t_color.r), to_8bit(t_color.g), to_8bit(t_color.b) };
+}
+
+template<std::size_t Width, std::size_t Height, typename Pixel = Rgba8> struct Image
+{
+  std::array<Pixel, Width * Height> pixels;
+
+  const auto &operator[](const std::pair<std::size_t, std::size_t> &loc) const { return pixels[loc.second * Width + loc.first]; }
+  auto &operator[](const std::pair<std::size_t, std::size_t> &loc) { return pixels[loc.second * Width + loc.first]; }
+
+  [[nodiscard]] static constexpr Size size() noexcept { return { Width, Height }; }
+  [[nodiscard]] const std::uint8_t *data() const noexcept { return reinterpret_cast<const std::uint8_t *>(pixels.data()); }
   //  auto &operator
 };
 
-template<std::size_t Width, std::size_t Height> constexpr auto get_indicies()
+// The same for a size only known at runtime
+template<typename Pixel = Rgba8> struct DynamicImage
 {
-  std::array<std::pair<std::size_t, std::size_t>, Width * Height> indicies{};
-  std::generate(begin(indicies), end(indicies), [index = begin(Size{ Width, Height })]() mutable { return *(index++); });
-  return indicies;
+  Size dimensions;
+  std::vector<Pixel> pixels = std::vector<Pixel>(std::size_t{ dimensions.width } * dimensions.height);
+
+  const auto &operator[](const std::pair<std::size_t, std::size_t> &loc) const { return pixels[loc.second * dimensions.width + loc.first]; }
+  auto &operator[](const std::pair<std::size_t, std::size_t> &loc) { return pixels[loc.second * dimensions.width + loc.first]; }
+
+  [[nodiscard]] constexpr Size size() const noexcept { return dimensions; }
+};
+
+// Lock free hand off from one writer thread to one reader thread. Of the
+// three buffers the writer owns one, the reader owns one and the third
+// holds the latest published value; either side takes ownership of that
+// one with a single atomic exchange of indices, so neither ever waits or
+// copies. A published buffer is never written again until the writer has
+// published once more.
+template<typename T> class TripleBuffer
+{
+public:
+  // writer
+  [[nodiscard]] T &back() noexcept { return buffers[back_index]; }
+  void publish() noexcept { back_index = middle.exchange(back_index | fresh, std::memory_order_acq_rel) & index_mask; }
+
+  // reader
+  [[nodiscard]] const T &front() const noexcept { return buffers[front_index]; }
+  [[nodiscard]] bool has_update() const noexcept { return (middle.load(std::memory_order_relaxed) & fresh) != 0; }
+
+  // swaps in the latest published value, if there is one the reader hasn't seen
+  bool update() noexcept
+  {
+    if (!has_update()) { return false; }
+    front_index = middle.exchange(front_index, std::memory_order_acq_rel) & index_mask;
+    return true;
+  }
+
+private:
+  static constexpr unsigned index_mask = 0b011;
+  static constexpr unsigned fresh      = 0b100;
+
+  std::array<T, 3> buffers{};
+  unsigned back_index = 0;
+  std::atomic<unsigned> middle{ 1 };
+  unsigned front_index = 2;
+};
+
+// The image is rendered in square tiles, a tile is the unit of work and
+// how often the renderer checks for new settings
+constexpr std::size_t tile_size = 64;
+
+// Progressive passes, coarse to fine: a quick preview where each 8x8 block
+// takes the color of its top left pixel, then every pixel
+constexpr std::array<std::size_t, 2> block_sizes{ 8, 1 };
+
+struct Tile
+{
+  std::size_t x{};
+  std::size_t y{};
+  std::size_t width{};
+  std::size_t height{};
+};
+
+[[nodiscard]] std::vector<Tile> get_tiles(const Size size)
+{
+  const auto columns = (size.width + tile_size - 1) / tile_size;
+  const auto rows    = (size.height + tile_size - 1) / tile_size;
+
+  std::vector<Tile> tiles(columns * rows);
+  for (std::size_t row = 0; row < rows; ++row) {
+    for (std::size_t column = 0; column < columns; ++column) {
+      const auto x                  = column * tile_size;
+      const auto y                  = row * tile_size;
+      tiles[row * columns + column] = Tile{ x, y, std::min(tile_size, size.width - x), std::min(tile_size, size.height - y) };
+    }
+  }
+  return tiles;
 }
 
-template<std::size_t Width, std::size_t Height> void run(Image<Width, Height> *img, const Settings *global_settings)
+// A pixel's escape and the color it was given
+struct Rendered
+{
+  Escape<double> escape{};
+  Rgba8 color{};
+};
+
+// Every pixel of a frame, kept by the worker
+template<std::size_t Width, std::size_t Height> using RenderedPixels = Image<Width, Height, Rendered>;
+
+// A pan by whole pixels: pixel (x, y) of the new frame is pixel
+// (x + shift.x, y + shift.y) of the old one
+struct Shift
 {
-  auto localImg              = std::make_unique<Image<Width, Height>>(*img);
-  auto settings              = *global_settings;
-  static constexpr auto indicies = get_indicies<Width, Height>();
+  std::ptrdiff_t x{};
+  std::ptrdiff_t y{};
+};
+
+// If nothing but the center changed, by whole pixels and less than a
+// frame, how far the view moved
+template<std::size_t Width, std::size_t Height>
+[[nodiscard]] std::optional<Shift> get_shift(const Settings &previous, const Settings &current) noexcept
+{
+  auto moved       = current;
+  moved.center     = previous.center;
+  moved.center_low = previous.center_low;
+  if (!(moved == previous)) { return std::nullopt; }
+
+  const auto pixels = [](const double from, const double from_low, const double to, const double to_low, const double pixel_size, const std::size_t extent) {
+    const auto offset = (DoubleDouble{ to, to_low } - DoubleDouble{ from, from_low }).to_double() / pixel_size;
+    const auto whole  = std::round(offset);
+    return std::abs(offset - whole) < 1e-3 && std::abs(whole) < static_cast<double>(extent) ? std::optional{ static_cast<std::ptrdiff_t>(whole) }
+                                                                                            : std::nullopt;
+  };
+
+  const auto x = pixels(previous.center.x, previous.center_low.x, current.center.x, current.center_low.x, current.scale / Width, Width);
+  const auto y = pixels(previous.center.y, previous.center_low.y, current.center.y, current.center_low.y, current.scale / Width, Height);
+  if (!x || !y) { return std::nullopt; }
+  return Shift{ *x, *y };
+}
+
+// Renders one pass of a tile, recording every computed pixel. Pixels that
+// were already computed by the previous (coarser) pass are taken from
+// those, and when the view was panned, pixels that were on screen before
+// are copied from the last complete frame, exactly even in a coarse pass.
+template<typename Pixels, typename FramePixels>
+void render_tile(Pixels &img,
+                 FramePixels &frame,
+                 const std::type_identity_t<FramePixels> *panned_from,
+                 const Shift shift,
+                 const Tile &tile,
+                 const std::size_t block_size,
+                 const std::size_t previous_block_size,
+                 const Settings &settings,
+                 const ReferenceOrbit *reference)
+{
+  const auto size = img.size();
+
+  const auto fill_block = [&](const std::size_t x, const std::size_t y, const Rgba8 color) {
+    for (std::size_t block_y = y; block_y < std::min(y + block_size, tile.y + tile.height); ++block_y) {
+      for (std::size_t block_x = x; block_x < std::min(x + block_size, tile.x + tile.width); ++block_x) {
+        img[{ block_x, block_y }] = color;
+      }
+    }
+  };
+
+  // where this pixel was before the pan, if it was on screen
+  const auto panned_source = [&](const std::size_t x, const std::size_t y) -> const Rendered * {
+    if (!panned_from) { return nullptr; }
+    const auto from_x = static_cast<std::size_t>(static_cast<std::ptrdiff_t>(x) + shift.x);
+    const auto from_y = static_cast<std::size_t>(static_cast<std::ptrdiff_t>(y) + shift.y);
+    return from_x < size.width && from_y < size.height ? &(*panned_from)[{ from_x, from_y }] : nullptr;
+  };
+
+  const auto copy_panned_block = [&](const std::size_t x, const std::size_t y) {
+    for (std::size_t block_y = y; block_y < std::min(y + block_size, tile.y + tile.height); ++block_y) {
+      for (std::size_t block_x = x; block_x < std::min(x + block_size, tile.x + tile.width); ++block_x) {
+        if (const auto *source = panned_source(block_x, block_y)) { img[{ block_x, block_y }] = source->color; }
+      }
+    }
+  };
+
+  const auto kernel = best_kernel(settings.power);
+
+  // one row of the tile's samples at a time goes through the kernel
+  std::array<std::size_t, tile_size> columns{};
+  std::array<std::complex<double>, tile_size> scaled{};
+  std::array<Escape<double>, tile_size> escapes{};
+
+  for (std::size_t y = tile.y; y < tile.y + tile.height; y += block_size) {
+    std::size_t count = 0;
+    for (std::size_t x = tile.x; x < tile.x + tile.width; x += block_size) {
+      if (previous_block_size != 0 && x % previous_block_size == 0 && y % previous_block_size == 0) {
+        fill_block(x, y, frame[{ x, y }].color);
+      } else if (const auto *source = panned_source(x, y)) {
+        frame[{ x, y }] = *source;
+        fill_block(x, y, source->color);
+      } else {
+        columns[count] = x;
+        // relative to the view's center for the reference orbit
+        scaled[count] = get_scaled(Point{ x, y }, reference ? Point{ 0.0, 0.0 } : settings.center, size, settings.scale);
+        ++count;
+        continue;
+      }
+
+      if (block_size > 1) { copy_panned_block(x, y); }
+    }
+
+    if (reference) {
+      for (std::size_t index = 0; index < count; ++index) { escapes[index] = reference->escape(scaled[index], settings.cur_max_iterations); }
+    } else {
+      escape_points(kernel,
+                    std::span{ scaled }.first(count),
+                    std::span{ escapes }.first(count),
+                    settings.cur_max_iterations,
+                    settings.power,
+                    settings.do_abs);
+    }
+
+    for (std::size_t index = 0; index < count; ++index) {
+      const auto x = columns[index];
+      frame[{ x, y }] = Rendered{ escapes[index], to_rgba8(get_color(escapes[index], settings.cur_max_iterations, settings.power)) };
+      fill_block(x, y, frame[{ x, y }].color);
+      if (block_size > 1) { copy_panned_block(x, y); }
+    }
+  }
+}
+
+// Each finished pass is published as a whole image, an abandoned one
+// never is
+template<std::size_t Width, std::size_t Height>
+void run(TripleBuffer<Image<Width, Height>> *images, TripleBuffer<Settings> *global_settings)
+{
+  static const auto tiles = get_tiles(Size{ Width, Height });
+
+  global_settings->update();
+  auto settings = global_settings->front();
+
+  // checked between tiles, so a change waits for at most one tile per
+  // thread rather than the rest of the frame
+  const auto outdated = [&] { return global_settings->has_update(); };
+
+  // the pixels of the frame being rendered, and of the last complete one
+  // with the settings it was rendered with
+  auto frames          = std::make_unique<std::array<RenderedPixels<Width, Height>, 2>>();
+  auto *frame          = &(*frames)[0];
+  auto *complete_frame = &(*frames)[1];
+  std::optional<Settings> complete_settings;
 
   while (!settings.canceling) {
-    constexpr Size size{ Width, Height };
-    transform(std::execution::par_unseq, begin(indicies), end(indicies), begin(localImg->colors), [=](const auto &location) {
-      return get_color(Point{ location.first, location.second },
-                       settings.center,
-                       size,
-                       settings.scale,
-                       settings.cur_max_iterations,
-                       settings.power,
-                       settings.do_abs);
-    });
+    const auto reference = is_deep_zoom(settings) ? std::optional<ReferenceOrbit>{ std::in_place, settings, Size{ Width, Height } } : std::nullopt;
+
+    // after a pan the coarse pass already shows everything still on screen
+    // at full resolution, only the newly exposed strips start out coarse
+    const auto shift       = complete_settings ? get_shift<Width, Height>(*complete_settings, settings) : std::nullopt;
+    const auto panned_from = shift ? complete_frame : nullptr;
+
+    bool complete                   = true;
+    std::size_t previous_block_size = 0;
+    for (const auto block_size : block_sizes) {
+      auto &img = images->back();
+      std::for_each(std::execution::par, begin(tiles), end(tiles), [&](const Tile &tile) {
+        if (!outdated()) {
+          render_tile(img,
+                      *frame,
+                      panned_from,
+                      shift.value_or(Shift{}),
+                      tile,
+                      block_size,
+                      previous_block_size,
+                      settings,
+                      reference ? &*reference : nullptr);
+        }
+      });
+
+      if (outdated()) {
+        complete = false;
+        break;
+      }
+
+      images->publish();
+      previous_block_size = block_size;
+    }
 
-    settings = *global_settings;
-    *img     = *localImg;
+    if (complete) {
+      complete_settings = settings;
+      std::swap(frame, complete_frame);
+    }
+
+    // the frame is done (or abandoned), wait for something to change
+    while (!outdated()) { std::this_thread::sleep_for(std::chrono::milliseconds(1)); }
+    global_settings->update();
+    settings = global_settings->front();
   }
 }
 
 constexpr static Size size{ 640u, 640u };
 
+// Equal, counting any NaN as equal to any other (points far outside the
+// set overflow into them)
+[[nodiscard]] bool same_escape(const Escape<double> &lhs, const Escape<double> &rhs) noexcept
+{
+  const auto same = [](const double a, const double b) { return a == b || (std::isnan(a) && std::isnan(b)); };
+  return lhs.iteration == rhs.iteration && same(std::real(lhs.current), std::real(rhs.current))
+         && same(std::imag(lhs.current), std::imag(rhs.current));
+}
+
+// Escapes every pixel of the starting view with each kernel, checking the
+// vector kernels against the scalar one
+void benchmark_kernels()
+{
+  for (const auto power : { 2.0, 3.0 }) {
+    Settings settings{};
+    settings.power = power;
+
+    std::vector<std::complex<double>> scaled;
+    for (const auto &loc : size) { scaled.push_back(get_scaled(Point{ loc.first, loc.second }, settings.center, size, settings.scale)); }
+
+    std::vector<Escape<double>> expected(scaled.size());
+    std::vector<Escape<double>> escapes(scaled.size());
+
+    const auto time_kernel = [&](const std::string_view name, const Kernel kernel, std::vector<Escape<double>> &results) {
+      const auto start = std::chrono::steady_clock::now();
+      escape_points(kernel, scaled, results, settings.cur_max_iterations, settings.power, settings.do_abs);
+      const auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+      const auto mismatches = std::count_if(begin(results), end(results), [&, index = std::size_t{ 0 }](const auto &result) mutable {
+        const auto &reference = expected[index++];
+        return !same_escape(result, reference);
+      });
+
+      std::cout << "power " << power << ' ' << name << ": " << static_cast<double>(scaled.size()) / elapsed / 1'000'000.0
+                << " Mpixels/sec, " << mismatches << " mismatches\n";
+    };
+
+    time_kernel("scalar", Kernel::Scalar, expected);
+#if defined(__x86_64__)
+    time_kernel("sse2", Kernel::SSE2, escapes);
+    if (best_kernel(power) == Kernel::AVX2) { time_kernel("avx2", Kernel::AVX2, escapes); }
+#endif
+  }
+
+#if defined(__x86_64__)
+  // Small iteration limits, where lanes that stopped at max_iteration sit
+  // next to lanes that escaped and keep going for a few more iterations
+  std::mt19937_64 random{ 42 };
+  std::uniform_real_distribution<double> coordinate{ -2.5, 2.5 };
+  std::vector<std::complex<double>> points(100'000);
+  for (auto &point : points) { point = std::complex{ coordinate(random), coordinate(random) }; }
+
+  std::vector<Escape<double>> expected(points.size());
+  std::vector<Escape<double>> escapes(points.size());
+
+  for (const auto kernel : { Kernel::SSE2, Kernel::AVX2 }) {
+    if (kernel == Kernel::AVX2 && best_kernel(2.0) != Kernel::AVX2) { continue; }
+
+    std::size_t mismatches = 0;
+    for (const auto power : { 2.0, 3.0 }) {
+      for (const auto max_iteration : { std::size_t{ 1 }, std::size_t{ 2 }, std::size_t{ 10 } }) {
+        for (const auto do_abs : { false, true }) {
+          escape_points(Kernel::Scalar, points, expected, max_iteration, power, do_abs);
+          escape_points(kernel, points, escapes, max_iteration, power, do_abs);
+          for (std::size_t index = 0; index < points.size(); ++index) {
+            if (!same_escape(escapes[index], expected[index])) { ++mismatches; }
+          }
+        }
+      }
+    }
+
+    std::cout << (kernel == Kernel::AVX2 ? "avx2" : "sse2") << " at max iterations 1, 2, 10: " << mismatches << " mismatches\n";
+  }
+#endif
+}
+
+// Perturbation against plain doubles on a view just deep enough for the
+// former, then a zoom far past what doubles can do. The view is around
+// c = i, which has structure at any depth.
+void benchmark_deep_zoom()
+{
+  Settings settings{};
+  settings.center             = Point{ 0.0, 1.0 };
+  settings.cur_max_iterations = 5000;
+
+  const auto report = [](const std::string_view name, const double scale, const double elapsed, const std::size_t iterations) {
+    std::cout << "deep zoom " << scale << ' ' << name << ": " << static_cast<double>(size.width * size.height) / elapsed / 1'000'000.0
+              << " Mpixels/sec, " << static_cast<double>(iterations) / elapsed / 1'000'000.0 << " Miterations/sec\n";
+  };
+
+  for (const auto scale : { 1e-11, 1e-30 }) {
+    settings.scale = scale;
 
-int main()
+    if (scale >= 1e-13) {
+      std::size_t iterations = 0;
+      const auto start       = std::chrono::steady_clock::now();
+      for (const auto &loc : size) {
+        iterations += escape(get_scaled(Point{ loc.first, loc.second }, settings.center, size, settings.scale), settings.cur_max_iterations, 2.0, false).iteration;
+      }
+      report("double", scale, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), iterations);
+    }
+
+    std::size_t iterations = 0;
+    const auto start       = std::chrono::steady_clock::now();
+    const ReferenceOrbit reference{ settings, size };
+    for (const auto &loc : size) {
+      iterations += reference.escape(get_scaled(Point{ loc.first, loc.second }, Point{ 0.0, 0.0 }, size, settings.scale), settings.cur_max_iterations).iteration;
+    }
+    report("perturbation", scale, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), iterations);
+    std::cout << "  " << reference.skipped_iterations() << " iterations skipped by series approximation\n";
+  }
+}
+
+// Decimal to double-double, so keyframes can hold centers deeper than a
+// double can: [-]digits[.digits][e[-]digits]
+[[nodiscard]] std::optional<DoubleDouble> parse_double_double(const std::string_view text) noexcept
 {
+  const auto negative = !text.empty() && text.front() == '-';
+  const auto mantissa_end = text.find_first_of("eE");
+  const auto mantissa     = text.substr(negative ? 1 : 0, mantissa_end == std::string_view::npos ? std::string_view::npos : mantissa_end - (negative ? 1 : 0));
+
+  DoubleDouble value{};
+  int exponent           = 0;
+  bool seen_point        = false;
+  std::size_t digit_count = 0;
+  for (const auto c : mantissa) {
+    if (c == '.' && !seen_point) {
+      seen_point = true;
+    } else if (c >= '0' && c <= '9') {
+      value = value * DoubleDouble{ 10.0 } + DoubleDouble{ static_cast<double>(c - '0') };
+      if (seen_point) { --exponent; }
+      ++digit_count;
+    } else {
+      return std::nullopt;
+    }
+  }
+  if (digit_count == 0) { return std::nullopt; }
+
+  if (mantissa_end != std::string_view::npos) {
+    auto exponent_text = text.substr(mantissa_end + 1);
+    const auto negative_exponent = !exponent_text.empty() && exponent_text.front() == '-';
+    if (negative_exponent || (!exponent_text.empty() && exponent_text.front() == '+')) { exponent_text.remove_prefix(1); }
+    if (exponent_text.empty()) { return std::nullopt; }
+
+    int explicit_exponent = 0;
+    for (const auto c : exponent_text) {
+      if (c < '0' || c > '9' || explicit_exponent > 1000) { return std::nullopt; }
+      explicit_exponent = explicit_exponent * 10 + (c - '0');
+    }
+    exponent += negative_exponent ? -explicit_exponent : explicit_exponent;
+  }
+
+  DoubleDouble power_of_ten{ 1.0 };
+  for (int count = 0; count < std::abs(exponent); ++count) { power_of_ten = power_of_ten * DoubleDouble{ 10.0 }; }
+  value = exponent < 0 ? value / power_of_ten : value * power_of_ten;
+
+  return negative ? DoubleDouble{ -value.hi, -value.lo } : value;
+}
+
+// One keyframe per line, blank lines and lines starting with # are
+// skipped:
+//
+//   center_x center_y scale power iterations
+[[nodiscard]] std::optional<std::vector<Settings>> read_keyframes(const std::string &path)
+{
+  std::ifstream file(path);
+  if (!file) {
+    std::cerr << "unable to open keyframes '" << path << "'\n";
+    return std::nullopt;
+  }
+
+  std::vector<Settings> keyframes;
+  std::string line;
+  for (std::size_t line_number = 1; std::getline(file, line); ++line_number) {
+    if (line.empty() || line.front() == '#') { continue; }
+
+    std::istringstream fields(line);
+    std::string center_x;
+    std::string center_y;
+    Settings settings{};
+    fields >> center_x >> center_y >> settings.scale >> settings.power >> settings.cur_max_iterations;
+
+    const auto x = parse_double_double(center_x);
+    const auto y = parse_double_double(center_y);
+    if (!fields || !x || !y || settings.scale <= 0.0 || settings.cur_max_iterations == 0) {
+      std::cerr << path << ':' << line_number << ": expected 'center_x center_y scale power iterations'\n";
+      return std::nullopt;
+    }
+
+    settings.center     = Point{ x->hi, y->hi };
+    settings.center_low = Point{ x->lo, y->lo };
+    keyframes.push_back(settings);
+  }
+
+  return keyframes;
+}
+
+// A whole frame at full resolution on all cores
+[[nodiscard]] DynamicImage<> render_frame(const Settings &settings, const Size size)
+{
+  DynamicImage<> img{ size };
+  DynamicImage<Rendered> frame{ size };
+
+  const auto reference = is_deep_zoom(settings) ? std::optional<ReferenceOrbit>{ std::in_place, settings, size } : std::nullopt;
+  const auto tiles     = get_tiles(size);
+
+  std::for_each(std::execution::par, begin(tiles), end(tiles), [&](const Tile &tile) {
+    render_tile(img, frame, nullptr, Shift{}, tile, 1, 0, settings, reference ? &*reference : nullptr);
+  });
+
+  return img;
+}
+
+// Binary PPM, which needs no image library
+[[nodiscard]] bool write_ppm(const std::string &path, const DynamicImage<> &img)
+{
+  std::ofstream file(path, std::ios::binary);
+  file << "P6\n" << img.size().width << ' ' << img.size().height << "\n255\n";
+  for (const auto &pixel : img.pixels) { file << pixel.r << pixel.g << pixel.b; }
+  return static_cast<bool>(file);
+}
+
+int render_keyframes(const std::string &keyframes_path, const Size size, const std::string &output_prefix)
+{
+  const auto keyframes = read_keyframes(keyframes_path);
+  if (!keyframes) { return EXIT_FAILURE; }
+
+  const auto start = std::chrono::steady_clock::now();
+
+  for (std::size_t index = 0; index < keyframes->size(); ++index) {
+    std::ostringstream path;
+    path << output_prefix << std::setw(4) << std::setfill('0') << index << ".ppm";
+
+    if (!write_ppm(path.str(), render_frame((*keyframes)[index], size))) {
+      std::cerr << "unable to write '" << path.str() << "'\n";
+      return EXIT_FAILURE;
+    }
+  }
+
+  const auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  std::cout << keyframes->size() << " frames of " << size.width << 'x' << size.height << " in " << elapsed << "s, "
+            << static_cast<double>(keyframes->size()) / elapsed << " frames/sec\n";
+
+  return EXIT_SUCCESS;
+}
+
+// A width or height on the command line, 1 to 65536 pixels
+[[nodiscard]] std::optional<unsigned int> parse_dimension(const std::string_view text) noexcept
+{
+  unsigned int value{};
+  const auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+  if (error != std::errc{} || end != text.data() + text.size() || value == 0 || value > 65536) { return std::nullopt; }
+  return value;
+}
+
+// A frame takes a color and a Rendered for every pixel at once, this keeps
+// that to a couple of GB (8192x8192 or the same area in any other shape)
+constexpr std::size_t max_render_pixels = std::size_t{ 1 } << 26;
+
+void print_usage(const std::string_view program)
+{
+  std::cerr << "usage: " << program << " bench\n"
+            << "       " << program << " render <keyframes> <width> <height> <output prefix>\n"
+            << "       (width x height at most " << max_render_pixels << " pixels)\n";
+}
+
+int main(int argc, const char *argv[])
+{
+  // mandelbrot bench
+  if (argc > 1 && std::string_view{ argv[1] } == "bench") {
+    benchmark_kernels();
+    benchmark_deep_zoom();
+    return 0;
+  }
+
+  // mandelbrot render <keyframes> <width> <height> <output prefix>
+  if (argc > 1 && std::string_view{ argv[1] } == "render") {
+    const auto width  = argc == 6 ? parse_dimension(argv[3]) : std::nullopt;
+    const auto height = argc == 6 ? parse_dimension(argv[4]) : std::nullopt;
+    if (!width || !height || std::size_t{ *width } * *height > max_render_pixels) {
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+    return render_keyframes(argv[2], Size{ *width, *height }, argv[5]);
+  }
+
+#ifdef MANDELBROT_HEADLESS
+  print_usage(argv[0]);
+  return EXIT_FAILURE;
+#else
   sf::RenderWindow window(sf::VideoMode(640u, 640u), "Tilemap");
   window.setVerticalSyncEnabled(true);
   window.display();
 
 
-  sf::Image img;
-  img.create(size.width, size.height);
   sf::Texture texture;
+  texture.create(size.width, size.height);
   sf::Sprite bufferSprite(texture);
-  texture.loadFromImage(img);
 
 
   bufferSprite.setTexture(texture);
@@ -237,29 +1193,35 @@ int main()
 
   Settings settings{};
 
-  auto img_colors = std::make_unique<Image<640u, 640u>>();
+  auto images          = std::make_unique<TripleBuffer<Image<640u, 640u>>>();
+  auto settings_buffer = std::make_unique<TripleBuffer<Settings>>();
 
-  std::thread worker(run<640u, 640u>, img_colors.get(), &settings);
+  // only changes are published, any update tells the worker to start over
+  const auto publish_settings = [&] {
+    settings_buffer->back() = settings;
+    settings_buffer->publish();
+  };
 
-  while (window.isOpen()) {
-    const auto img_copy = std::make_unique<Image<640u, 640u>>(*img_colors);
-    for (const auto &loc : size) { set_pixel(img, Point{ loc.first, loc.second }, (*img_copy)[loc]); }
+  publish_settings();
 
-    texture.loadFromImage(img);
+  std::thread worker(run<640u, 640u>, images.get(), settings_buffer.get());
+
+  while (window.isOpen()) {
+    if (images->update()) { texture.update(images->front().data()); }
 
     window.draw(bufferSprite);
     window.display();
 
-    settings = [settings = Settings(settings)]() mutable {
+    const auto next_settings = [settings = Settings(settings)]() mutable {
       if (sf::Keyboard::isKeyPressed(sf::Keyboard::PageUp)) { settings.scale *= 0.9; }
       if (sf::Keyboard::isKeyPressed(sf::Keyboard::PageDown)) { settings.scale *= 1.1; }
       auto move_offset = settings.scale / 640;
 
       if (sf::Keyboard::isKeyPressed(sf::Keyboard::LShift)) { move_offset *= 10; }
-      if (sf::Keyboard::isKeyPressed(sf::Keyboard::Left)) { settings.center.x -= move_offset; }
-      if (sf::Keyboard::isKeyPressed(sf::Keyboard::Right)) { settings.center.x += move_offset; }
-      if (sf::Keyboard::isKeyPressed(sf::Keyboard::Up)) { settings.center.y -= move_offset; }
-      if (sf::Keyboard::isKeyPressed(sf::Keyboard::Down)) { settings.center.y += move_offset; }
+      if (sf::Keyboard::isKeyPressed(sf::Keyboard::Left)) { move_center(settings, -move_offset, 0.0); }
+      if (sf::Keyboard::isKeyPressed(sf::Keyboard::Right)) { move_center(settings, move_offset, 0.0); }
+      if (sf::Keyboard::isKeyPressed(sf::Keyboard::Up)) { move_center(settings, 0.0, -move_offset); }
+      if (sf::Keyboard::isKeyPressed(sf::Keyboard::Down)) { move_center(settings, 0.0, move_offset); }
       if (sf::Keyboard::isKeyPressed(sf::Keyboard::P)) {
         if (sf::Keyboard::isKeyPressed(sf::Keyboard::LShift)) {
           settings.power += 0.1;
@@ -271,10 +1233,15 @@ int main()
 
       return settings;
     }();
+
+    if (!(next_settings == settings)) {
+      settings = next_settings;
+      publish_settings();
+    }
   }
 
-  Settings canceling  = settings;
-  canceling.canceling = true;
-  settings            = canceling;
+  settings.canceling = true;
+  publish_settings();
   worker.join();
+#endif
 }